@@ -0,0 +1,115 @@
+/**
+ * File:     iexec-preload
+ * Purpose:  A shim that iexec preloads into a program to lock and/or
+ *           prefault its memory before main() runs (--mlockall,
+ *           --prefault), which cannot be done from before execve().
+ *
+ * Author:   Damian Eads
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <error.h>
+
+/** Older headers lack the populating madvise() advice (Linux 5.14). */
+#ifndef MADV_POPULATE_READ
+#define MADV_POPULATE_READ 22
+#endif
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+/**
+ * Parses the IEXEC_MLOCKALL list of current, future and onfault into
+ * MCL_* flags.
+ *
+ * @param flags  The comma-separated list.
+ */
+int iexec_preload_parse_mlockall(const char *flags) {
+  int result = 0;
+  while (*flags != 0) {
+    size_t len = strcspn(flags, ",");
+    if (len == 7 && strncmp(flags, "current", len) == 0) {
+      result |= MCL_CURRENT;
+    } else if (len == 6 && strncmp(flags, "future", len) == 0) {
+      result |= MCL_FUTURE;
+    } else if (len == 7 && strncmp(flags, "onfault", len) == 0) {
+      result |= MCL_ONFAULT;
+    } else {
+      error(0, 0, "iexec-preload: unknown mlockall flag `%.*s'", (int)len, flags);
+      _exit(EXIT_FAILURE);
+    }
+    flags += len + (flags[len] == ',');
+  }
+  return result;
+}
+
+/**
+ * Faults in every readable mapping listed in /proc/self/maps, writable
+ * private ones for writing so that their copy-on-write is done too.
+ * Mappings that cannot be populated (eg device memory) are skipped.
+ */
+void iexec_preload_prefault(void) {
+  FILE *maps = fopen("/proc/self/maps", "re");
+  if (maps == 0) {
+    error(0, errno, "iexec-preload: unable to open /proc/self/maps");
+    return;
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), maps) != 0) {
+    unsigned long start, end;
+    char perms[5];
+    if (sscanf(line, "%lx-%lx %4s", &start, &end, perms) != 3 || perms[0] != 'r') {
+      continue;
+    }
+    /** The vsyscall page lies outside the address space madvise()
+        accepts. */
+    if (strstr(line, "[vsyscall]") != 0 || strstr(line, "[vvar") != 0) {
+      continue;
+    }
+    int advice = perms[1] == 'w' && perms[3] == 'p' ? MADV_POPULATE_WRITE : MADV_POPULATE_READ;
+    madvise((void *)start, end - start, advice);
+  }
+  fclose(maps);
+}
+
+/**
+ * Runs before the program's main(): locks its memory as IEXEC_MLOCKALL
+ * says and prefaults it if IEXEC_PREFAULT is set, then removes these
+ * variables and itself (the first entry of LD_PRELOAD, where iexec puts
+ * it) from the environment so the program's own children go without.
+ * Exits if the memory cannot be locked.
+ */
+__attribute__((constructor))
+void iexec_preload(void) {
+  const char *mlockall_flags = getenv("IEXEC_MLOCKALL");
+  const char *prefault = getenv("IEXEC_PREFAULT");
+
+  if (mlockall_flags != 0 && mlockall_flags[0] != 0) {
+    if (mlockall(iexec_preload_parse_mlockall(mlockall_flags)) < 0) {
+      error(0, errno, "iexec-preload: unable to lock memory (see --rlimit-memlock-soft)");
+      _exit(EXIT_FAILURE);
+    }
+  }
+  if (prefault != 0 && prefault[0] != 0 && strcmp(prefault, "0") != 0) {
+    iexec_preload_prefault();
+  }
+
+  unsetenv("IEXEC_MLOCKALL");
+  unsetenv("IEXEC_PREFAULT");
+  const char *preload = getenv("LD_PRELOAD");
+  if (preload != 0) {
+    const char *rest = preload + strcspn(preload, " :");
+    rest += strspn(rest, " :");
+    if (*rest == 0) {
+      unsetenv("LD_PRELOAD");
+    } else {
+      setenv("LD_PRELOAD", rest, 1);
+    }
+  }
+}
@@ -0,0 +1,52 @@
+/**
+ * The layout of the compiled profiles written by iexec --compile-profiles.
+ *
+ * The file starts with an iexec_profile_header. The profiles follow as
+ * num_profiles iexec_profile_entry, sorted by name with strcmp(), and
+ * each refers to its run of iexec_profile_setting. All offsets are in
+ * bytes from the start of the file, and point at NUL-terminated strings
+ * for names and values. iexec maps the file, finds a profile with a
+ * binary search and applies its settings in order, without splitting
+ * words or looking up option names:
+ *
+ *   header | entries | settings | strings
+ *
+ * The options are the values iexec's getopt_long() returns, so a file
+ * is only read by an iexec with the same long options (see
+ * options_hash); any other iexec, or a file naming an option it does
+ * not have or with a value the option does not take, falls back to the
+ * text profiles.
+ */
+#ifndef IEXEC_PROFILE_H
+#define IEXEC_PROFILE_H
+
+#include <stdint.h>
+
+#define IEXEC_PROFILE_MAGIC 0x69657870  /* "iexp" */
+#define IEXEC_PROFILE_VERSION 2
+
+typedef struct iexec_profile_header {
+  uint32_t magic;       /** IEXEC_PROFILE_MAGIC. */
+  uint32_t version;     /** IEXEC_PROFILE_VERSION. */
+  uint32_t options_hash; /** A hash of the long options of the iexec
+                            that compiled the file. */
+  uint32_t size;        /** The size of the file. */
+  uint32_t num_profiles; /** The number of profiles. */
+  uint32_t entries;     /** The offset of the first iexec_profile_entry. */
+  uint32_t num_settings; /** The number of settings of all profiles. */
+  uint32_t settings;    /** The offset of the first iexec_profile_setting. */
+} iexec_profile_header;
+
+typedef struct iexec_profile_entry {
+  uint32_t name;        /** The offset of the name of the profile. */
+  uint32_t first_setting; /** The index of its first setting. */
+  uint32_t num_settings; /** The number of its settings. */
+  uint32_t reserved;    /** 0. */
+} iexec_profile_entry;
+
+typedef struct iexec_profile_setting {
+  int32_t option;       /** The option, as returned by getopt_long(). */
+  uint32_t value;       /** The offset of its value (0 = none). */
+} iexec_profile_setting;
+
+#endif
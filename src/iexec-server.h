@@ -0,0 +1,58 @@
+/**
+ * The protocol of the launch server started with iexec --server.
+ *
+ * A client connects to the server's SOCK_SEQPACKET UNIX socket and sends
+ * one request: an iexec_server_request followed by argc arguments and
+ * then envc environment variables, each NUL-terminated, in a single
+ * message. The arguments are those of an iexec command line, starting
+ * with the name iexec is called by:
+ *
+ *   iexec -o out.log -p app.pid -- app --port 80
+ *
+ * The message carries four descriptors with SCM_RIGHTS: the working
+ * directory the paths are relative to (O_PATH is enough), and the
+ * standard input, output and error iexec would have (where help and
+ * error messages go, and what -k keeps open).
+ *
+ * The server answers with one iexec_server_reply, carrying a pidfd of
+ * the program with SCM_RIGHTS when pid is positive and the program still
+ * runs, also when iexec exits early, as on --help, --version or an
+ * error in the options. An error is written to the standard error sent.
+ * When the connection is closed without a reply, the worker serving the
+ * request died.
+ */
+#ifndef IEXEC_SERVER_H
+#define IEXEC_SERVER_H
+
+#include <stdint.h>
+
+#define IEXEC_SERVER_MAGIC 0x69657873  /* "iexs" */
+#define IEXEC_SERVER_VERSION 1
+
+/** The largest request the server accepts, in bytes. */
+#define IEXEC_SERVER_MAX_REQUEST (256 * 1024)
+
+/** The descriptors sent with a request, in this order. */
+#define IEXEC_SERVER_FD_CWD 0
+#define IEXEC_SERVER_FD_STDIN 1
+#define IEXEC_SERVER_FD_STDOUT 2
+#define IEXEC_SERVER_FD_STDERR 3
+#define IEXEC_SERVER_NUM_FDS 4
+
+typedef struct iexec_server_request {
+  uint32_t magic;       /** IEXEC_SERVER_MAGIC. */
+  uint32_t version;     /** IEXEC_SERVER_VERSION. */
+  uint32_t argc;        /** The number of arguments that follow. */
+  uint32_t envc;        /** The number of environment variables after them. */
+  uint32_t umask;       /** The umask the program is launched with. */
+  uint32_t reserved;    /** 0. */
+} iexec_server_request;
+
+typedef struct iexec_server_reply {
+  int32_t status;       /** The exit status iexec would have exited with. */
+  int32_t pid;          /** The pid of the (first) program launched, or 0
+                            if a monitor in the background (-s) launched
+                            it. */
+} iexec_server_reply;
+
+#endif
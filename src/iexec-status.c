@@ -0,0 +1,369 @@
+/**
+ * File:     iexec-status
+ * Purpose:  Reads the status files written by iexec -s, in the text,
+ *           jsonl or mmap format, across directories of them in one
+ *           pass, and prints the state of each program and the number
+ *           of programs in each state.
+ *
+ * Author:   Damian Eads
+ */
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <error.h>
+
+#include "iexec-status.h"
+
+/** The program ran when the file was written, but its pid is gone: the
+    monitor that watched it died. */
+#define IEXEC_STATUS_LOST 8
+/** The file could not be read or holds no pid. */
+#define IEXEC_STATUS_UNREADABLE 9
+
+/** A string name for each state (indexed by constant). */
+const char *state_names[] = {
+  [IEXEC_STATUS_STARTING] = "starting",
+  [IEXEC_STATUS_RUNNING] = "running",
+  [IEXEC_STATUS_STOPPED] = "stopped",
+  [IEXEC_STATUS_EXITED] = "exited",
+  [IEXEC_STATUS_KILLED] = "killed",
+  [IEXEC_STATUS_BACKOFF] = "backoff",
+  [IEXEC_STATUS_GAVE_UP] = "gave-up",
+  [IEXEC_STATUS_ERROR] = "error",
+  [IEXEC_STATUS_LOST] = "lost",
+  [IEXEC_STATUS_UNREADABLE] = "unreadable"
+};
+
+#define IEXEC_NUM_STATES (IEXEC_STATUS_UNREADABLE + 1)
+
+/** How much of the end of a text or jsonl file is read first; the whole
+    file is read only if its last pid is not in there. */
+#define IEXEC_STATUS_TAIL_SIZE (64 * 1024)
+
+/** The fewest files that are read by several threads. */
+#define IEXEC_STATUS_PARALLEL_MIN 64
+
+/** The most threads that read files. */
+#define IEXEC_STATUS_MAX_THREADS 16
+
+/**
+ * A status file and the state of the program read from it.
+ */
+typedef struct iexec_status_entry {
+  char *path;           /** The status file. */
+  int state;            /** The state (IEXEC_STATUS_*). */
+  long long pid;        /** The pid of the last run (0 = none seen). */
+  int exit_code;        /** The exit status of the last run that exited. */
+  int signal;           /** The signal that last killed or stopped it. */
+  int restarts;         /** How many times it was restarted. */
+} iexec_status_entry;
+
+/** The files to read, and the next one a thread takes. */
+iexec_status_entry *entries = 0;
+int num_entries = 0;
+int next_entry = 0;
+
+/**
+ * Prints how to use iexec-status to standard error and exits.
+ */
+void usage() {
+  fprintf(stderr, "Usage: %s [-s] [-j threads] status-file|directory...\n"
+          "Prints the state of the programs whose status files (written by iexec -s\n"
+          "in any --status-format) are given or are in the directories given, then the\n"
+          "number of programs in each state. -s prints the numbers only. Directories\n"
+          "with many files are read by up to -j threads.\n", program_invocation_name);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Applies one event of a status file to the state of its program.
+ *
+ * @param entry The program.
+ * @param event The event, eg exit.
+ * @param value Its first value, or 0 if it has none.
+ */
+void iexec_status_apply(iexec_status_entry *entry, const char *event, long long value) {
+  if (strcmp(event, "pid") == 0) {
+    entry->state = IEXEC_STATUS_RUNNING;
+    entry->pid = value;
+  } else if (strcmp(event, "start") == 0) {
+    entry->restarts = value > 0 ? value - 1 : 0;
+  } else if (strcmp(event, "exit") == 0) {
+    entry->state = IEXEC_STATUS_EXITED;
+    entry->exit_code = value;
+  } else if (strcmp(event, "kill") == 0) {
+    entry->state = IEXEC_STATUS_KILLED;
+    entry->signal = value;
+  } else if (strcmp(event, "stop") == 0) {
+    entry->state = IEXEC_STATUS_STOPPED;
+    entry->signal = value;
+  } else if (strcmp(event, "cont") == 0) {
+    entry->state = IEXEC_STATUS_RUNNING;
+  } else if (strcmp(event, "backoff") == 0) {
+    entry->state = IEXEC_STATUS_BACKOFF;
+  } else if (strcmp(event, "giveup") == 0) {
+    entry->state = IEXEC_STATUS_GAVE_UP;
+  } else if (strcmp(event, "err") == 0) {
+    entry->state = IEXEC_STATUS_ERROR;
+  }
+}
+
+/**
+ * Applies the lines of a text or jsonl status file to the state of its
+ * program. A jsonl line is read by its "event" and the first value
+ * after it, which is how iexec writes them.
+ *
+ * @param entry  The program.
+ * @param lines  The lines, NUL-terminated.
+ */
+void iexec_status_parse(iexec_status_entry *entry, char *lines) {
+  for (char *line = lines; *line != 0; ) {
+    char *end = strchr(line, '\n');
+    if (end != 0) {
+      *end = 0;
+    }
+    char event[32];
+    long long value = 0;
+    char *json = strstr(line, "\"event\":\"");
+    if (json != 0) {
+      if (sscanf(json + 9, "%31[^\"]", event) == 1) {
+        char *colon = strchr(json + 9, ':');
+        if (colon != 0) {
+          sscanf(colon + 1, "%lld", &value);
+        }
+        iexec_status_apply(entry, event, value);
+      }
+    } else if (sscanf(line, "%31s %lld", event, &value) >= 1) {
+      iexec_status_apply(entry, event, value);
+    }
+    if (end == 0) {
+      break;
+    }
+    line = end + 1;
+  }
+}
+
+/**
+ * Reads an mmap status record, retrying while the monitor updates it.
+ *
+ * Returns 0, or a negative value if the file does not hold a record.
+ */
+int iexec_status_read_record(iexec_status_entry *entry, int fd) {
+  iexec_status_record record;
+  for (int tries = 0; tries < 100; tries++) {
+    if (pread(fd, &record, sizeof(record), 0) != sizeof(record)
+        || strcmp(record.magic, IEXEC_STATUS_MAGIC) != 0 || record.version != IEXEC_STATUS_VERSION) {
+      return -1;
+    }
+    uint64_t sequence;
+    if ((record.sequence & 1) == 0 && pread(fd, &sequence, sizeof(sequence), offsetof(iexec_status_record, sequence)) == sizeof(sequence)
+        && sequence == record.sequence) {
+      entry->state = record.state < IEXEC_NUM_STATES ? (int)record.state : IEXEC_STATUS_UNREADABLE;
+      entry->pid = record.pid;
+      entry->exit_code = record.exit_code;
+      entry->signal = record.signal;
+      entry->restarts = record.restarts;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/**
+ * Reads the state of a program from its status file: the record of an
+ * mmap file, or the lines of a text or jsonl file, from its last
+ * IEXEC_STATUS_TAIL_SIZE bytes if its last pid is in there. A program
+ * left running or stopped whose pid is gone is lost.
+ */
+void iexec_status_read(iexec_status_entry *entry) {
+  entry->state = IEXEC_STATUS_UNREADABLE;
+  entry->pid = 0;
+  entry->exit_code = 0;
+  entry->signal = 0;
+  entry->restarts = 0;
+  int fd = open(entry->path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return;
+  }
+  char magic[sizeof(IEXEC_STATUS_MAGIC)];
+  if (st.st_size == sizeof(iexec_status_record) && pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+      && memcmp(magic, IEXEC_STATUS_MAGIC, sizeof(magic)) == 0) {
+    iexec_status_read_record(entry, fd);
+  } else {
+    off_t size = st.st_size;
+    off_t offset = size > IEXEC_STATUS_TAIL_SIZE ? size - IEXEC_STATUS_TAIL_SIZE : 0;
+    char tail[IEXEC_STATUS_TAIL_SIZE + 1];
+    ssize_t length = pread(fd, tail, size - offset, offset);
+    if (length >= 0) {
+      tail[length] = 0;
+      /** The first line of the tail may be cut. */
+      char *lines = offset > 0 && strchr(tail, '\n') != 0 ? strchr(tail, '\n') + 1 : tail;
+      iexec_status_parse(entry, lines);
+    }
+    if (entry->pid == 0 && offset > 0) {
+      char *whole = malloc(size + 1);
+      if (whole != 0 && (length = pread(fd, whole, size, 0)) >= 0) {
+        whole[length] = 0;
+        iexec_status_parse(entry, whole);
+      }
+      free(whole);
+    }
+    if (entry->pid == 0) {
+      entry->state = IEXEC_STATUS_UNREADABLE;
+    }
+  }
+  close(fd);
+  if ((entry->state == IEXEC_STATUS_RUNNING || entry->state == IEXEC_STATUS_STOPPED)
+      && entry->pid > 0 && kill(entry->pid, 0) < 0 && errno == ESRCH) {
+    entry->state = IEXEC_STATUS_LOST;
+  }
+}
+
+/**
+ * Reads status files until none is left; run by each thread.
+ */
+void *iexec_status_reader(void *unused) {
+  int i;
+  while ((i = __atomic_fetch_add(&next_entry, 1, __ATOMIC_RELAXED)) < num_entries) {
+    iexec_status_read(&entries[i]);
+  }
+  return 0;
+}
+
+/**
+ * Adds a status file to read.
+ */
+void iexec_status_add(char *path) {
+  iexec_status_entry *temp_entries = realloc(entries, sizeof(iexec_status_entry) * (num_entries + 1));
+  if (temp_entries == 0) {
+    error(0, errno, "realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  entries = temp_entries;
+  entries[num_entries++].path = path;
+}
+
+/**
+ * Adds the status files in a directory, ie its regular files not
+ * starting with a dot, in the order of their names.
+ *
+ * Returns 0, or a negative value if the directory cannot be read.
+ */
+int iexec_status_add_dir(const char *dir_path) {
+  struct dirent **names;
+  int num_names = scandir(dir_path, &names, 0, alphasort);
+  if (num_names < 0) {
+    error(0, errno, "unable to read directory `%s'", dir_path);
+    return -1;
+  }
+  for (int i = 0; i < num_names; i++) {
+    if (names[i]->d_name[0] != '.' && (names[i]->d_type == DT_REG || names[i]->d_type == DT_UNKNOWN)) {
+      char *path = malloc(strlen(dir_path) + strlen(names[i]->d_name) + 2);
+      if (path == 0) {
+        error(0, errno, "malloc failed");
+        exit(EXIT_FAILURE);
+      }
+      sprintf(path, "%s/%s", dir_path, names[i]->d_name);
+      iexec_status_add(path);
+    }
+    free(names[i]);
+  }
+  free(names);
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  int summary_only = 0, status = EXIT_SUCCESS;
+  long num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int c;
+  while ((c = getopt(argc, argv, "sj:h")) != -1) {
+    switch (c) {
+    case 's':
+      summary_only = 1;
+      break;
+    case 'j':
+      num_threads = atoi(optarg);
+      break;
+    default:
+      usage();
+    }
+  }
+  if (optind == argc) {
+    usage();
+  }
+  for (int i = optind; i < argc; i++) {
+    struct stat st;
+    if (stat(argv[i], &st) == 0 && S_ISDIR(st.st_mode)) {
+      if (iexec_status_add_dir(argv[i]) < 0) {
+        status = EXIT_FAILURE;
+      }
+    } else {
+      iexec_status_add(argv[i]);
+    }
+  }
+
+  /** Reading a file is a few system calls, so threads only pay off for
+      many files, of which each thread takes the next one left. */
+  if (num_threads > IEXEC_STATUS_MAX_THREADS) {
+    num_threads = IEXEC_STATUS_MAX_THREADS;
+  }
+  if (num_entries < IEXEC_STATUS_PARALLEL_MIN || num_threads < 2) {
+    num_threads = 1;
+  }
+  pthread_t threads[IEXEC_STATUS_MAX_THREADS];
+  int num_started = 0;
+  for (; num_started < num_threads - 1; num_started++) {
+    if (pthread_create(&threads[num_started], 0, iexec_status_reader, 0) != 0) {
+      break;
+    }
+  }
+  iexec_status_reader(0);
+  for (int i = 0; i < num_started; i++) {
+    pthread_join(threads[i], 0);
+  }
+
+  int counts[IEXEC_NUM_STATES] = {0};
+  for (int i = 0; i < num_entries; i++) {
+    const iexec_status_entry *entry = &entries[i];
+    counts[entry->state]++;
+    if (summary_only) {
+      continue;
+    }
+    printf("%s %s", entry->path, state_names[entry->state]);
+    if (entry->state != IEXEC_STATUS_UNREADABLE) {
+      printf(" pid=%lld", entry->pid);
+    }
+    if (entry->state == IEXEC_STATUS_EXITED) {
+      printf(" code=%d", entry->exit_code);
+    } else if (entry->state == IEXEC_STATUS_KILLED || entry->state == IEXEC_STATUS_STOPPED) {
+      printf(" signal=%d", entry->signal);
+    }
+    if (entry->restarts > 0) {
+      printf(" restarts=%d", entry->restarts);
+    }
+    putchar('\n');
+  }
+  printf("total=%d", num_entries);
+  for (int i = 0; i < IEXEC_NUM_STATES; i++) {
+    if (counts[i] > 0) {
+      printf(" %s=%d", state_names[i], counts[i]);
+    }
+  }
+  putchar('\n');
+  return status;
+}
@@ -0,0 +1,69 @@
+/**
+ * The layout of a status file written with --status-format=mmap.
+ *
+ * The file holds a single iexec_status_record that the monitor updates
+ * in place through a shared mapping. A poller maps the file (or reads it
+ * with a single pread()) and gets a consistent copy like a seqlock
+ * reader:
+ *
+ *   do {
+ *     seq = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+ *     copy = *record;
+ *     __atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *   } while ((seq & 1) || seq != __atomic_load_n(&record->sequence, __ATOMIC_RELAXED));
+ *
+ * The sequence is odd while the monitor updates the record and grows by
+ * two with every update, so it also tells whether anything changed
+ * since the last poll.
+ */
+#ifndef IEXEC_STATUS_H
+#define IEXEC_STATUS_H
+
+#include <stdint.h>
+
+#define IEXEC_STATUS_MAGIC "iexecst"
+#define IEXEC_STATUS_VERSION 1
+
+/** The program is being launched: no pid yet. */
+#define IEXEC_STATUS_STARTING 0
+/** The program runs (or was continued). */
+#define IEXEC_STATUS_RUNNING 1
+/** The program was stopped by signal. */
+#define IEXEC_STATUS_STOPPED 2
+/** The program exited with exit_code. */
+#define IEXEC_STATUS_EXITED 3
+/** The program was killed by signal. */
+#define IEXEC_STATUS_KILLED 4
+/** The program terminated and waits to be restarted. */
+#define IEXEC_STATUS_BACKOFF 5
+/** The program was restarted too often and given up on. */
+#define IEXEC_STATUS_GAVE_UP 6
+/** The program could not be launched or waited for. */
+#define IEXEC_STATUS_ERROR 7
+
+typedef struct iexec_status_record {
+  char magic[8];        /** IEXEC_STATUS_MAGIC, NUL-terminated. */
+  uint32_t version;     /** IEXEC_STATUS_VERSION. */
+  uint32_t size;        /** sizeof(iexec_status_record). */
+  uint64_t sequence;    /** Odd while an update is in progress. */
+  int64_t pid;          /** The pid of the current (or last) run. */
+  uint32_t state;       /** One of IEXEC_STATUS_*. */
+  int32_t exit_code;    /** The exit status of the last run that exited. */
+  int32_t signal;       /** The signal that last killed or stopped it. */
+  uint32_t restarts;    /** How many times the program was restarted. */
+  int64_t start_time;   /** When the current run started (ns since the
+                            epoch, CLOCK_REALTIME). */
+  int64_t backoff;      /** The last delay before a restart (ms). */
+  /** The resources the last terminated run used, from wait4(). */
+  int64_t utime;        /** User CPU time (us). */
+  int64_t stime;        /** System CPU time (us). */
+  int64_t max_rss;      /** Maximum resident set (KiB). */
+  int64_t minflt;       /** Page faults without I/O. */
+  int64_t majflt;       /** Page faults with I/O. */
+  int64_t nvcsw;        /** Voluntary context switches. */
+  int64_t nivcsw;       /** Involuntary context switches. */
+  int64_t inblock;      /** Blocks read. */
+  int64_t oublock;      /** Blocks written. */
+} iexec_status_record;
+
+#endif
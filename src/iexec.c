@@ -11,30 +11,323 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <error.h>
 #include <locale.h>
+#include <limits.h>
 #include <libintl.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <pwd.h>
 #include <sys/wait.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/pidfd.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/close_range.h>
+#include <linux/sched.h>
+#include <linux/mempolicy.h>
+#include <mntent.h>
+#include <sys/prctl.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <linux/perf_event.h>
+#include <linux/capability.h>
 #include "iexec-help.h"
 #include "iexec-help-nontty.h"
+#include "iexec-status.h"
+#include "iexec-server.h"
+#include "iexec-profile.h"
 
 #define IEXEC_VERSION "1.1"
 
 #define IEXEC_OPTION_UMASK 7001
 #define IEXEC_OPTION_VERSION 7002
 #define IEXEC_OPTION_CGROUP_PATH 7003
+#define IEXEC_OPTION_ENGINE 7004
+#define IEXEC_OPTION_BATCH 7005
+#define IEXEC_OPTION_CLOSE_FROM 7006
+#define IEXEC_OPTION_CLOSE_ALL 7007
+#define IEXEC_OPTION_CLOSE_ALL_EXCEPT 7008
+#define IEXEC_OPTION_RESTART 7009
+#define IEXEC_OPTION_RESTART_BACKOFF_MIN 7010
+#define IEXEC_OPTION_RESTART_BACKOFF_MAX 7011
+#define IEXEC_OPTION_RESTART_JITTER 7012
+#define IEXEC_OPTION_RESTART_LIMIT 7013
+#define IEXEC_OPTION_RESTART_WINDOW 7014
+#define IEXEC_OPTION_STATUS_FORMAT 7015
+#define IEXEC_OPTION_SAMPLE_INTERVAL 7016
+#define IEXEC_OPTION_CPU_MAX 7017
+#define IEXEC_OPTION_MEMORY_HIGH 7018
+#define IEXEC_OPTION_MEMORY_MAX 7019
+#define IEXEC_OPTION_IO_WEIGHT 7020
+#define IEXEC_OPTION_PIDS_MAX 7021
+#define IEXEC_OPTION_CPUS 7022
+#define IEXEC_OPTION_NUMA_NODE 7023
+#define IEXEC_OPTION_MEMBIND 7024
+#define IEXEC_OPTION_INTERLEAVE 7025
+#define IEXEC_OPTION_SCHED 7026
+#define IEXEC_OPTION_SCHED_PRIORITY 7027
+#define IEXEC_OPTION_NICE 7028
+#define IEXEC_OPTION_IOPRIO_CLASS 7029
+#define IEXEC_OPTION_IOPRIO_LEVEL 7030
+#define IEXEC_OPTION_TIMERSLACK 7031
+#define IEXEC_OPTION_LOG_ROTATE_SIZE 7032
+#define IEXEC_OPTION_LOG_ROTATE_INTERVAL 7033
+#define IEXEC_OPTION_LOG_KEEP 7034
+#define IEXEC_OPTION_STDOUT_TEE 7035
+#define IEXEC_OPTION_STDERR_TEE 7036
+#define IEXEC_OPTION_LISTEN 7037
+#define IEXEC_OPTION_LISTEN_BACKLOG 7038
+#define IEXEC_OPTION_LISTEN_REUSEPORT 7039
+#define IEXEC_OPTION_LISTEN_FASTOPEN 7040
+#define IEXEC_OPTION_INSTANCES 7041
+#define IEXEC_OPTION_PIN_INSTANCES 7042
+#define IEXEC_OPTION_WAIT_READY 7043
+#define IEXEC_OPTION_READY_FD 7044
+#define IEXEC_OPTION_TRACE_TIMINGS 7045
+#define IEXEC_OPTION_REDIRECT 7046
+#define IEXEC_OPTION_THP 7047
+#define IEXEC_OPTION_KSM 7048
+#define IEXEC_OPTION_MLOCKALL 7049
+#define IEXEC_OPTION_PREFAULT 7050
+#define IEXEC_OPTION_ADJUST_PID 7051
+#define IEXEC_OPTION_ADJUST_PID_FILE 7052
+#define IEXEC_OPTION_SERVER 7053
+#define IEXEC_OPTION_RESOLVE_BINARY 7054
+#define IEXEC_OPTION_PSI_WATCH 7055
+#define IEXEC_OPTION_PSI_SIGNAL 7056
+#define IEXEC_OPTION_PSI_HOOK 7057
+#define IEXEC_OPTION_TIMEOUT 7058
+#define IEXEC_OPTION_STOP_SIGNAL 7059
+#define IEXEC_OPTION_STOP_GRACE 7060
+#define IEXEC_OPTION_STOP 7061
+#define IEXEC_OPTION_NAME 7062
+#define IEXEC_OPTION_AFTER 7063
+#define IEXEC_OPTION_REQUIRES 7064
+#define IEXEC_OPTION_PROFILE 7065
+#define IEXEC_OPTION_COMPILE_PROFILES 7066
+#define IEXEC_OPTION_PERF_COUNTERS 7067
+#define IEXEC_OPTION_SUBREAPER 7068
+#define IEXEC_OPTION_MAX_DESCENDANTS 7069
+#define IEXEC_OPTION_UPGRADE 7070
 
 #define IEXEC_OPTION_RLIMIT_SOFT 8000
 #define IEXEC_OPTION_RLIMIT_HARD 9000
 
-#define IEXEC_RLIMIT_UNCHANGED -2
+/** A limit that is not to be changed (RLIM_INFINITY is (rlim_t)-1). */
+#define IEXEC_RLIMIT_UNCHANGED ((rlim_t)-2)
+
+#define IEXEC_ENGINE_AUTO 0
+#define IEXEC_ENGINE_VFORK 1
+#define IEXEC_ENGINE_FORK 2
+#define IEXEC_ENGINE_CLONE3 3
+
+#define IEXEC_REDIRECT_LEAN 0
+#define IEXEC_REDIRECT_COMPAT 1
+
+/** The I/O scheduling classes of ioprio_set(). */
+#define IEXEC_IOPRIO_CLASS_NONE 0
+#define IEXEC_IOPRIO_CLASS_REALTIME 1
+#define IEXEC_IOPRIO_CLASS_BEST_EFFORT 2
+#define IEXEC_IOPRIO_CLASS_IDLE 3
+#define IEXEC_IOPRIO_CLASS_SHIFT 13
+
+/** A string name for each I/O scheduling class (indexed by constant). */
+const char *ioprio_class_names[] = {
+  [IEXEC_IOPRIO_CLASS_NONE] = "none",
+  [IEXEC_IOPRIO_CLASS_REALTIME] = "realtime",
+  [IEXEC_IOPRIO_CLASS_BEST_EFFORT] = "best-effort",
+  [IEXEC_IOPRIO_CLASS_IDLE] = "idle"
+};
+
+/** The scheduling policies of --sched, with their names. */
+const struct {
+  const char *name;
+  int policy;
+} sched_policies[] = {
+  {"other", SCHED_OTHER},
+  {"batch", SCHED_BATCH},
+  {"idle", SCHED_IDLE},
+  {"fifo", SCHED_FIFO},
+  {"rr", SCHED_RR}
+};
+
+/** The number of NUMA nodes a memory policy can name. */
+#define IEXEC_MAX_NODES 1024
+#define IEXEC_NODE_WORDS (IEXEC_MAX_NODES / (8 * sizeof(unsigned long)))
+
+/** How much output of a program the monitor buffers before writing it
+    to a log, and for how long (ms) at most. */
+#define IEXEC_LOG_BUFFER_SIZE (64 * 1024)
+#define IEXEC_LOG_FLUSH_DELAY 100
+
+/** The size of the pipe that holds output on its way to a tee socket,
+    and how long (ms) to wait before reconnecting a lost one. */
+#define IEXEC_TEE_PIPE_SIZE (1024 * 1024)
+#define IEXEC_TEE_RECONNECT_DELAY 1000
+
+/** The first descriptor passed sockets go to, as in systemd's socket
+    activation (SD_LISTEN_FDS_START). */
+#define IEXEC_LISTEN_FDS_START 3
+
+/** How often (ms) the monitor counts the descendants of a program
+    with --max-descendants. */
+#define IEXEC_DESCENDANTS_INTERVAL 100
+
+/** The size of the stack the vfork engine runs the child on. */
+#define IEXEC_VFORK_STACK_SIZE (256 * 1024)
+
+#define IEXEC_RESTART_NO 0
+#define IEXEC_RESTART_ON_FAILURE 1
+#define IEXEC_RESTART_ALWAYS 2
+
+#define IEXEC_STATUS_FORMAT_TEXT 0
+#define IEXEC_STATUS_FORMAT_MMAP 1
+#define IEXEC_STATUS_FORMAT_JSONL 2
+
+/** A string name for each status file format (indexed by constant). */
+const char *status_format_names[] = {
+  [IEXEC_STATUS_FORMAT_TEXT] = "text",
+  [IEXEC_STATUS_FORMAT_MMAP] = "mmap",
+  [IEXEC_STATUS_FORMAT_JSONL] = "jsonl"
+};
+
+/** A string name for each restart policy (indexed by constant). */
+const char *restart_names[] = {
+  [IEXEC_RESTART_NO] = "no",
+  [IEXEC_RESTART_ON_FAILURE] = "on-failure",
+  [IEXEC_RESTART_ALWAYS] = "always"
+};
+
+/** A string name for each launch engine (indexed by constant). */
+const char *engine_names[] = {
+  [IEXEC_ENGINE_AUTO] = "auto",
+  [IEXEC_ENGINE_VFORK] = "vfork",
+  [IEXEC_ENGINE_FORK] = "fork",
+  [IEXEC_ENGINE_CLONE3] = "clone3"
+};
+
+/** A string name for each way of redirecting stdio (indexed by constant). */
+const char *redirect_names[] = {
+  [IEXEC_REDIRECT_LEAN] = "lean",
+  [IEXEC_REDIRECT_COMPAT] = "compat"
+};
+
+#define IEXEC_THP_UNCHANGED -1
+#define IEXEC_THP_NEVER 0
+#define IEXEC_THP_ALWAYS 1
+
+/** A string name for each transparent hugepage mode (indexed by constant). */
+const char *thp_names[] = {
+  [IEXEC_THP_NEVER] = "never",
+  [IEXEC_THP_ALWAYS] = "always"
+};
+
+#define IEXEC_PSI_CPU 0
+#define IEXEC_PSI_MEMORY 1
+#define IEXEC_PSI_IO 2
+
+/** A string name for each resource of --psi-watch, which is also the
+    name of its pressure file (indexed by constant). */
+const char *psi_names[] = {
+  [IEXEC_PSI_CPU] = "cpu",
+  [IEXEC_PSI_MEMORY] = "memory",
+  [IEXEC_PSI_IO] = "io"
+};
+
+#define IEXEC_PERF_CYCLES 0
+#define IEXEC_PERF_INSTRUCTIONS 1
+#define IEXEC_PERF_CACHE_REFERENCES 2
+#define IEXEC_PERF_CACHE_MISSES 3
+#define IEXEC_PERF_BRANCHES 4
+#define IEXEC_PERF_BRANCH_MISSES 5
+#define IEXEC_PERF_CONTEXT_SWITCHES 6
+#define IEXEC_PERF_CPU_MIGRATIONS 7
+#define IEXEC_PERF_PAGE_FAULTS 8
+#define IEXEC_PERF_TASK_CLOCK 9
+#define IEXEC_NUM_PERF_COUNTERS 10
+
+/** A string name for each counter of --perf-counters, as perf stat
+    names it (indexed by constant). */
+const char *perf_names[] = {
+  [IEXEC_PERF_CYCLES] = "cycles",
+  [IEXEC_PERF_INSTRUCTIONS] = "instructions",
+  [IEXEC_PERF_CACHE_REFERENCES] = "cache-references",
+  [IEXEC_PERF_CACHE_MISSES] = "cache-misses",
+  [IEXEC_PERF_BRANCHES] = "branches",
+  [IEXEC_PERF_BRANCH_MISSES] = "branch-misses",
+  [IEXEC_PERF_CONTEXT_SWITCHES] = "context-switches",
+  [IEXEC_PERF_CPU_MIGRATIONS] = "cpu-migrations",
+  [IEXEC_PERF_PAGE_FAULTS] = "page-faults",
+  [IEXEC_PERF_TASK_CLOCK] = "task-clock"
+};
+
+/** The perf_event_open() type and config of each counter (indexed by
+    constant). */
+const struct {
+  uint32_t type;
+  uint64_t config;
+} perf_events[] = {
+  [IEXEC_PERF_CYCLES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  [IEXEC_PERF_INSTRUCTIONS] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  [IEXEC_PERF_CACHE_REFERENCES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+  [IEXEC_PERF_CACHE_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+  [IEXEC_PERF_BRANCHES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_INSTRUCTIONS},
+  [IEXEC_PERF_BRANCH_MISSES] = {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+  [IEXEC_PERF_CONTEXT_SWITCHES] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+  [IEXEC_PERF_CPU_MIGRATIONS] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS},
+  [IEXEC_PERF_PAGE_FAULTS] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+  [IEXEC_PERF_TASK_CLOCK] = {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}
+};
+
+/**
+ * A pressure stall trigger of --psi-watch: it fires when the tasks stall
+ * on a resource for stall microseconds within a window of window
+ * microseconds.
+ */
+typedef struct iexec_psi_trigger {
+  int resource;         /** The resource (IEXEC_PSI_*). */
+  int full;             /** Non-zero if all tasks stall (full), zero if
+                            some do (some). */
+  long long stall;      /** The stall time (us). */
+  long long window;     /** The window (us). */
+} iexec_psi_trigger;
+
+/** Older headers lack the KSM prctl() (Linux 6.4). */
+#ifndef PR_SET_MEMORY_MERGE
+#define PR_SET_MEMORY_MERGE 67
+#endif
+
+/** The shim that locks and prefaults the program's memory (--mlockall,
+    --prefault); the IEXEC_PRELOAD environment variable overrides it. */
+#ifndef IEXEC_PRELOAD_PATH
+#define IEXEC_PRELOAD_PATH "/usr/local/lib/iexec/libiexec-preload.so"
+#endif
+
+/** The text profiles of --profile; the IEXEC_PROFILES environment
+    variable overrides it. */
+#ifndef IEXEC_PROFILES_PATH
+#define IEXEC_PROFILES_PATH "/etc/iexec/profiles.conf"
+#endif
 
 /** A string name for each limit constant (indexed by constant). */
 const char *limit_names[] = {
@@ -65,6 +358,10 @@ typedef struct iexec_config {
                            descriptors open. */
   int *fds_to_close;    /** The file descriptors to close prior to exec. */
   int num_fds_to_close; /** The number of file descriptors to close prior to exec. */
+  int close_from;       /** Close every file descriptor from this one up
+                            prior to exec (-1 = none). */
+  int *fds_to_keep;     /** The file descriptors that close_from leaves open. */
+  int num_fds_to_keep;  /** The number of file descriptors close_from leaves open. */
   char *use_stdin_file; /** The pathname to use for standard input. This
                             is ignored when keep_open is true.*/
   char *use_stdout_file;/** The pathname to use for standard output. This
@@ -81,15 +378,286 @@ typedef struct iexec_config {
   char **remaining_argv;/** The remaining argument values after iexec
                             arguments. */
   /* Values to set soft resource limits for setrlimit/getrlimit. */
-  long soft_limits[RLIMIT_NLIMITS];
+  rlim_t soft_limits[RLIMIT_NLIMITS];
   /* Values to set hard resource limits for setrlimit/getrlimit. */
-  long hard_limits[RLIMIT_NLIMITS];
+  rlim_t hard_limits[RLIMIT_NLIMITS];
+  pid_t adjust_pid;     /** The running process to change the limits of
+                            instead of launching (0 = launch). */
+  char *adjust_pid_file;/** The pid file naming that process (0 = none). */
+  char *server;         /** The socket to serve launch requests on instead
+                            of launching (0 = launch). */
 
   char *username;       /** The effective uid to run as. 0 means do not change it. */
-  char *cgroup_path;    /** Cgroup path */
+  char *cgroup_path;    /** The cgroup v2 to launch the program in (0 = iexec's). */
+  char *cpu_max;        /** The cgroup's cpu.max (0 = unchanged). */
+  char *memory_high;    /** The cgroup's memory.high (0 = unchanged). */
+  char *memory_max;     /** The cgroup's memory.max (0 = unchanged). */
+  char *io_weight;      /** The cgroup's io.weight (0 = unchanged). */
+  char *pids_max;       /** The cgroup's pids.max (0 = unchanged). */
+  char *cpus;           /** The list of CPUs to run on (0 = unchanged). */
+  int numa_node;        /** The NUMA node to run on and allocate from (-1 = none). */
+  char *membind;        /** The list of NUMA nodes to allocate from (0 = unchanged). */
+  char *interleave;     /** The list of NUMA nodes to interleave allocations
+                            over (0 = unchanged). */
+  int sched_policy;     /** The scheduling policy (-1 = unchanged). */
+  int sched_priority;   /** The static priority for SCHED_FIFO/SCHED_RR (-1 = unset). */
+  int nice;             /** The nice value (INT_MIN = unchanged). */
+  int ioprio_class;     /** The I/O scheduling class (-1 = unchanged). */
+  int ioprio_level;     /** The priority within the class (-1 = default). */
+  long timerslack;      /** The timer slack in ns (-1 = unchanged). */
+  int thp;              /** The transparent hugepage mode (IEXEC_THP_*). */
+  int ksm;              /** If non-zero, let KSM merge the program's pages. */
+  int mlockall;         /** The MCL_* flags for the shim to call mlockall()
+                            with (0 = do not lock). */
+  int prefault;         /** If non-zero, the shim prefaults the program's
+                            mappings. */
+  int resolve_binary;   /** If non-zero, the program is looked up once
+                            and executed from an open descriptor. */
+  iexec_psi_trigger *psi_triggers; /** The pressure triggers the monitor
+                            watches. */
+  int num_psi_triggers; /** The number of pressure triggers. */
+  int psi_signal;       /** The signal sent to the program when a trigger
+                            fires (0 = none). */
+  char *psi_hook;       /** The command run when a trigger fires (0 = none). */
+  long long timeout;    /** How long the program may run before it is
+                            stopped (ms, 0 = forever). */
+  int stop_signal;      /** The signal that asks the program to stop. */
+  long long stop_grace; /** How long the program has to stop before it
+                            is killed (ms). */
+  char *stop_pid_file;  /** The pid file of the program to stop instead
+                            of launching (0 = launch). */
+  long long log_rotate_size; /** The size to rotate -o/-e logs at (0 = never). */
+  long long log_rotate_interval; /** How often to rotate -o/-e logs (ms, 0 = never). */
+  int log_keep;         /** The number of rotated logs to keep. */
+  char *stdout_tee;     /** The socket to also send stdout to (0 = none). */
+  char *stderr_tee;     /** The socket to also send stderr to (0 = none). */
+  char **listen;        /** The sockets to listen on and pass (--listen). */
+  int num_listen;       /** The number of sockets to listen on. */
+  int listen_backlog;   /** The backlog of the sockets. */
+  int listen_reuseport; /** If non-zero, set SO_REUSEPORT on the sockets. */
+  int listen_fastopen;  /** The TCP_FASTOPEN queue length (0 = off). */
+  int instances;        /** The number of copies of the program to launch. */
+  int pin_instances;    /** If non-zero, pin each instance to one CPU. */
+  int instance;         /** The number of this instance (-1 = not one of
+                            several). */
+  long long wait_ready; /** How long to wait for the program to report it
+                            is ready (ms, 0 = forever, -1 = do not wait). */
+  int ready_fd;         /** The descriptor the program reports readiness
+                            on (-1 = NOTIFY_SOCKET). */
+  int trace_timings;    /** If non-zero, print how long each phase of the
+                            launch took. */
   int no_daemonize;     /** If non-zero, do not daemonize. Block until child exits. */
+  int engine;           /** The launch engine to use (IEXEC_ENGINE_*). */
+  int redirect;         /** How to redirect stdio (IEXEC_REDIRECT_*). */
+  int verbose;          /** If non-zero, report how the program was launched. */
+  char *batch_file;     /** The manifest of programs to launch (0 = none). */
+  int status_format;    /** The format of the status file (IEXEC_STATUS_FORMAT_*). */
+  int restart;          /** When to restart the program (IEXEC_RESTART_*). */
+  long long restart_backoff_min; /** The delay before the first restart (ms). */
+  long long restart_backoff_max; /** The longest delay before a restart (ms). */
+  double restart_jitter;/** The fraction by which a delay is randomized. */
+  int restart_limit;    /** The most restarts within restart_window
+                            before giving up (0 = no limit). */
+  long long restart_window; /** The period restart_limit applies to (ms). */
+  long long sample_interval; /** How often to sample /proc/<pid>/stat
+                            (ms, 0 = never). */
+  char *name;           /** The name other manifest entries refer to the
+                            program by (0 = the program's basename). */
+  char *after;          /** The comma-separated names of the programs to
+                            launch after (0 = none). */
+  char *requires;       /** The comma-separated names of the programs to
+                            launch after, that must not fail (0 = none). */
+  int ordered;          /** If non-zero, the program is launched in
+                            dependency order by the monitor. */
+  char *compile_profiles; /** The profiles to compile instead of
+                            launching (0 = launch). */
+  int perf_counters;    /** The counters of --perf-counters (bit i =
+                            perf_names[i], 0 = none). */
+  int subreaper;        /** If non-zero, the monitor reaps and accounts
+                            for the descendants of the program. */
+  int max_descendants;  /** The most descendants the program may have
+                            running (0 = no limit). */
+  char *upgrade_pid_file; /** The pid file of the program the launched one
+                            replaces (0 = none). */
+  pid_t upgrade_pid;    /** The pid of that program. */
+  int *upgrade_fds;     /** The sockets taken over from that program,
+                            passed instead of binding --listen (0 = none). */
 } iexec_config;
 
+/**
+ * The steps the launched child performs before execvp(). When a step
+ * fails, the child reports it back to the launching process, which
+ * prints the error.
+ */
+enum iexec_stage {
+  IEXEC_STAGE_START,
+  IEXEC_STAGE_CGROUP,
+  IEXEC_STAGE_SETRLIMIT_SOFT,
+  IEXEC_STAGE_SETRLIMIT_HARD,
+  IEXEC_STAGE_THP,
+  IEXEC_STAGE_KSM,
+  IEXEC_STAGE_SETUID,
+  IEXEC_STAGE_CHDIR,
+  IEXEC_STAGE_LISTEN,
+  IEXEC_STAGE_READY_FD,
+  IEXEC_STAGE_SCHED_SETAFFINITY,
+  IEXEC_STAGE_SET_MEMPOLICY,
+  IEXEC_STAGE_ACCESS_STDIN,
+  IEXEC_STAGE_ACCESS_STDOUT,
+  IEXEC_STAGE_ACCESS_STDERR,
+  IEXEC_STAGE_CLOSE,
+  IEXEC_STAGE_CLOSE_FROM,
+  IEXEC_STAGE_CLOSE_STDIN,
+  IEXEC_STAGE_CLOSE_STDOUT,
+  IEXEC_STAGE_CLOSE_STDERR,
+  IEXEC_STAGE_REDIRECT_STDIN,
+  IEXEC_STAGE_REDIRECT_STDOUT,
+  IEXEC_STAGE_REDIRECT_STDERR,
+  IEXEC_STAGE_STAT,
+  IEXEC_STAGE_TRUNCATE,
+  IEXEC_STAGE_SETSID,
+  IEXEC_STAGE_SCHED,
+  IEXEC_STAGE_NICE,
+  IEXEC_STAGE_IOPRIO,
+  IEXEC_STAGE_TIMERSLACK,
+  IEXEC_STAGE_PERF,
+  IEXEC_STAGE_EXEC
+};
+
+/** A string name for each stage, for --trace-timings (indexed by constant). */
+const char *stage_names[] = {
+  [IEXEC_STAGE_START] = "clone",
+  [IEXEC_STAGE_CGROUP] = "cgroup",
+  [IEXEC_STAGE_SETRLIMIT_SOFT] = "setrlimit",
+  [IEXEC_STAGE_SETRLIMIT_HARD] = "setrlimit",
+  [IEXEC_STAGE_THP] = "memory",
+  [IEXEC_STAGE_KSM] = "memory",
+  [IEXEC_STAGE_SETUID] = "setuid",
+  [IEXEC_STAGE_CHDIR] = "chdir",
+  [IEXEC_STAGE_LISTEN] = "listen",
+  [IEXEC_STAGE_READY_FD] = "ready-fd",
+  [IEXEC_STAGE_SCHED_SETAFFINITY] = "sched_setaffinity",
+  [IEXEC_STAGE_SET_MEMPOLICY] = "set_mempolicy",
+  [IEXEC_STAGE_ACCESS_STDIN] = "access",
+  [IEXEC_STAGE_ACCESS_STDOUT] = "access",
+  [IEXEC_STAGE_ACCESS_STDERR] = "access",
+  [IEXEC_STAGE_CLOSE] = "close",
+  [IEXEC_STAGE_CLOSE_FROM] = "close-from",
+  [IEXEC_STAGE_CLOSE_STDIN] = "close-stdio",
+  [IEXEC_STAGE_CLOSE_STDOUT] = "close-stdio",
+  [IEXEC_STAGE_CLOSE_STDERR] = "close-stdio",
+  [IEXEC_STAGE_REDIRECT_STDIN] = "redirect-stdin",
+  [IEXEC_STAGE_REDIRECT_STDOUT] = "redirect-stdout",
+  [IEXEC_STAGE_REDIRECT_STDERR] = "redirect-stderr",
+  [IEXEC_STAGE_STAT] = "same_file",
+  [IEXEC_STAGE_TRUNCATE] = "truncate",
+  [IEXEC_STAGE_SETSID] = "setsid",
+  [IEXEC_STAGE_SCHED] = "sched",
+  [IEXEC_STAGE_NICE] = "setpriority",
+  [IEXEC_STAGE_IOPRIO] = "ioprio_set",
+  [IEXEC_STAGE_TIMERSLACK] = "timerslack",
+  [IEXEC_STAGE_PERF] = "perf_event_open",
+  [IEXEC_STAGE_EXEC] = "execvp"
+};
+
+/**
+ * A record the child writes to the report pipe. Only the truncate and
+ * perf stages are warnings, every other record with an errno means the launch
+ * failed. With --trace-timings, records without one tell when the child
+ * finished a stage.
+ */
+typedef struct iexec_report {
+  int stage;            /** The IEXEC_STAGE_* that failed or finished. */
+  int err;              /** The errno of the failure (0 = a timing). */
+  int arg;              /** A stage-specific argument (limit or fd number). */
+  long long time;       /** When the record was written (CLOCK_MONOTONIC, ns). */
+} iexec_report;
+
+/**
+ * Holds everything the launched child needs. It is prepared by the
+ * launching process so that the child itself only makes system calls,
+ * which is what makes it safe to run in a vfork()ed context that shares
+ * memory with its parent.
+ */
+typedef struct iexec_launch {
+  const iexec_config *config;  /** The configuration to launch. */
+  struct rlimit limits[RLIMIT_NLIMITS]; /** The resource limits to set. */
+  int limits_set[RLIMIT_NLIMITS]; /** Non-zero for each limit to set. */
+  uid_t uid;            /** The uid to change to if config->username is set. */
+  int working_dir_fd;   /** A descriptor of the working directory (-1 = unchanged). */
+  struct perf_event_attr perf_attr; /** The attributes of the counters of
+                            --perf-counters, but for their type. */
+  int perf_fd;          /** The child's end of the socket it sends the
+                            counters over (-1 = none, or parent). */
+  int perf_fds[IEXEC_NUM_PERF_COUNTERS]; /** The counters of the last run
+                            (-1 = not open). */
+  int binary_fd;        /** An O_PATH descriptor of the program with
+                            --resolve-binary (-1 = execvp() looks it up). */
+  const char *binary_path; /** Where the program was found, relative to
+                            the working directory (the name it is given
+                            as without --resolve-binary). */
+  int cgroup_fd;        /** A descriptor of the cgroup to launch in (-1 = iexec's). */
+  int in_cgroup;        /** Non-zero if the child is spawned in the cgroup
+                            already (CLONE_INTO_CGROUP), so it need not
+                            move itself. */
+  int *fds_to_keep;     /** config->fds_to_keep, sorted. */
+  int cpus_set;         /** Non-zero if the CPU affinity is to be set. */
+  cpu_set_t cpus;       /** The CPUs to run on. */
+  int mempolicy;        /** The memory policy to set (MPOL_BIND,
+                            MPOL_INTERLEAVE or MPOL_DEFAULT = unchanged). */
+  unsigned long nodes[IEXEC_NODE_WORDS]; /** The nodes of the memory policy. */
+  int ioprio;           /** The value for ioprio_set() (-1 = unchanged). */
+  int log_fds[2];       /** The write ends of the pipes to the monitor's
+                            log collector that stdout and stderr go to
+                            (-1 = the file itself). */
+  int sigpipe_ignored;  /** Non-zero if iexec was started with SIGPIPE
+                            ignored, which the program then inherits. */
+  int *listen_fds;      /** The bound sockets, to be passed from
+                            IEXEC_LISTEN_FDS_START on. */
+  int ready_fds[2];     /** The notify socket or the read end of the
+                            --ready-fd pipe, and the write end of the pipe
+                            (-1 = none). */
+  char **envp;          /** The environment of the program with LISTEN_FDS,
+                            LISTEN_PID and NOTIFY_SOCKET (0 = iexec's own). */
+  char *listen_pid;     /** Where the child writes its pid into envp. */
+  sigset_t sigmask;     /** The signal mask the program starts with. */
+  int report_fd;        /** The write end of the report pipe (child only). */
+  int engine;           /** The engine used by the last launch. */
+  pid_t pid;            /** The pid of the program if this process launched
+                            it (0 = not launched, or by a monitor). */
+} iexec_launch;
+
+/**
+ * What became of a program launched in dependency order (see
+ * iexec_monitor_schedule()).
+ */
+#define IEXEC_PROGRAM_NEW 0     /* Not launched by this process. */
+#define IEXEC_PROGRAM_PENDING 1 /* Waiting for the programs it comes after. */
+#define IEXEC_PROGRAM_STARTED 2 /* Launched, not ready or exited yet. */
+#define IEXEC_PROGRAM_DONE 3    /* Ready, or exited successfully. */
+#define IEXEC_PROGRAM_FAILED 4  /* Failed to launch, to become ready or to
+                                   exit successfully, or not launched. */
+
+/**
+ * A program another one of a manifest is launched after.
+ */
+typedef struct iexec_program_dep {
+  int program;          /** The index of the program in the list. */
+  int required;         /** If non-zero, the other program is not launched
+                            if this one fails (requires=). */
+} iexec_program_dep;
+
+/**
+ * A program to launch: its configuration and its prepared launch.
+ */
+typedef struct iexec_program {
+  iexec_config config;  /** The configuration of the program. */
+  iexec_launch launch;  /** The prepared launch of the program. */
+  iexec_program_dep *deps; /** The programs to launch it after. */
+  int num_deps;         /** The number of those programs. */
+  int state;            /** What became of it (IEXEC_PROGRAM_*). */
+} iexec_program;
+
 /**
  * Prints out the usage/help message to standard error.
  */
@@ -111,20 +679,50 @@ void version() {
   printf("%s\n", IEXEC_VERSION);
 }
 
+/** A user looked up by a launch server's worker, kept by the server
+    for the workers it forks later. */
+typedef struct iexec_cached_user {
+  char *name;           /** The user name. */
+  uid_t uid;            /** Its uid. */
+} iexec_cached_user;
+
+/** The users looked up so far (--server only). */
+iexec_cached_user *iexec_user_cache = 0;
+int iexec_num_cached_users = 0;
+
+/** In a worker of --server, the channel to the server that lookups are
+    sent back on, and the connection of the client (-1 = not a worker). */
+int iexec_server_channel_fd = -1;
+int iexec_server_client_fd = -1;
+/** The pid of the worker, which replies to the client when it exits. */
+pid_t iexec_server_worker_pid = 0;
+
 /**
- * Changes to a different user.
+ * Looks up the uid of a user. The lookup goes through NSS, so it is
+ * done by the launching process rather than the launched child. A
+ * worker of --server looks in the server's cache first and sends the
+ * server what it looked up.
  */
 
-void iexec_change_user(const char *user) {
+uid_t iexec_lookup_user(const char *user) {
+  for (int i = 0; i < iexec_num_cached_users; i++) {
+    if (strcmp(iexec_user_cache[i].name, user) == 0) {
+      return iexec_user_cache[i].uid;
+    }
+  }
   struct passwd *pw = getpwnam(user);
   if (pw == 0) {
     error(0, errno, "could not find user %s", user);
     exit(EXIT_FAILURE);
   }
-  if (setuid(pw->pw_uid)) {
-    error(0, errno, "could not change to different user");
-    exit(EXIT_FAILURE);
+  if (iexec_server_channel_fd >= 0 && strlen(user) < 256) {
+    char message[1 + sizeof(uid_t) + 256];
+    message[0] = 'U';
+    memcpy(message + 1, &pw->pw_uid, sizeof(uid_t));
+    strcpy(message + 1 + sizeof(uid_t), user);
+    send(iexec_server_channel_fd, message, 1 + sizeof(uid_t) + strlen(user), MSG_NOSIGNAL);
   }
+  return pw->pw_uid;
 }
 
 /**
@@ -159,615 +757,7295 @@ void iexec_config_set_default_values(iexec_config *config) {
   config->use_stdout_file = "/dev/null";
   config->use_stderr_file = "/dev/null";
   config->use_pid_file = 0;
+  config->adjust_pid = 0;
+  config->adjust_pid_file = 0;
+  config->server = 0;
   config->use_status_file = 0;
   config->use_working_dir = 0;
   config->fds_to_close = 0;
   config->num_fds_to_close = 0;
+  config->close_from = -1;
+  config->fds_to_keep = 0;
+  config->num_fds_to_keep = 0;
   config->username = 0;
   config->no_daemonize = 0;
+  config->cgroup_path = 0;
+  config->cpu_max = 0;
+  config->memory_high = 0;
+  config->memory_max = 0;
+  config->io_weight = 0;
+  config->pids_max = 0;
+  config->cpus = 0;
+  config->numa_node = -1;
+  config->membind = 0;
+  config->interleave = 0;
+  config->sched_policy = -1;
+  config->sched_priority = -1;
+  config->nice = INT_MIN;
+  config->ioprio_class = -1;
+  config->ioprio_level = -1;
+  config->timerslack = -1;
+  config->thp = IEXEC_THP_UNCHANGED;
+  config->ksm = 0;
+  config->mlockall = 0;
+  config->prefault = 0;
+  config->resolve_binary = 0;
+  config->psi_triggers = 0;
+  config->num_psi_triggers = 0;
+  config->psi_signal = 0;
+  config->psi_hook = 0;
+  config->timeout = 0;
+  config->stop_signal = SIGTERM;
+  config->stop_grace = 10000;
+  config->stop_pid_file = 0;
+  config->log_rotate_size = 0;
+  config->log_rotate_interval = 0;
+  config->log_keep = 5;
+  config->stdout_tee = 0;
+  config->stderr_tee = 0;
+  config->listen = 0;
+  config->num_listen = 0;
+  config->listen_backlog = SOMAXCONN;
+  config->listen_reuseport = 0;
+  config->listen_fastopen = 0;
+  config->instances = 1;
+  config->pin_instances = 0;
+  config->instance = -1;
+  config->wait_ready = -1;
+  config->ready_fd = -1;
+  const char *trace_timings = getenv("IEXEC_TRACE_TIMINGS");
+  config->trace_timings = trace_timings != 0 && trace_timings[0] != 0 && strcmp(trace_timings, "0") != 0;
+  config->engine = IEXEC_ENGINE_AUTO;
+  config->redirect = IEXEC_REDIRECT_LEAN;
+  config->verbose = 0;
+  config->batch_file = 0;
+  config->name = 0;
+  config->after = 0;
+  config->requires = 0;
+  config->ordered = 0;
+  config->compile_profiles = 0;
+  config->perf_counters = 0;
+  config->subreaper = 0;
+  config->max_descendants = 0;
+  config->upgrade_pid_file = 0;
+  config->upgrade_pid = 0;
+  config->upgrade_fds = 0;
+  config->status_format = IEXEC_STATUS_FORMAT_TEXT;
+  config->restart = IEXEC_RESTART_NO;
+  config->restart_backoff_min = 100;
+  config->restart_backoff_max = 30000;
+  config->restart_jitter = 0;
+  config->restart_limit = 0;
+  config->restart_window = 60000;
+  config->sample_interval = 0;
   for (int i = 0; i < RLIMIT_NLIMITS; i++) {
     config->soft_limits[i] = IEXEC_RLIMIT_UNCHANGED;
     config->hard_limits[i] = IEXEC_RLIMIT_UNCHANGED;
   }
 }
 
+/** The long options, which are also the keys of a batch manifest line. */
+struct option iexec_long_options[] = {
+    {"batch",                 required_argument, 0, IEXEC_OPTION_BATCH},
+    {"close",                 required_argument, 0, 'c'},
+    {"close-all",             no_argument,       0, IEXEC_OPTION_CLOSE_ALL},
+    {"close-all-except",      required_argument, 0, IEXEC_OPTION_CLOSE_ALL_EXCEPT},
+    {"close-from",            required_argument, 0, IEXEC_OPTION_CLOSE_FROM},
+    {"engine",                required_argument, 0, IEXEC_OPTION_ENGINE},
+    {"help",                  no_argument,       0, 'h'},
+    {"keep-open",             no_argument,       0, 'k'},
+    {"no-daemonize",          no_argument,       0, 'n'},
+    {"pid",                   required_argument, 0, 'p'},
+    {"restart",               required_argument, 0, IEXEC_OPTION_RESTART},
+    {"restart-backoff-max",   required_argument, 0, IEXEC_OPTION_RESTART_BACKOFF_MAX},
+    {"restart-backoff-min",   required_argument, 0, IEXEC_OPTION_RESTART_BACKOFF_MIN},
+    {"restart-jitter",        required_argument, 0, IEXEC_OPTION_RESTART_JITTER},
+    {"restart-limit",         required_argument, 0, IEXEC_OPTION_RESTART_LIMIT},
+    {"restart-window",        required_argument, 0, IEXEC_OPTION_RESTART_WINDOW},
+    {"cgroup-path",           required_argument, 0, IEXEC_OPTION_CGROUP_PATH},
+    {"cpu-max",               required_argument, 0, IEXEC_OPTION_CPU_MAX},
+    {"cpus",                  required_argument, 0, IEXEC_OPTION_CPUS},
+    {"numa-node",             required_argument, 0, IEXEC_OPTION_NUMA_NODE},
+    {"membind",               required_argument, 0, IEXEC_OPTION_MEMBIND},
+    {"interleave",            required_argument, 0, IEXEC_OPTION_INTERLEAVE},
+    {"sched",                 required_argument, 0, IEXEC_OPTION_SCHED},
+    {"sched-priority",        required_argument, 0, IEXEC_OPTION_SCHED_PRIORITY},
+    {"nice",                  required_argument, 0, IEXEC_OPTION_NICE},
+    {"ioprio-class",          required_argument, 0, IEXEC_OPTION_IOPRIO_CLASS},
+    {"ioprio-level",          required_argument, 0, IEXEC_OPTION_IOPRIO_LEVEL},
+    {"timerslack",            required_argument, 0, IEXEC_OPTION_TIMERSLACK},
+    {"log-rotate-size",       required_argument, 0, IEXEC_OPTION_LOG_ROTATE_SIZE},
+    {"log-rotate-interval",   required_argument, 0, IEXEC_OPTION_LOG_ROTATE_INTERVAL},
+    {"log-keep",              required_argument, 0, IEXEC_OPTION_LOG_KEEP},
+    {"stdout-tee",            required_argument, 0, IEXEC_OPTION_STDOUT_TEE},
+    {"stderr-tee",            required_argument, 0, IEXEC_OPTION_STDERR_TEE},
+    {"listen",                required_argument, 0, IEXEC_OPTION_LISTEN},
+    {"listen-backlog",        required_argument, 0, IEXEC_OPTION_LISTEN_BACKLOG},
+    {"listen-reuseport",      no_argument,       0, IEXEC_OPTION_LISTEN_REUSEPORT},
+    {"listen-fastopen",       required_argument, 0, IEXEC_OPTION_LISTEN_FASTOPEN},
+    {"instances",             required_argument, 0, IEXEC_OPTION_INSTANCES},
+    {"pin-instances",         no_argument,       0, IEXEC_OPTION_PIN_INSTANCES},
+    {"wait-ready",            optional_argument, 0, IEXEC_OPTION_WAIT_READY},
+    {"ready-fd",              required_argument, 0, IEXEC_OPTION_READY_FD},
+    {"trace-timings",         no_argument,       0, IEXEC_OPTION_TRACE_TIMINGS},
+    {"redirect",              required_argument, 0, IEXEC_OPTION_REDIRECT},
+    {"thp",                   required_argument, 0, IEXEC_OPTION_THP},
+    {"ksm",                   no_argument,       0, IEXEC_OPTION_KSM},
+    {"mlockall",              optional_argument, 0, IEXEC_OPTION_MLOCKALL},
+    {"prefault",              no_argument,       0, IEXEC_OPTION_PREFAULT},
+    {"resolve-binary",        no_argument,       0, IEXEC_OPTION_RESOLVE_BINARY},
+    {"psi-watch",             required_argument, 0, IEXEC_OPTION_PSI_WATCH},
+    {"psi-signal",            required_argument, 0, IEXEC_OPTION_PSI_SIGNAL},
+    {"psi-hook",              required_argument, 0, IEXEC_OPTION_PSI_HOOK},
+    {"timeout",               required_argument, 0, IEXEC_OPTION_TIMEOUT},
+    {"stop-signal",           required_argument, 0, IEXEC_OPTION_STOP_SIGNAL},
+    {"stop-grace",            required_argument, 0, IEXEC_OPTION_STOP_GRACE},
+    {"stop",                  required_argument, 0, IEXEC_OPTION_STOP},
+    {"name",                  required_argument, 0, IEXEC_OPTION_NAME},
+    {"after",                 required_argument, 0, IEXEC_OPTION_AFTER},
+    {"requires",              required_argument, 0, IEXEC_OPTION_REQUIRES},
+    {"profile",               required_argument, 0, IEXEC_OPTION_PROFILE},
+    {"compile-profiles",      optional_argument, 0, IEXEC_OPTION_COMPILE_PROFILES},
+    {"perf-counters",         required_argument, 0, IEXEC_OPTION_PERF_COUNTERS},
+    {"subreaper",             no_argument,       0, IEXEC_OPTION_SUBREAPER},
+    {"max-descendants",       required_argument, 0, IEXEC_OPTION_MAX_DESCENDANTS},
+    {"upgrade",               required_argument, 0, IEXEC_OPTION_UPGRADE},
+    {"adjust-pid",            required_argument, 0, IEXEC_OPTION_ADJUST_PID},
+    {"adjust-pid-file",       required_argument, 0, IEXEC_OPTION_ADJUST_PID_FILE},
+    {"server",                required_argument, 0, IEXEC_OPTION_SERVER},
+    {"memory-high",           required_argument, 0, IEXEC_OPTION_MEMORY_HIGH},
+    {"memory-max",            required_argument, 0, IEXEC_OPTION_MEMORY_MAX},
+    {"io-weight",             required_argument, 0, IEXEC_OPTION_IO_WEIGHT},
+    {"pids-max",              required_argument, 0, IEXEC_OPTION_PIDS_MAX},
+    {"rlimit-as-hard",        required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_AS},
+    {"rlimit-cpu-hard",       required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_CPU},
+    {"rlimit-fsize-hard",     required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_FSIZE},
+    {"rlimit-data-hard",      required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_DATA},
+    {"rlimit-stack-hard",     required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_STACK},
+    {"rlimit-core-hard",      required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_CORE},
+    {"rlimit-rss-hard",       required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_RSS},
+    {"rlimit-nofile-hard",    required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_NOFILE},
+    {"rlimit-nproc-hard",     required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_NPROC},
+    {"rlimit-memlock-hard",   required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_MEMLOCK},
+    {"rlimit-locks-hard",     required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_LOCKS},
+    {"rlimit-sigpending-hard",required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_SIGPENDING},
+    {"rlimit-msgqueue-hard",  required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_MSGQUEUE},
+    {"rlimit-nice-hard",      required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_NICE},
+    {"rlimit-rtprio-hard",    required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_RTPRIO},
+    {"rlimit-as-soft",        required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_AS},
+    {"rlimit-cpu-soft",       required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_CPU},
+    {"rlimit-fsize-soft",     required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_FSIZE},
+    {"rlimit-data-soft",      required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_DATA},
+    {"rlimit-stack-soft",     required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_STACK},
+    {"rlimit-core-soft",      required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_CORE},
+    {"rlimit-rss-soft",       required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_RSS},
+    {"rlimit-nofile-soft",    required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_NOFILE},
+    {"rlimit-nproc-soft",     required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_NPROC},
+    {"rlimit-memlock-soft",   required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_MEMLOCK},
+    {"rlimit-locks-soft",     required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_LOCKS},
+    {"rlimit-sigpending-soft",required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_SIGPENDING},
+    {"rlimit-msgqueue-soft",  required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_MSGQUEUE},
+    {"rlimit-nice-soft",      required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_NICE},
+    {"rlimit-rtprio-soft",    required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_RTPRIO},
+    {"sample-interval",       required_argument, 0, IEXEC_OPTION_SAMPLE_INTERVAL},
+    {"status",                required_argument, 0, 's'},
+    {"status-format",         required_argument, 0, IEXEC_OPTION_STATUS_FORMAT},
+    {"stdin",                 required_argument, 0, 'i'},
+    {"stdout",                required_argument, 0, 'o'},
+    {"stderr",                required_argument, 0, 'e'},
+    {"umask",                 required_argument, 0, IEXEC_OPTION_UMASK},
+    {"user",                  required_argument, 0, 'u'},
+    {"verbose",               no_argument,       0, 'v'},
+    {"version",               no_argument,       0, IEXEC_OPTION_VERSION},
+    {"working-dir",           required_argument, 0, 'w'},
+    {0, 0, 0, 0}
+};
+
 /**
- * Parse the command line options.
- *
- * @param argc   The command line argument count.
- * @param argv   The command line argument array.
- * @param config The configuration to store parsed option values in.
+ * Appends a file descriptor to an array of them, growing it. Exits if
+ * there is not enough memory.
  */
+void iexec_append_fd(int **fds, int *num_fds, int fd) {
+  /* A temporary pointer to an array of file descriptors. Used
+     for safe realloc. */
+  int *temp_fd_array = realloc(*fds, sizeof(int) * (*num_fds + 1));
+  /* If there is not enough memory to resize the array, free
+     what we have and exit. */
+  if (temp_fd_array == 0) {
+    error(0, errno, "realloc failed");
+    free(*fds);
+    exit(EXIT_FAILURE);
+  }
 
-void parse_options(int argc, char **argv, iexec_config *config) {
-  int option_index = 0;
-  iexec_config_set_default_values(config);
-  while (1) {
-    /* Define the long options in a structure array.*/
-    static struct option long_options[] = {
-      {"close",                 required_argument, 0, 'c'},
-      {"help",                  no_argument,       0, 'h'},
-      {"keep-open",             no_argument,       0, 'k'},
-      {"no-daemonize",          no_argument,       0, 'n'},
-      {"pid",                   required_argument, 0, 'p'},
-      /**{"cgroup-path",           required_argument, 0, IEXEC_OPTION_CGROUP_PATH},*/
-      {"rlimit-as-hard",        required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_AS},
-      {"rlimit-cpu-hard",       required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_CPU},
-      {"rlimit-fsize-hard",     required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_FSIZE},
-      {"rlimit-data-hard",      required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_DATA},
-      {"rlimit-stack-hard",     required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_STACK},
-      {"rlimit-core-hard",      required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_CORE},
-      {"rlimit-rss-hard",       required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_RSS},
-      {"rlimit-nofile-hard",    required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_NOFILE},
-      {"rlimit-nproc-hard",     required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_NPROC},
-      {"rlimit-memlock-hard",   required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_MEMLOCK},
-      {"rlimit-locks-hard",     required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_LOCKS},
-      {"rlimit-sigpending-hard",required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_SIGPENDING},
-      {"rlimit-msgqueue-hard",  required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_MSGQUEUE},
-      {"rlimit-nice-hard",      required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_NICE},
-      {"rlimit-rtprio-hard",    required_argument, 0, IEXEC_OPTION_RLIMIT_HARD + RLIMIT_RTPRIO},
-      {"rlimit-as-soft",        required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_AS},
-      {"rlimit-cpu-soft",       required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_CPU},
-      {"rlimit-fsize-soft",     required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_FSIZE},
-      {"rlimit-data-soft",      required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_DATA},
-      {"rlimit-stack-soft",     required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_STACK},
-      {"rlimit-core-soft",      required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_CORE},
-      {"rlimit-rss-soft",       required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_RSS},
-      {"rlimit-nofile-soft",    required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_NOFILE},
-      {"rlimit-nproc-soft",     required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_NPROC},
-      {"rlimit-memlock-soft",   required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_MEMLOCK},
-      {"rlimit-locks-soft",     required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_LOCKS},
-      {"rlimit-sigpending-soft",required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_SIGPENDING},
-      {"rlimit-msgqueue-soft",  required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_MSGQUEUE},
-      {"rlimit-nice-soft",      required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_NICE},
-      {"rlimit-rtprio-soft",    required_argument, 0, IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_RTPRIO},
-      {"status",                required_argument, 0, 's'},
-      {"stdin",                 required_argument, 0, 'i'},
-      {"stdout",                required_argument, 0, 'o'},
-      {"stderr",                required_argument, 0, 'e'},
-      {"umask",                 required_argument, 0, IEXEC_OPTION_UMASK},
-      {"user",                  required_argument, 0, 'u'},
-      {"version",               no_argument,       0, IEXEC_OPTION_VERSION},
-      {"working-dir",           required_argument, 0, 'w'},
-      {0, 0, 0, 0}
-    };
-    /* The option index which indicates the next option used. */
-    int c = 0;
+  /** If the allocation was successful, update the array pointer. */
+  *fds = temp_fd_array;
+  (*fds)[(*num_fds)++] = fd;
+}
 
-    /* A temporary pointer to an array of file descriptors. Used
-       for safe realloc. */
-    int *temp_fd_array = 0;
-    
-    /* Let's parse the next option. */
-    c = getopt_long (argc, argv, "khns:p:i:o:e:w:c:u:",
-                     long_options, &option_index);
-    
-    /* If its the end of the options, leave the loop. */
-    if (c == -1) {
-      break;
-    }
+/**
+ * Parses a file descriptor number given to an option. Exits if it is
+ * not a number of at least min.
+ */
+int iexec_parse_fd(const char *option, const char *arg, int min) {
+  char *end = 0;
+  long fd = strtol(arg, &end, 10);
+  if (end == arg || *end != 0 || fd < min || fd > INT_MAX) {
+    error(0, 0, "invalid file descriptor `%s' given to --%s (must be at least %d)", arg, option, min);
+    exit(EXIT_FAILURE);
+  }
+  return (int)fd;
+}
 
-    /* If a soft limit was specified, change the corresponding value in the soft_limits
-     array.*/
-    if (c >= IEXEC_OPTION_RLIMIT_SOFT && c < IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_NLIMITS) {
-      int limit_number = c - IEXEC_OPTION_RLIMIT_SOFT;
-      int limit_value = atoi(optarg);
-#ifdef IEXEC_DEBUG
-      printf("setting %s_SOFT=%d\n", limit_names[limit_number], limit_value);
-#endif
-      config->soft_limits[limit_number] = limit_value;
-      continue;
-    }
-    /* If a hard limit was specified, change the corresponding value in the hard_limits
-     array.*/
-    if (c >= IEXEC_OPTION_RLIMIT_HARD && c < IEXEC_OPTION_RLIMIT_HARD + RLIMIT_NLIMITS) {
-      int limit_number = c - IEXEC_OPTION_RLIMIT_HARD;
-      int limit_value = atoi(optarg);
-#ifdef IEXEC_DEBUG
-      printf("setting %s_HARD=%d\n", limit_names[limit_number], limit_value);
-#endif
-      config->hard_limits[limit_number] = limit_value;
-      continue;
+/**
+ * Parses a duration given to an option: a number with an optional unit
+ * of ms, s (the default), m or h, eg 250ms or 1.5s. Exits if it is not
+ * a duration.
+ *
+ * Returns the duration in milliseconds.
+ */
+long long iexec_parse_duration(const char *option, const char *arg) {
+  char *unit = 0;
+  double value = strtod(arg, &unit);
+  double scale = -1;
+  if (unit != arg && value >= 0) {
+    if (*unit == 0 || strcmp(unit, "s") == 0) {
+      scale = 1000;
+    } else if (strcmp(unit, "ms") == 0) {
+      scale = 1;
+    } else if (strcmp(unit, "m") == 0) {
+      scale = 60000;
+    } else if (strcmp(unit, "h") == 0) {
+      scale = 3600000;
     }
+  }
+  if (scale < 0) {
+    error(0, 0, "invalid duration `%s' given to --%s", arg, option);
+    exit(EXIT_FAILURE);
+  }
+  return (long long)(value * scale);
+}
 
-    /* Let's display the usage, set a configuration value, or flag
-       depending on which option was just parsed. */
-    switch (c) {
-    case 0:
-      /* If this option set a flag, do nothing else now. */
-      break;
-    case 'k':
-      config->keep_open = 1;
-      break;
-    case 'n':
-      config->no_daemonize = 1;
-      break;
-    case 'u':
-      {
-        int len = strnlen(optarg,255);
-        config->username = malloc(len+1);
-        strncpy(config->username, optarg, len);
-        if (config->username == 0) {
-          error(0, errno, "could not find space for username");
-        }
-      }
-      break;
-    case 'c':
-      /* If the -c option is specified, add the pid to an array. */
-      config->num_fds_to_close++;
-      temp_fd_array = realloc(config->fds_to_close, sizeof(int) * config->num_fds_to_close);
-      /* If there is not enough memory to resize the array, free
-         what we have and exit. */
-      if (temp_fd_array == 0) {
-        error(0, errno, "realloc failed");
-        free(config->fds_to_close);
-        exit(EXIT_FAILURE);
-      }
-
-      /** If the allocation was successful, update the array pointer. */
-      config->fds_to_close = temp_fd_array;
-      config->fds_to_close[config->num_fds_to_close-1] = atoi(optarg);
-      break;
-    case 'h':
-      usage(0);
-      exit(EXIT_SUCCESS);
-      break;
-    case 'p':
-      config->use_pid_file = optarg;
-      break;
-    case 's':
-      config->use_status_file = optarg;
-      break;
-    case 'i':
-      config->use_stdin_file = optarg;
-      break;
-    case 'o':
-      config->use_stdout_file = optarg;
-      break;
-    case 'e':
-      config->use_stderr_file = optarg;
-      break;
-    case IEXEC_OPTION_CGROUP_PATH:
-      config->cgroup_path = optarg;
-      break;
-    case IEXEC_OPTION_UMASK:
-      config->umask = atoi(optarg);
-      break;
-    case IEXEC_OPTION_VERSION:
-      version(0);
-      exit(EXIT_SUCCESS);
-      break;
-    case 'w':
-      config->use_working_dir = optarg;
-      break;
-    case '?':
-      usage(1);
-      exit(EXIT_FAILURE);
-      /* getopt_long already printed an error message. */
-      break;        
-    default:
-      exit(EXIT_SUCCESS);
+/**
+ * Parses a size given to an option: a number of bytes with an optional
+ * suffix of K, M, G or T (powers of 1024). Exits if it is not a size.
+ */
+long long iexec_parse_size(const char *option, const char *arg) {
+  char *suffix = 0;
+  long long value = strtoll(arg, &suffix, 10);
+  long long scale = -1;
+  if (suffix != arg && value >= 0) {
+    switch (suffix[0] == 0 || suffix[1] == 0 ? suffix[0] : '?') {
+    case 0: scale = 1; break;
+    case 'k': case 'K': scale = 1LL << 10; break;
+    case 'm': case 'M': scale = 1LL << 20; break;
+    case 'g': case 'G': scale = 1LL << 30; break;
+    case 't': case 'T': scale = 1LL << 40; break;
     }
   }
-  /** The remaining arguments begin after the last iexec option
-      and its option argument (if applicable). It should always be positive
-      (ie iexec is never included as an argument).*/
-  config->remaining_argv = argv + optind;
-  config->remaining_argc = argc - optind;
-  return;
+  if (scale < 0 || value > LLONG_MAX / scale) {
+    error(0, 0, "invalid size `%s' given to --%s", arg, option);
+    exit(EXIT_FAILURE);
+  }
+  return value * scale;
 }
 
 /**
- * If the first file does not exist, it is first created.
+ * Parses the value of a --rlimit-* option: a size (see
+ * iexec_parse_size()) or unlimited/infinity for RLIM_INFINITY. Exits if
+ * it is neither.
  *
- * Returns a negative value if an error occured, 0 if the filenames refer to different
- * files and 1 if they refer to the same file.
+ * @param c      The IEXEC_OPTION_RLIMIT_* value of the option.
+ * @param arg    The option argument.
  */
-int same_file(const char *fn1, const char *fn2) {
-  struct stat s1;
-  struct stat s2;
-  int r1 = stat(fn1, &s1);
-  if (r1 < 0) {
-    /** If the file does not exist, create it because it will be used
-        anyway. */
-    if (errno == ENOENT) {
-      int tresult = creat(fn1, 0666);
-      if (tresult < 0) {
-        return tresult;
-      }
-      close(tresult);
-      /** Now try stat() again. */
-      r1 = stat(fn1, &s1);
-    } else { /* An error other than ENOENT occured, propogate it downward. */
-      return r1;
-    }
+rlim_t iexec_parse_rlimit(int c, const char *arg) {
+  if (strcmp(arg, "unlimited") == 0 || strcmp(arg, "infinity") == 0) {
+    return RLIM_INFINITY;
   }
-  /* Now try the stat on the second file. */
-  int r2 = stat(fn2, &s2);
-  if (r2 < 0) {
-    return r2;
+  char option[64];
+  int hard = c >= IEXEC_OPTION_RLIMIT_HARD;
+  int resource = c - (hard ? IEXEC_OPTION_RLIMIT_HARD : IEXEC_OPTION_RLIMIT_SOFT);
+  /** RLIMIT_MEMLOCK -> rlimit-memlock-soft. */
+  snprintf(option, sizeof(option), "rlimit-%s-%s", limit_names[resource] + strlen("RLIMIT_"), hard ? "hard" : "soft");
+  for (char *p = option; *p != 0; p++) {
+    *p = tolower((unsigned char)*p);
   }
-  /* The files are the same iff their device and inode are the same. */
-  return (s1.st_dev == s2.st_dev && s1.st_ino == s2.st_ino) ? 1 : 0; 
+  return iexec_parse_size(option, arg);
 }
 
-int iexec_monitor_child_as_parent(const iexec_config *config, int child_pid, int saved_stderr_fd) {
-  int retval_status = 0;
+/**
+ * Formats a resource limit value for a message: its number, or
+ * unlimited for RLIM_INFINITY.
+ *
+ * @param buffer Where to format the value.
+ * @param size   The size of buffer.
+ * @param value  The limit value.
+ */
+const char *iexec_format_rlimit(char *buffer, size_t size, rlim_t value) {
+  if (value == RLIM_INFINITY) {
+    snprintf(buffer, size, "unlimited");
+  } else {
+    snprintf(buffer, size, "%llu", (unsigned long long)value);
+  }
+  return buffer;
+}
 
-  /** If the pid file was specified, write it to the file.*/
-  if (config->use_pid_file != 0) {
-    if (access(config->use_pid_file, W_OK) != 0 && errno != ENOENT) {
-      int saved_errno = errno;
-      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-        error(0, saved_errno, "file specified with -p (%s) is not writable", config->use_pid_file);
-      }
-      exit(EXIT_FAILURE);
-    }
-    
-    FILE *pid_file = fopen(config->use_pid_file, "w");
-    
-    /** If an error occurred when trying to open the pid_file, return it. */
-    if (pid_file == 0) {
-      int saved_errno = errno;
-      error(0, saved_errno, "unable to write pid file `%s'", config->use_pid_file);
-      exit(EXIT_FAILURE);
-    }
-    /** Write the pid to the pid file. */
-    int nc = fprintf(pid_file, "%d\n", child_pid);
-    if (nc == 0) {
-      int saved_errno = errno;
-      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-        error(0, saved_errno, "unable to write data to pid file `%s'", config->use_pid_file);
-      }
-      exit(EXIT_FAILURE);        
-    }
-    
-    /** Close the pid file. */
-    fclose(pid_file);
+/**
+ * Parses a non-negative integer given to an option. Exits if it is not
+ * one.
+ */
+int iexec_parse_count(const char *option, const char *arg) {
+  char *end = 0;
+  long value = strtol(arg, &end, 10);
+  if (end == arg || *end != 0 || value < 0 || value > INT_MAX) {
+    error(0, 0, "invalid number `%s' given to --%s", arg, option);
+    exit(EXIT_FAILURE);
   }
+  return (int)value;
+}
 
-  /** If the pid file was specified, write it to the file.*/
-  if (config->use_status_file != 0) {
-    if (access(config->use_status_file, W_OK) != 0 && errno != ENOENT) {
-      int saved_errno = errno;
-      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-        error(0, saved_errno, "file specified with -s (%s) is not writable", config->use_status_file);
-      }
-      exit(EXIT_FAILURE);
-    }
-    
-    FILE *status_file = fopen(config->use_status_file, "w");
-    
-    /** If an error occurred when trying to open the pid_file, return it. */
-    if (status_file == 0) {
-      int saved_errno = errno;
-      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-        error(0, saved_errno, "unable to write status file `%s'", config->use_status_file);
-      }
-      exit(EXIT_FAILURE);
+/**
+ * Parses a signal given to an option: its number, or its name with or
+ * without SIG, eg TERM, SIGUSR1 or 10. Exits if it is not a signal.
+ */
+int iexec_parse_signal(const char *option, const char *arg) {
+  char *end = 0;
+  long value = strtol(arg, &end, 10);
+  if (end != arg && *end == 0 && value > 0 && value < NSIG) {
+    return (int)value;
+  }
+  const char *name = strncasecmp(arg, "SIG", 3) == 0 ? arg + 3 : arg;
+  for (int i = 1; i < NSIG; i++) {
+    const char *abbrev = sigabbrev_np(i);
+    if (abbrev != 0 && strcasecmp(abbrev, name) == 0) {
+      return i;
     }
-    fprintf(status_file, "pid %d\n", child_pid);
-    /** While the child hasn't terminated, keep waiting for a status change. */
-    while (1) {
-      /** Slot to store the status. */
-      int status;
-      int wret = waitpid(child_pid, &status, 0);
-      /** If successful in reading a status change... */
-      if (wret > 0) {
-        /** If the child exited, write the exit status. */
-        if (WIFEXITED(status)) {
-          int estatus = WEXITSTATUS(status);
-          fprintf(status_file, "exit %d\n", estatus);
-          retval_status = estatus;
-          break;
-        }
-        /** If the child was signaled and terminated, write the signal code. */
-        else if (WIFSIGNALED(status)) {
-          int esignal = WTERMSIG(status);
-          fprintf(status_file, "kill %d\n", esignal);
-          retval_status = 128 + esignal;
-          break;
-        }
-        /** If the child was signaled and stopped, write the signal code. */
-        else if (WIFSTOPPED(status)) {
-          int esignal = WSTOPSIG(status);
-          fprintf(status_file, "stop %d\n", esignal);
-        }
-        /** If the child was continued, write the signal code. */
-        else if (WIFCONTINUED(status)) {
-          int esignal = 18;
-          fprintf(status_file, "cont %d\n", esignal);
-        }
-      }
-      /** If there was an error, report it. */
-      else {
-        fprintf(status_file, "err\n");
-        fclose(status_file);
-        int saved_errno = errno;
-        if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-          error(0, saved_errno, "error waiting for child `%d'", child_pid);
-        }
-        exit(EXIT_FAILURE);
-      }
-    } 
-    /** Close the pid file. */
-    fclose(status_file);
   }
-  return retval_status;
+  error(0, 0, "invalid signal `%s' given to --%s", arg, option);
+  exit(EXIT_FAILURE);
 }
 
 /**
- * The main function.
+ * Appends the comma-separated names given to --after or --requires to
+ * those given before, so the option can be repeated.
  *
- * @param argc   The command line argument count.
- * @param argv   The command line argument array.
+ * Returns the names, or the new ones if there were none before.
  */
-
-int main(int argc, char **argv) {
-  pid_t child_pid = 0, session_pid = 0;   /* The child pid and session pid. */
-  iexec_config config;            /* The configuration. */
-  int k;                          /* Looper variable. */
-
-  /** Parse the options into the configuration. */
-  parse_options(argc, argv, &config);
-
-  /** If there are no remaining arguments after the options, print an error,
-      and exit since a program must be provided. */
-  if (config.remaining_argc == 0) {
-    error(0, 0, "a program and its arguments are required!");
+char *iexec_append_names(char *names, char *arg) {
+  if (names == 0) {
+    return arg;
+  }
+  char *joined = malloc(strlen(names) + strlen(arg) + 2);
+  if (joined == 0) {
+    error(0, errno, "malloc failed");
     exit(EXIT_FAILURE);
   }
+  sprintf(joined, "%s,%s", names, arg);
+  return joined;
+}
 
-  /** Save standard error's file desciptor in case setsid() or execvp() fails. */
-  int saved_stderr_fd = 2;
+/**
+ * Returns the name manifest entries refer to a program by: the one given
+ * with --name, or the basename of the program.
+ */
+const char *iexec_program_name(const iexec_config *config) {
+  if (config->name != 0) {
+    return config->name;
+  }
+  const char *slash = strrchr(config->remaining_argv[0], '/');
+  return slash != 0 ? slash + 1 : config->remaining_argv[0];
+}
 
-  /** For each resource limit, */
-  for (int i = 0; i < RLIMIT_NLIMITS; i++) {
-    /* If the soft_limit or hard_limit is specified as an option, process it. */
-    const int soft_limit = config.soft_limits[i];
-    const int hard_limit = config.hard_limits[i];
-    if (soft_limit > IEXEC_RLIMIT_UNCHANGED || hard_limit > IEXEC_RLIMIT_UNCHANGED) {
-      struct rlimit current_limit;
-      getrlimit(i, &current_limit);
-      /* If the soft limit was specified, check for validity, and then set it in the structure. */
-      if (soft_limit > IEXEC_RLIMIT_UNCHANGED) {
-        /* Check to see if the soft limit is valid. */
-        if (current_limit.rlim_max != RLIM_INFINITY
-            && soft_limit > current_limit.rlim_max) {
-          error(0, 0, "specified %s_SOFT=%d exceeds %s_HARD=%d",
-                limit_names[i], soft_limit, limit_names[i], (int)current_limit.rlim_max);
-          exit(EXIT_FAILURE);
-        }
-        current_limit.rlim_cur = soft_limit;
-      }
-      /* If the hard limit was specified, set it in the structure. */
-      if (hard_limit > IEXEC_RLIMIT_UNCHANGED) {
-        current_limit.rlim_max = hard_limit;
-      }
-      /* If the soft limit option is greater than the hard limit, set
-         the soft limit to the hard limit. */
-      if (current_limit.rlim_max != RLIM_INFINITY
-          && current_limit.rlim_cur > current_limit.rlim_max) {
-        current_limit.rlim_cur = current_limit.rlim_max;
-      }
-      if (setrlimit(i, &current_limit) < 0) {
-        if (soft_limit != IEXEC_RLIMIT_UNCHANGED) {
-          error(0, errno, "error setting resource limit %s_SOFT=%d", limit_names[i], soft_limit);
-        }
-        if (hard_limit != IEXEC_RLIMIT_UNCHANGED) {
-          error(0, errno, "error setting resource limit %s_HARD=%d", limit_names[i], hard_limit);
-        }
-        exit(EXIT_FAILURE);
+/**
+ * Parses a trigger of --psi-watch, RESOURCE:some|full:STALL/WINDOW, with
+ * the resource cpu, memory or io and the times in microseconds, eg
+ * memory:some:150000/1000000. The kernel takes windows from 500ms to
+ * 10s. Exits if it is not such a trigger.
+ *
+ * @param arg     The trigger.
+ * @param trigger Where to store it.
+ */
+void iexec_parse_psi_trigger(const char *arg, iexec_psi_trigger *trigger) {
+  size_t len = strcspn(arg, ":");
+  trigger->resource = -1;
+  for (int i = 0; i < (int)(sizeof(psi_names) / sizeof(psi_names[0])); i++) {
+    if (strlen(psi_names[i]) == len && strncmp(arg, psi_names[i], len) == 0) {
+      trigger->resource = i;
+    }
+  }
+  const char *kind = arg + len + (arg[len] == ':');
+  trigger->full = strncmp(kind, "full:", 5) == 0;
+  char *end = 0;
+  if (trigger->resource >= 0 && (trigger->full || strncmp(kind, "some:", 5) == 0)) {
+    trigger->stall = strtoll(kind + 5, &end, 10);
+    if (*end == '/') {
+      const char *window = end + 1;
+      trigger->window = strtoll(window, &end, 10);
+      if (end == window) {
+        end = 0;
       }
+    } else {
+      end = 0;
     }
   }
+  if (end == 0 || *end != 0 || trigger->stall <= 0 || trigger->stall > trigger->window
+      || trigger->window < 500000 || trigger->window > 10000000) {
+    error(0, 0, "invalid trigger `%s' given to --psi-watch (must be cpu|memory|io:some|full:STALL/WINDOW in us, with WINDOW from 500000 to 10000000)", arg);
+    exit(EXIT_FAILURE);
+  }
+}
 
-  /** Change the effective user id. */
-  if (config.username != 0) {
-    iexec_change_user(config.username);
+/**
+ * Applies one parsed option to the configuration. This is shared by the
+ * command line parser and the batch manifest reader; options that do not
+ * describe a launch (--help, --version, --batch) are handled by the
+ * callers.
+ *
+ * @param config The configuration to store the option value in.
+ * @param c      The option (its short name or IEXEC_OPTION_* value).
+ * @param arg    The option argument, or 0 if it takes none.
+ */
+void iexec_config_apply_option(iexec_config *config, int c, char *arg) {
+  /* If a soft limit was specified, change the corresponding value in the soft_limits
+   array.*/
+  if (c >= IEXEC_OPTION_RLIMIT_SOFT && c < IEXEC_OPTION_RLIMIT_SOFT + RLIMIT_NLIMITS) {
+    int limit_number = c - IEXEC_OPTION_RLIMIT_SOFT;
+    rlim_t limit_value = iexec_parse_rlimit(c, arg);
+#ifdef IEXEC_DEBUG
+    printf("setting %s_SOFT=%llu\n", limit_names[limit_number], (unsigned long long)limit_value);
+#endif
+    config->soft_limits[limit_number] = limit_value;
+    return;
   }
-  
-  /** If the stdin,stderr,stdout file descriptors are not to be kept
-      open (ie they are to be closed) then check if the paths provided
-      with -i, -o, and -e exist and have the right permissions. */
-  if (!config.keep_open) {
-    if (access(config.use_stdin_file, R_OK) != 0 && errno != ENOENT) {
-      error(0, errno, "file specified with -i (%s) is not readable", config.use_stdin_file);
+  /* If a hard limit was specified, change the corresponding value in the hard_limits
+   array.*/
+  if (c >= IEXEC_OPTION_RLIMIT_HARD && c < IEXEC_OPTION_RLIMIT_HARD + RLIMIT_NLIMITS) {
+    int limit_number = c - IEXEC_OPTION_RLIMIT_HARD;
+    rlim_t limit_value = iexec_parse_rlimit(c, arg);
+#ifdef IEXEC_DEBUG
+    printf("setting %s_HARD=%llu\n", limit_names[limit_number], (unsigned long long)limit_value);
+#endif
+    config->hard_limits[limit_number] = limit_value;
+    return;
+  }
+
+  /* Set a configuration value, or flag depending on which option was
+     just parsed. */
+  switch (c) {
+  case 0:
+    /* If this option set a flag, do nothing else now. */
+    break;
+  case 'k':
+    config->keep_open = 1;
+    break;
+  case 'n':
+    config->no_daemonize = 1;
+    break;
+  case 'v':
+    config->verbose = 1;
+    break;
+  case 'u':
+    config->username = strndup(arg, 255);
+    if (config->username == 0) {
+      error(0, errno, "could not find space for username");
       exit(EXIT_FAILURE);
     }
-    if (access(config.use_stdout_file, W_OK) != 0 && errno != ENOENT) {
-      error(0, errno, "file specified with -o (%s) is not writable", config.use_stdout_file);
-      exit(EXIT_FAILURE);
+    break;
+  case 'c':
+    /* If the -c option is specified, add the pid to an array. */
+    iexec_append_fd(&config->fds_to_close, &config->num_fds_to_close, atoi(arg));
+    break;
+  case IEXEC_OPTION_CLOSE_FROM:
+    config->close_from = iexec_parse_fd("close-from", arg, 3);
+    break;
+  case IEXEC_OPTION_CLOSE_ALL:
+    config->close_from = 3;
+    break;
+  case IEXEC_OPTION_CLOSE_ALL_EXCEPT:
+    /** The list is comma-separated, eg 3,7,9. */
+    config->close_from = 3;
+    for (char *fd = strtok(arg, ","); fd != 0; fd = strtok(0, ",")) {
+      iexec_append_fd(&config->fds_to_keep, &config->num_fds_to_keep,
+                      iexec_parse_fd("close-all-except", fd, 0));
+    }
+    break;
+  case 'p':
+    config->use_pid_file = arg;
+    break;
+  case 's':
+    config->use_status_file = arg;
+    break;
+  case 'i':
+    config->use_stdin_file = arg;
+    break;
+  case 'o':
+    config->use_stdout_file = arg;
+    break;
+  case 'e':
+    config->use_stderr_file = arg;
+    break;
+  case IEXEC_OPTION_CGROUP_PATH:
+    config->cgroup_path = arg;
+    break;
+  case IEXEC_OPTION_CPU_MAX:
+    config->cpu_max = arg;
+    break;
+  case IEXEC_OPTION_MEMORY_HIGH:
+    config->memory_high = arg;
+    break;
+  case IEXEC_OPTION_MEMORY_MAX:
+    config->memory_max = arg;
+    break;
+  case IEXEC_OPTION_IO_WEIGHT:
+    config->io_weight = arg;
+    break;
+  case IEXEC_OPTION_PIDS_MAX:
+    config->pids_max = arg;
+    break;
+  case IEXEC_OPTION_CPUS:
+    config->cpus = arg;
+    break;
+  case IEXEC_OPTION_NUMA_NODE:
+    config->numa_node = iexec_parse_count("numa-node", arg);
+    break;
+  case IEXEC_OPTION_MEMBIND:
+    config->membind = arg;
+    break;
+  case IEXEC_OPTION_INTERLEAVE:
+    config->interleave = arg;
+    break;
+  case IEXEC_OPTION_SCHED:
+    config->sched_policy = -1;
+    for (int i = 0; i < (int)(sizeof(sched_policies) / sizeof(sched_policies[0])); i++) {
+      if (strcmp(arg, sched_policies[i].name) == 0) {
+        config->sched_policy = sched_policies[i].policy;
+      }
     }
-    if (access(config.use_stderr_file, W_OK) != 0 && errno != ENOENT) {
-      error(0, errno, "file specified with -e (%s) is not writable", config.use_stdout_file);
+    if (config->sched_policy < 0) {
+      error(0, 0, "unknown scheduling policy `%s'", arg);
       exit(EXIT_FAILURE);
     }
-    saved_stderr_fd = dup(STDERR_FILENO);
-    /** Otherwise, save away standard error in case we need it later. */
-    if (saved_stderr_fd >= 0) {
-      if (set_cloexec_flag(saved_stderr_fd) != 0) {
-        error(0, errno, "cannot arrange for stderr file descriptor to close before execvp()");
+    break;
+  case IEXEC_OPTION_SCHED_PRIORITY:
+    config->sched_priority = iexec_parse_count("sched-priority", arg);
+    break;
+  case IEXEC_OPTION_NICE:
+    {
+      char *end = 0;
+      long nice = strtol(arg, &end, 10);
+      if (end == arg || *end != 0 || nice < -20 || nice > 19) {
+        error(0, 0, "invalid nice value `%s' (must be from -20 to 19)", arg);
+        exit(EXIT_FAILURE);
       }
+      config->nice = nice;
     }
-  }
-
-  /** Before doing thing else, eg closing/reopening file descriptors,
-      change directory to working directory if appropriate. */
-  if (config.use_working_dir != 0) {
-    if (chdir(config.use_working_dir) < 0) {
-      error(0, errno, "unable to change directory to `%s'", config.use_working_dir);
-      exit(EXIT_FAILURE);
+    break;
+  case IEXEC_OPTION_IOPRIO_CLASS:
+    config->ioprio_class = -1;
+    for (int i = IEXEC_IOPRIO_CLASS_REALTIME; i <= IEXEC_IOPRIO_CLASS_IDLE; i++) {
+      if (strcmp(arg, ioprio_class_names[i]) == 0) {
+        config->ioprio_class = i;
+      }
     }
-  }
-
-  /** Close the file descriptor descriptors inherited from
-      the parent that were specified with the -C option. */
-  for (k = 0; k < config.num_fds_to_close; k++) {
-    /** Close the file. */
-    int fd_close_status = close(config.fds_to_close[k]);
-
-    /** If the close was not successful, for security
-        reasons, exit. */
-    if (fd_close_status < 0) {
-      error(0, errno, "unable to close file descriptor %d",
-            config.fds_to_close[k]);
+    if (config->ioprio_class < 0) {
+      error(0, 0, "unknown I/O scheduling class `%s'", arg);
       exit(EXIT_FAILURE);
     }
-  }
-
-  /** If the file descriptors were not supposed to be kept open, close
-      them and reopen them according to the options -i, -o, and -e.*/
-  if (!config.keep_open) {
-    FILE *result = 0;
-    /** Try closing standard in. */
-    if (close(STDIN_FILENO) < 0) {
-      error(0, errno, "unable to close stdin");
+    break;
+  case IEXEC_OPTION_IOPRIO_LEVEL:
+    config->ioprio_level = iexec_parse_count("ioprio-level", arg);
+    if (config->ioprio_level > 7) {
+      error(0, 0, "invalid I/O priority level `%s' (must be from 0 to 7)", arg);
       exit(EXIT_FAILURE);
     }
-    /** Try closing standard out. */
-    if (close(STDOUT_FILENO) < 0) {
-      error(0, errno, "unable to close stdout");
+    break;
+  case IEXEC_OPTION_TIMERSLACK:
+    config->timerslack = iexec_parse_count("timerslack", arg);
+    break;
+  case IEXEC_OPTION_THP:
+    if (strcmp(arg, thp_names[IEXEC_THP_NEVER]) == 0) {
+      config->thp = IEXEC_THP_NEVER;
+    } else if (strcmp(arg, thp_names[IEXEC_THP_ALWAYS]) == 0) {
+      config->thp = IEXEC_THP_ALWAYS;
+    } else {
+      error(0, 0, "unknown transparent hugepage mode `%s' (must be always or never)", arg);
       exit(EXIT_FAILURE);
     }
-    /** Try closing standard error. */
-    if (close(STDERR_FILENO) < 0) {
-      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-        error(0, errno, "failed to close standard error");
+    break;
+  case IEXEC_OPTION_KSM:
+    config->ksm = 1;
+    break;
+  case IEXEC_OPTION_PERF_COUNTERS:
+    config->perf_counters = 0;
+    for (char *name = strtok(arg, ","); name != 0; name = strtok(0, ",")) {
+      int i = 0;
+      while (i < IEXEC_NUM_PERF_COUNTERS && strcmp(name, perf_names[i]) != 0) {
+        i++;
       }
-      exit(EXIT_FAILURE);
+      if (i == IEXEC_NUM_PERF_COUNTERS) {
+        error(0, 0, "unknown perf counter `%s' given to --perf-counters", name);
+        exit(EXIT_FAILURE);
+      }
+      config->perf_counters |= 1 << i;
     }
-    /** Try reopening standard input using the file specified -i. */
-    result = freopen(config.use_stdin_file, "r", stdin);
-    if (result == 0) {
-      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-        error(0, errno, "failed to redirect standard input");
+    break;
+  case IEXEC_OPTION_SUBREAPER:
+    config->subreaper = 1;
+    break;
+  case IEXEC_OPTION_MAX_DESCENDANTS:
+    config->max_descendants = iexec_parse_count("max-descendants", arg);
+    config->subreaper = 1;
+    break;
+  case IEXEC_OPTION_MLOCKALL:
+    if (arg == 0) {
+      config->mlockall = MCL_CURRENT | MCL_FUTURE;
+      break;
+    }
+    config->mlockall = 0;
+    for (char *flag = strtok(arg, ","); flag != 0; flag = strtok(0, ",")) {
+      if (strcmp(flag, "current") == 0) {
+        config->mlockall |= MCL_CURRENT;
+      } else if (strcmp(flag, "future") == 0) {
+        config->mlockall |= MCL_FUTURE;
+      } else if (strcmp(flag, "onfault") == 0) {
+        config->mlockall |= MCL_ONFAULT;
+      } else {
+        error(0, 0, "unknown mlockall flag `%s' (must be current, future or onfault)", flag);
+        exit(EXIT_FAILURE);
       }
+    }
+    if ((config->mlockall & (MCL_CURRENT | MCL_FUTURE)) == 0) {
+      error(0, 0, "--mlockall needs current, future or both");
       exit(EXIT_FAILURE);
     }
-    /** If both the standard output and standard error refer to the same
-         file, truncate the file and use append mode in the later freopen
-         calls. Otherwise, use write with truncate*/
-    int outerr_same = same_file(config.use_stdout_file, config.use_stderr_file);
-    const char *open_mode = "a";
-    if (outerr_same < 0) { /*** An error occurred. */
-      if (errno != ENOENT) {
-        if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-          error(0, errno, "stat() error");
-        }
+    break;
+  case IEXEC_OPTION_PREFAULT:
+    config->prefault = 1;
+    break;
+  case IEXEC_OPTION_RESOLVE_BINARY:
+    config->resolve_binary = 1;
+    break;
+  case IEXEC_OPTION_PSI_WATCH:
+    {
+      iexec_psi_trigger *temp_triggers = realloc(config->psi_triggers, sizeof(iexec_psi_trigger) * (config->num_psi_triggers + 1));
+      if (temp_triggers == 0) {
+        error(0, errno, "realloc failed");
         exit(EXIT_FAILURE);
       }
-      open_mode = "w";
-    } else if (outerr_same == 0) { /*** DIFFERENT: use write with truncate mode. */
-      open_mode = "w";
+      config->psi_triggers = temp_triggers;
+      iexec_parse_psi_trigger(arg, &config->psi_triggers[config->num_psi_triggers++]);
     }
-    /** Try reopening standard output using the file specified with -o. */
-    result = freopen(config.use_stdout_file, open_mode, stdout);
-    if (result == 0) {
-      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-        error(0, errno, "failed to redirect standard output");
-      }
+    break;
+  case IEXEC_OPTION_PSI_SIGNAL:
+    config->psi_signal = iexec_parse_signal("psi-signal", arg);
+    break;
+  case IEXEC_OPTION_PSI_HOOK:
+    config->psi_hook = arg;
+    break;
+  case IEXEC_OPTION_TIMEOUT:
+    config->timeout = iexec_parse_duration("timeout", arg);
+    break;
+  case IEXEC_OPTION_STOP_SIGNAL:
+    config->stop_signal = iexec_parse_signal("stop-signal", arg);
+    break;
+  case IEXEC_OPTION_STOP_GRACE:
+    config->stop_grace = iexec_parse_duration("stop-grace", arg);
+    break;
+  case IEXEC_OPTION_STOP:
+    config->stop_pid_file = arg;
+    break;
+  case IEXEC_OPTION_UPGRADE:
+    config->upgrade_pid_file = arg;
+    break;
+  case IEXEC_OPTION_NAME:
+    if (arg[0] == 0 || strchr(arg, ',') != 0) {
+      error(0, 0, "invalid name `%s' given to --name", arg);
       exit(EXIT_FAILURE);
     }
-    else if (outerr_same == 1) { /** Truncate the file. */
-      struct stat out_stat;
-      if (stat(config.use_stdout_file, &out_stat) < 0) {
-        if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-          error(0, errno, "stat() error");
-        }
+    config->name = arg;
+    break;
+  case IEXEC_OPTION_AFTER:
+    config->after = iexec_append_names(config->after, arg);
+    break;
+  case IEXEC_OPTION_REQUIRES:
+    config->requires = iexec_append_names(config->requires, arg);
+    break;
+  case IEXEC_OPTION_ADJUST_PID:
+    config->adjust_pid = iexec_parse_count("adjust-pid", arg);
+    if (config->adjust_pid == 0) {
+      error(0, 0, "invalid pid `%s' given to --adjust-pid", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case IEXEC_OPTION_ADJUST_PID_FILE:
+    config->adjust_pid_file = arg;
+    break;
+  case IEXEC_OPTION_SERVER:
+    config->server = arg;
+    break;
+  case IEXEC_OPTION_LOG_ROTATE_SIZE:
+    config->log_rotate_size = iexec_parse_size("log-rotate-size", arg);
+    break;
+  case IEXEC_OPTION_LOG_ROTATE_INTERVAL:
+    config->log_rotate_interval = iexec_parse_duration("log-rotate-interval", arg);
+    break;
+  case IEXEC_OPTION_LOG_KEEP:
+    config->log_keep = iexec_parse_count("log-keep", arg);
+    break;
+  case IEXEC_OPTION_LISTEN:
+    if (strncmp(arg, "unix:", 5) != 0 && strncmp(arg, "tcp:", 4) != 0) {
+      error(0, 0, "invalid address `%s' given to --listen (must be tcp:ADDR:PORT or unix:PATH)", arg);
+      exit(EXIT_FAILURE);
+    }
+    {
+      char **temp_listen = realloc(config->listen, sizeof(char *) * (config->num_listen + 1));
+      if (temp_listen == 0) {
+        error(0, errno, "realloc failed");
         exit(EXIT_FAILURE);
       }
-      if (S_ISREG(out_stat.st_mode)) {
-        if (ftruncate(1, 0) < 0) {
-          if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-            error(0, errno, "truncate() error");
-          }
-        }
-      }
+      config->listen = temp_listen;
+      config->listen[config->num_listen++] = arg;
     }
-
-    /** Try reopening standard error using the file specified with -e. */
-    result = freopen(config.use_stderr_file, open_mode, stderr);
-    if (result == 0) {
-      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-        error(0, errno, "failed to redirect standard error");
+    break;
+  case IEXEC_OPTION_LISTEN_BACKLOG:
+    config->listen_backlog = iexec_parse_count("listen-backlog", arg);
+    break;
+  case IEXEC_OPTION_LISTEN_REUSEPORT:
+    config->listen_reuseport = 1;
+    break;
+  case IEXEC_OPTION_LISTEN_FASTOPEN:
+    config->listen_fastopen = iexec_parse_count("listen-fastopen", arg);
+    break;
+  case IEXEC_OPTION_INSTANCES:
+    config->instances = iexec_parse_count("instances", arg);
+    if (config->instances < 1) {
+      error(0, 0, "invalid number of instances `%s' (must be at least 1)", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case IEXEC_OPTION_PIN_INSTANCES:
+    config->pin_instances = 1;
+    break;
+  case IEXEC_OPTION_WAIT_READY:
+    config->wait_ready = arg != 0 ? iexec_parse_duration("wait-ready", arg) : 0;
+    break;
+  case IEXEC_OPTION_READY_FD:
+    config->ready_fd = iexec_parse_fd("ready-fd", arg, STDERR_FILENO + 1);
+    break;
+  case IEXEC_OPTION_TRACE_TIMINGS:
+    config->trace_timings = 1;
+    break;
+  case IEXEC_OPTION_STDOUT_TEE:
+  case IEXEC_OPTION_STDERR_TEE:
+    if (strncmp(arg, "unix:", 5) != 0 && strncmp(arg, "tcp:", 4) != 0) {
+      error(0, 0, "invalid address `%s' given to --%s (must be unix:PATH or tcp:HOST:PORT)",
+            arg, c == IEXEC_OPTION_STDOUT_TEE ? "stdout-tee" : "stderr-tee");
+      exit(EXIT_FAILURE);
+    }
+    if (c == IEXEC_OPTION_STDOUT_TEE) {
+      config->stdout_tee = arg;
+    } else {
+      config->stderr_tee = arg;
+    }
+    break;
+  case IEXEC_OPTION_ENGINE:
+    if (strcmp(arg, engine_names[IEXEC_ENGINE_AUTO]) == 0) {
+      config->engine = IEXEC_ENGINE_AUTO;
+    } else if (strcmp(arg, engine_names[IEXEC_ENGINE_VFORK]) == 0) {
+      config->engine = IEXEC_ENGINE_VFORK;
+    } else if (strcmp(arg, engine_names[IEXEC_ENGINE_FORK]) == 0) {
+      config->engine = IEXEC_ENGINE_FORK;
+    } else if (strcmp(arg, engine_names[IEXEC_ENGINE_CLONE3]) == 0) {
+      config->engine = IEXEC_ENGINE_CLONE3;
+    } else {
+      error(0, 0, "unknown launch engine `%s'", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case IEXEC_OPTION_UMASK:
+    {
+      char *end = 0;
+      long mask = strtol(arg, &end, 8);
+      if (end == arg || *end != 0 || mask < 0 || mask > 0777) {
+        error(0, 0, "invalid umask `%s' (must be octal, from 0 to 777)", arg);
+        exit(EXIT_FAILURE);
       }
+      config->umask = mask;
+    }
+    break;
+  case IEXEC_OPTION_REDIRECT:
+    if (strcmp(arg, redirect_names[IEXEC_REDIRECT_LEAN]) == 0) {
+      config->redirect = IEXEC_REDIRECT_LEAN;
+    } else if (strcmp(arg, redirect_names[IEXEC_REDIRECT_COMPAT]) == 0) {
+      config->redirect = IEXEC_REDIRECT_COMPAT;
+    } else {
+      error(0, 0, "unknown redirection `%s'", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case IEXEC_OPTION_STATUS_FORMAT:
+    if (strcmp(arg, status_format_names[IEXEC_STATUS_FORMAT_TEXT]) == 0) {
+      config->status_format = IEXEC_STATUS_FORMAT_TEXT;
+    } else if (strcmp(arg, status_format_names[IEXEC_STATUS_FORMAT_MMAP]) == 0) {
+      config->status_format = IEXEC_STATUS_FORMAT_MMAP;
+    } else if (strcmp(arg, status_format_names[IEXEC_STATUS_FORMAT_JSONL]) == 0) {
+      config->status_format = IEXEC_STATUS_FORMAT_JSONL;
+    } else {
+      error(0, 0, "unknown status format `%s'", arg);
       exit(EXIT_FAILURE);
     }
+    break;
+  case IEXEC_OPTION_RESTART:
+    if (strcmp(arg, restart_names[IEXEC_RESTART_NO]) == 0) {
+      config->restart = IEXEC_RESTART_NO;
+    } else if (strcmp(arg, restart_names[IEXEC_RESTART_ON_FAILURE]) == 0) {
+      config->restart = IEXEC_RESTART_ON_FAILURE;
+    } else if (strcmp(arg, restart_names[IEXEC_RESTART_ALWAYS]) == 0) {
+      config->restart = IEXEC_RESTART_ALWAYS;
+    } else {
+      error(0, 0, "unknown restart policy `%s'", arg);
+      exit(EXIT_FAILURE);
+    }
+    break;
+  case IEXEC_OPTION_RESTART_BACKOFF_MIN:
+    config->restart_backoff_min = iexec_parse_duration("restart-backoff-min", arg);
+    break;
+  case IEXEC_OPTION_RESTART_BACKOFF_MAX:
+    config->restart_backoff_max = iexec_parse_duration("restart-backoff-max", arg);
+    break;
+  case IEXEC_OPTION_RESTART_JITTER:
+    {
+      char *end = 0;
+      config->restart_jitter = strtod(arg, &end);
+      if (end == arg || *end != 0 || config->restart_jitter < 0 || config->restart_jitter > 1) {
+        error(0, 0, "invalid jitter `%s' given to --restart-jitter (must be from 0 to 1)", arg);
+        exit(EXIT_FAILURE);
+      }
+    }
+    break;
+  case IEXEC_OPTION_RESTART_LIMIT:
+    config->restart_limit = iexec_parse_count("restart-limit", arg);
+    break;
+  case IEXEC_OPTION_RESTART_WINDOW:
+    config->restart_window = iexec_parse_duration("restart-window", arg);
+    break;
+  case IEXEC_OPTION_SAMPLE_INTERVAL:
+    config->sample_interval = iexec_parse_duration("sample-interval", arg);
+    break;
+  case 'w':
+    config->use_working_dir = arg;
+    break;
+  default:
+    exit(EXIT_SUCCESS);
   }
+}
+
+char *iexec_profiles_path(void);
+void iexec_apply_profile(iexec_config *config, const char *name);
+
+/**
+ * Parse the command line options.
+ *
+ * @param argc   The command line argument count.
+ * @param argv   The command line argument array.
+ * @param config The configuration to store parsed option values in.
+ */
 
-  /** Fork to create a child process. */
-  child_pid = fork();
+void parse_options(int argc, char **argv, iexec_config *config) {
+  int option_index = 0;
+  /** The options are applied once they are all parsed, after the
+      profiles, so that they override the profiles wherever given. */
+  struct { int c; char *arg; } options[argc > 0 ? argc : 1];
+  int num_options = 0;
+  iexec_config_set_default_values(config);
+  while (1) {
+    /* The option index which indicates the next option used. */
+    int c = 0;
 
-  /** If I am the child process, set the mask (if appropriate option is
-      set), create a new session with setsid(), open and close file descriptors
-      depending on the options set, and then execvp() */
-  if (child_pid == 0) {
-    /** If the umask option was specified. */
-    if (config.umask >= 0) {
-      umask(config.umask);
+    /* Let's parse the next option. */
+    c = getopt_long (argc, argv, "khnvs:p:i:o:e:w:c:u:",
+                     iexec_long_options, &option_index);
+    
+    /* If its the end of the options, leave the loop. */
+    if (c == -1) {
+      break;
     }
-    if (config.no_daemonize == 0) {
-      /** Create a new session and make the child the process group
-          leader and session leader. */
-      session_pid = setsid();
 
-      /** If there was an error creating the new session, print an error
-          and exit. */
-      if (session_pid < 0) {
-        if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-          error(0, errno, "setsid() failed");
-        }
-        exit(EXIT_FAILURE);
-      }
+    /* Let's display the usage, or apply the option to the configuration
+       depending on which option was just parsed. */
+    switch (c) {
+    case 'h':
+      usage(0);
+      exit(EXIT_SUCCESS);
+      break;
+    case IEXEC_OPTION_VERSION:
+      version(0);
+      exit(EXIT_SUCCESS);
+      break;
+    case IEXEC_OPTION_BATCH:
+      config->batch_file = optarg;
+      break;
+    case IEXEC_OPTION_COMPILE_PROFILES:
+      config->compile_profiles = optarg != 0 ? optarg : iexec_profiles_path();
+      break;
+    case '?':
+      usage(1);
+      exit(EXIT_FAILURE);
+      /* getopt_long already printed an error message. */
+      break;        
+    default:
+      options[num_options].c = c;
+      options[num_options++].arg = optarg;
+    }
+  }
+  for (int i = 0; i < num_options; i++) {
+    if (options[i].c == IEXEC_OPTION_PROFILE) {
+      iexec_apply_profile(config, options[i].arg);
+    }
+  }
+  for (int i = 0; i < num_options; i++) {
+    if (options[i].c != IEXEC_OPTION_PROFILE) {
+      iexec_config_apply_option(config, options[i].c, options[i].arg);
     }
+  }
+  /** The remaining arguments begin after the last iexec option
+      and its option argument (if applicable). It should always be positive
+      (ie iexec is never included as an argument).*/
+  config->remaining_argv = argv + optind;
+  config->remaining_argc = argc - optind;
+  return;
+}
 
-    /** If -s is specified, wait fork again, and have the child wait
-        for the grandchild to finish */
-    if (config.use_status_file && config.no_daemonize == 0) {
-      int grandchild_pid = fork();
-      if (grandchild_pid > 0) { /* if we're not in the grand child, monitor the grandchild. */
-        iexec_monitor_child_as_parent(&config, grandchild_pid, saved_stderr_fd);
-        exit(0);
-      } else if (grandchild_pid < 0) {
-        int saved_errno = errno;
-        if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-          error(0, saved_errno, "second monitoring fork() on `failed");
-        }
-        exit(EXIT_FAILURE);        
+/**
+ * If the first file does not exist, it is first created.
+ *
+ * Returns a negative value if an error occured, 0 if the filenames refer to different
+ * files and 1 if they refer to the same file.
+ */
+int same_file(const char *fn1, const char *fn2) {
+  struct stat s1;
+  struct stat s2;
+  int r1 = stat(fn1, &s1);
+  if (r1 < 0) {
+    /** If the file does not exist, create it because it will be used
+        anyway. */
+    if (errno == ENOENT) {
+      int tresult = creat(fn1, 0666);
+      if (tresult < 0) {
+        return tresult;
       }
+      close(tresult);
+      /** Now try stat() again. */
+      r1 = stat(fn1, &s1);
+    } else { /* An error other than ENOENT occured, propogate it downward. */
+      return r1;
     }
+  }
+  /* Now try the stat on the second file. */
+  int r2 = stat(fn2, &s2);
+  if (r2 < 0) {
+    return r2;
+  }
+  /* The files are the same iff their device and inode are the same. */
+  return (s1.st_dev == s2.st_dev && s1.st_ino == s2.st_ino) ? 1 : 0; 
+}
 
-    /* Run the desired comand in the new session. */
-    if (execvp(config.remaining_argv[0], config.remaining_argv) == -1) {
-      int saved_errno = errno;
-      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-        error(0, saved_errno, "execvp() on `%s' failed", config.remaining_argv[0]);
-      }
-      exit(EXIT_FAILURE);
+/** When iexec started (CLOCK_MONOTONIC, ns), which --trace-timings
+    reports every phase relative to. */
+long long iexec_trace_origin;
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds.
+ */
+long long iexec_trace_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * With --trace-timings, prints a phase that ran from start to end to
+ * standard error as a line of the form
+ *
+ *   iexec: trace PHASE START DURATION
+ *
+ * with START (since iexec started) and DURATION in microseconds.
+ *
+ * @param config The configuration being launched.
+ * @param phase  The name of the phase.
+ * @param start  When the phase started (see iexec_trace_ns()).
+ * @param end    When it ended.
+ */
+void iexec_trace_phase(const iexec_config *config, const char *phase, long long start, long long end) {
+  if (config->trace_timings) {
+    fprintf(stderr, "%s: trace %s %.3f %.3f\n", program_invocation_name, phase,
+            (start - iexec_trace_origin) / 1000.0, (end - start) / 1000.0);
+  }
+}
+
+/**
+ * Prints a phase that started at start and ended now (see
+ * iexec_trace_phase()).
+ *
+ * Returns now, the start of the next phase.
+ */
+long long iexec_trace(const iexec_config *config, const char *phase, long long start) {
+  if (!config->trace_timings) {
+    return 0;
+  }
+  long long now = iexec_trace_ns();
+  iexec_trace_phase(config, phase, start, now);
+  return now;
+}
+
+/**
+ * Writes a report record to the launching process. Called by the
+ * launched child only.
+ */
+void iexec_launch_report(const iexec_launch *launch, int stage, int err, int arg) {
+  iexec_report report = {stage, err, arg, 0};
+  if (write(launch->report_fd, &report, sizeof(report)) < 0) {
+    /* There is no one else to tell. */
+  }
+}
+
+/**
+ * With --trace-timings, tells the launching process when the child
+ * finished a stage, and the limit it was for with setrlimit.
+ * clock_gettime() goes to the vDSO, so this is as safe in the vfork
+ * engine as the system calls around it.
+ */
+void iexec_launch_mark_arg(const iexec_launch *launch, int stage, int arg) {
+  if (launch->config->trace_timings) {
+    iexec_report report = {stage, 0, arg, iexec_trace_ns()};
+    if (write(launch->report_fd, &report, sizeof(report)) < 0) {
+      /* The timing is lost. */
     }
   }
+}
 
-  /** If the forking was unsuccessful, return an error message, and exit. */
-  if (child_pid < 0) {
+/**
+ * With --trace-timings, tells the launching process when the child
+ * finished a stage.
+ */
+void iexec_launch_mark(const iexec_launch *launch, int stage) {
+  iexec_launch_mark_arg(launch, stage, 0);
+}
+
+/**
+ * Reports a failed step and terminates the launched child.
+ */
+void iexec_launch_fail(const iexec_launch *launch, int stage, int err, int arg) {
+  iexec_launch_report(launch, stage, err, arg);
+  _exit(EXIT_FAILURE);
+}
+
+/**
+ * Opens a file onto the target file descriptor in the same way freopen()
+ * does: if open() does not return the target itself, it is moved there.
+ *
+ * Returns the target or a negative value if an error occurred.
+ */
+int iexec_open_onto(const char *filename, int flags, int target) {
+  int fd = open(filename, flags, 0666);
+  if (fd < 0 || fd == target) {
+    return fd;
+  }
+  if (dup2(fd, target) < 0) {
     int saved_errno = errno;
-    if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
-      error(0, saved_errno, "fork() failed");
-    }
-    exit(EXIT_FAILURE);
+    close(fd);
+    errno = saved_errno;
+    return -1;
+  }
+  close(fd);
+  return target;
+}
+
+/**
+ * Puts a descriptor opened close-on-exec onto a standard stream so it
+ * stays open across execvp(). The original is closed by execvp().
+ *
+ * Returns the target or a negative value if an error occurred.
+ */
+int iexec_lean_onto(int fd, int target) {
+  if (fd == target) {
+    return fcntl(target, F_SETFD, 0) < 0 ? -1 : target;
   }
+  return dup3(fd, target, 0);
+}
 
-  /** If I am the parent, I have the child's pid. Write it to the pid
-      file and forget the pid.*/
-  if (child_pid) {
-    if (config.use_status_file == 0) {
-      iexec_monitor_child_as_parent(&config, child_pid, saved_stderr_fd);
-    } else if (config.use_status_file != 0 && config.no_daemonize != 0) {
-      int exit_status = iexec_monitor_child_as_parent(&config, child_pid, saved_stderr_fd);
-      exit(exit_status);
+/**
+ * Redirects stdin, stdout and stderr of the launched child with as few
+ * system calls as possible: each file is opened once, close-on-exec and
+ * relative to the working directory, and put in place with dup3(), which
+ * needs no close() of the old stream first. No access() check comes
+ * before, as open() fails the same way. stdout and stderr going to the
+ * same file share one open file, found by the name or, for different
+ * names, with fstat(), so their writes never overwrite each other. This
+ * takes 5 system calls for the default /dev/null streams and 8 for
+ * different -o and -e files, against 11 or more for --redirect=compat.
+ * Errors are reported like those of the access() checks. Exits on error.
+ */
+void iexec_redirect_lean(const iexec_launch *launch) {
+  const iexec_config *config = launch->config;
+  int in_fd = open(config->use_stdin_file, O_RDONLY | O_CLOEXEC);
+  if (in_fd < 0) {
+    iexec_launch_fail(launch, IEXEC_STAGE_ACCESS_STDIN, errno, 0);
+  }
+  iexec_launch_mark(launch, IEXEC_STAGE_REDIRECT_STDIN);
+  int out_fd = launch->log_fds[0];
+  if (out_fd < 0) {
+    out_fd = open(config->use_stdout_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (out_fd < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_ACCESS_STDOUT, errno, 0);
     }
-    exit(0);
   }
+  iexec_launch_mark(launch, IEXEC_STAGE_REDIRECT_STDOUT);
+  int err_fd = launch->log_fds[1];
+  if (err_fd < 0 && launch->log_fds[0] < 0 && strcmp(config->use_stdout_file, config->use_stderr_file) == 0) {
+    err_fd = out_fd;
+  } else if (err_fd < 0) {
+    /** Truncating a file that turns out to be stdout's again does no
+        harm, nothing was written yet. */
+    err_fd = open(config->use_stderr_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (err_fd < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_ACCESS_STDERR, errno, 0);
+    }
+    struct stat out_stat, err_stat;
+    if (launch->log_fds[0] < 0) {
+      if (fstat(out_fd, &out_stat) < 0 || fstat(err_fd, &err_stat) < 0) {
+        iexec_launch_fail(launch, IEXEC_STAGE_STAT, errno, 0);
+      }
+      if (out_stat.st_dev == err_stat.st_dev && out_stat.st_ino == err_stat.st_ino) {
+        err_fd = out_fd;
+      }
+    }
+  }
+  if (iexec_lean_onto(in_fd, STDIN_FILENO) < 0) {
+    iexec_launch_fail(launch, IEXEC_STAGE_REDIRECT_STDIN, errno, 0);
+  }
+  if (iexec_lean_onto(out_fd, STDOUT_FILENO) < 0) {
+    iexec_launch_fail(launch, IEXEC_STAGE_REDIRECT_STDOUT, errno, 0);
+  }
+  if (iexec_lean_onto(err_fd, STDERR_FILENO) < 0) {
+    iexec_launch_fail(launch, IEXEC_STAGE_REDIRECT_STDERR, errno, 0);
+  }
+  iexec_launch_mark(launch, IEXEC_STAGE_REDIRECT_STDERR);
+}
+
+/**
+ * Returns non-zero if a range of file descriptors holds one that the
+ * launched child still needs until it execs.
+ */
+int iexec_launch_needs_fd_in(const iexec_launch *launch, unsigned int first, unsigned int last) {
+  const int needed[] = {launch->report_fd, launch->log_fds[0], launch->log_fds[1], launch->ready_fds[1],
+                        launch->binary_fd, launch->perf_fd};
+  for (int i = 0; i < (int)(sizeof(needed) / sizeof(needed[0])); i++) {
+    if (needed[i] >= 0 && (unsigned int)needed[i] >= first && (unsigned int)needed[i] <= last) {
+      return 1;
+    }
+  }
+  for (int i = 0; i < launch->config->num_listen; i++) {
+    if ((unsigned int)launch->listen_fds[i] >= first && (unsigned int)launch->listen_fds[i] <= last) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Closes a range of file descriptors in the launched child with one
+ * close_range() call. If the range holds a descriptor the child still
+ * needs, it is marked close-on-exec instead, which closes the whole
+ * range at execvp().
+ *
+ * Returns 0, or a negative value if close_range() is not available.
+ */
+int iexec_close_range(const iexec_launch *launch, unsigned int first, unsigned int last) {
+  unsigned int flags = iexec_launch_needs_fd_in(launch, first, last) ? CLOSE_RANGE_CLOEXEC : 0;
+  return close_range(first, last, flags);
+}
+
+/**
+ * Closes the file descriptors from config->close_from up by walking
+ * /proc/self/fd, for kernels without close_range(). The directory is read
+ * with getdents64() into a buffer on the stack, as the launched child
+ * cannot allocate memory.
+ *
+ * Returns 0, or a negative value if an error occurred.
+ */
+int iexec_close_from_proc(const iexec_launch *launch) {
+  const iexec_config *config = launch->config;
+  char buffer[4096];
+  int dir_fd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dir_fd < 0) {
+    return -1;
+  }
+  while (1) {
+    long nread = syscall(SYS_getdents64, dir_fd, buffer, sizeof(buffer));
+    if (nread <= 0) {
+      int saved_errno = errno;
+      close(dir_fd);
+      errno = saved_errno;
+      return nread < 0 ? -1 : 0;
+    }
+    for (long offset = 0; offset < nread;) {
+      struct dirent64 *entry = (struct dirent64 *)(buffer + offset);
+      offset += entry->d_reclen;
+      if (entry->d_name[0] < '0' || entry->d_name[0] > '9') {
+        continue;
+      }
+      int fd = 0;
+      for (const char *digit = entry->d_name; *digit != 0; digit++) {
+        fd = fd * 10 + (*digit - '0');
+      }
+      int keep = fd == dir_fd || fd < config->close_from;
+      for (int k = 0; !keep && k < config->num_fds_to_keep; k++) {
+        keep = config->fds_to_keep[k] == fd;
+      }
+      if (keep) {
+        continue;
+      }
+      if (iexec_launch_needs_fd_in(launch, fd, fd)) {
+        set_cloexec_flag(fd);
+      } else {
+        close(fd);
+      }
+    }
+  }
+}
+
+/**
+ * Closes every file descriptor from config->close_from up, except those
+ * listed with --close-all-except. This is one close_range() call per
+ * run of descriptors between the ones kept, however many the parent
+ * left open.
+ *
+ * Returns 0, or a negative value if an error occurred.
+ */
+int iexec_close_from(const iexec_launch *launch) {
+  const iexec_config *config = launch->config;
+  unsigned int first = config->close_from;
+  int result = 0;
+  for (int k = 0; k < config->num_fds_to_keep && result == 0; k++) {
+    unsigned int keep = launch->fds_to_keep[k];
+    if (keep < first) {
+      continue;
+    }
+    if (keep > first) {
+      result = iexec_close_range(launch, first, keep - 1);
+    }
+    first = keep + 1;
+  }
+  if (result == 0) {
+    result = iexec_close_range(launch, first, ~0U);
+  }
+  if (result == 0) {
+    return 0;
+  }
+  /** close_range() is missing (ENOSYS) or does not know
+      CLOSE_RANGE_CLOEXEC (EINVAL). */
+  if (errno == ENOSYS || errno == EINVAL) {
+    return iexec_close_from_proc(launch);
+  }
+  return -1;
+}
+
+/**
+ * Opens the counters of --perf-counters on the launched child itself,
+ * and sends them to the launching process over launch->perf_fd. They
+ * start counting at execvp() and follow the threads and processes the
+ * program starts; the child's copies are closed on exec, the ones in
+ * flight are not. A counter the machine lacks is reported as a warning.
+ */
+void iexec_launch_open_perf(const iexec_launch *launch) {
+  int counters[IEXEC_NUM_PERF_COUNTERS], fds[IEXEC_NUM_PERF_COUNTERS];
+  int num_fds = 0;
+  for (int i = 0; i < IEXEC_NUM_PERF_COUNTERS; i++) {
+    if ((launch->config->perf_counters & (1 << i)) == 0) {
+      continue;
+    }
+    struct perf_event_attr attr = launch->perf_attr;
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    int fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    /** Unprivileged users may only count the program in user space
+        with the default perf_event_paranoid. */
+    if (fd < 0 && (errno == EACCES || errno == EPERM)) {
+      attr.exclude_kernel = 1;
+      fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    if (fd < 0) {
+      iexec_launch_report(launch, IEXEC_STAGE_PERF, errno, i);
+      continue;
+    }
+    counters[num_fds] = i;
+    fds[num_fds++] = fd;
+  }
+  if (num_fds == 0) {
+    return;
+  }
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = counters, .iov_len = sizeof(int) * num_fds };
+  struct msghdr header = { .msg_iov = &iov, .msg_iovlen = 1,
+                           .msg_control = control.buffer, .msg_controllen = CMSG_SPACE(sizeof(int) * num_fds) };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+  if (sendmsg(launch->perf_fd, &header, MSG_NOSIGNAL) < 0) {
+    iexec_launch_report(launch, IEXEC_STAGE_PERF, errno, counters[0]);
+  }
+}
+
+/**
+ * The launched child. It sets the resource limits, changes to the
+ * user, changes to the working directory, closes and redirects file
+ * descriptors, creates a new session and then execs the program.
+ *
+ * It runs in the vfork engine's context, sharing memory with the
+ * launching process, so it only makes system calls and reports errors
+ * through launch->report_fd instead of printing them.
+ *
+ * @param arg    The iexec_launch to perform.
+ */
+int iexec_launch_child(void *arg) {
+  const iexec_launch *launch = arg;
+  const iexec_config *config = launch->config;
+  int k;
+
+  iexec_launch_mark(launch, IEXEC_STAGE_START);
+
+  /** Move into the cgroup unless spawned in it, before anything else
+      (which may drop the permission to). Writing 0 moves the writer. */
+  if (launch->cgroup_fd >= 0 && !launch->in_cgroup) {
+    int procs_fd = openat(launch->cgroup_fd, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+    if (procs_fd < 0 || write(procs_fd, "0", 1) != 1) {
+      iexec_launch_fail(launch, IEXEC_STAGE_CGROUP, errno, 0);
+    }
+    close(procs_fd);
+    iexec_launch_mark(launch, IEXEC_STAGE_CGROUP);
+  }
+
+  /** For each resource limit that was specified, set it. */
+  for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+    if (!launch->limits_set[i]) {
+      continue;
+    }
+    if (setrlimit(i, &launch->limits[i]) < 0) {
+      int saved_errno = errno;
+      if (config->soft_limits[i] != IEXEC_RLIMIT_UNCHANGED) {
+        iexec_launch_report(launch, IEXEC_STAGE_SETRLIMIT_SOFT, saved_errno, i);
+      }
+      if (config->hard_limits[i] != IEXEC_RLIMIT_UNCHANGED) {
+        iexec_launch_report(launch, IEXEC_STAGE_SETRLIMIT_HARD, saved_errno, i);
+      }
+      _exit(EXIT_FAILURE);
+    }
+    iexec_launch_mark_arg(launch, IEXEC_STAGE_SETRLIMIT_SOFT, i);
+  }
+
+  /** Set the memory behaviour next to RLIMIT_MEMLOCK and before setuid(),
+      which drops the CAP_SYS_RESOURCE merging needs. Both are inherited
+      and survive execve(); locking and prefaulting cannot be done from
+      here, since execve() unlocks and replaces the memory, so the shim
+      of launch->envp does those in the program itself. */
+  if (config->thp != IEXEC_THP_UNCHANGED
+      && prctl(PR_SET_THP_DISABLE, config->thp == IEXEC_THP_NEVER, 0, 0, 0) < 0) {
+    iexec_launch_fail(launch, IEXEC_STAGE_THP, errno, 0);
+  }
+  if (config->ksm && prctl(PR_SET_MEMORY_MERGE, 1, 0, 0, 0) < 0) {
+    iexec_launch_fail(launch, IEXEC_STAGE_KSM, errno, 0);
+  }
+  if (config->thp != IEXEC_THP_UNCHANGED || config->ksm) {
+    iexec_launch_mark(launch, IEXEC_STAGE_THP);
+  }
+
+  /** Change the effective user id. */
+  if (config->username != 0) {
+    if (setuid(launch->uid)) {
+      iexec_launch_fail(launch, IEXEC_STAGE_SETUID, errno, 0);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_SETUID);
+  }
+
+  /** Before doing anything else, eg closing/reopening file descriptors,
+      change directory to working directory if appropriate. */
+  if (launch->working_dir_fd >= 0) {
+    if (fchdir(launch->working_dir_fd) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_CHDIR, errno, 0);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_CHDIR);
+  }
+
+  /** If the stdin,stderr,stdout file descriptors are not to be kept
+      open (ie they are to be closed) then check if the paths provided
+      with -i, -o, and -e exist and have the right permissions. The lean
+      redirection finds out when it opens them. */
+  if (!config->keep_open && config->redirect == IEXEC_REDIRECT_COMPAT) {
+    if (access(config->use_stdin_file, R_OK) != 0 && errno != ENOENT) {
+      iexec_launch_fail(launch, IEXEC_STAGE_ACCESS_STDIN, errno, 0);
+    }
+    if (access(config->use_stdout_file, W_OK) != 0 && errno != ENOENT) {
+      iexec_launch_fail(launch, IEXEC_STAGE_ACCESS_STDOUT, errno, 0);
+    }
+    if (access(config->use_stderr_file, W_OK) != 0 && errno != ENOENT) {
+      iexec_launch_fail(launch, IEXEC_STAGE_ACCESS_STDERR, errno, 0);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_ACCESS_STDIN);
+  }
+
+  /** Close the file descriptor descriptors inherited from
+      the parent that were specified with the -c option. */
+  for (k = 0; k < config->num_fds_to_close; k++) {
+    /** If the close was not successful, for security
+        reasons, exit. */
+    if (close(config->fds_to_close[k]) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_CLOSE, errno, config->fds_to_close[k]);
+    }
+  }
+  if (config->num_fds_to_close > 0) {
+    iexec_launch_mark(launch, IEXEC_STAGE_CLOSE);
+  }
+
+  /** Close the rest of the inherited file descriptors if --close-from,
+      --close-all or --close-all-except was given. */
+  if (config->close_from >= 0) {
+    if (iexec_close_from(launch) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_CLOSE_FROM, errno, config->close_from);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_CLOSE_FROM);
+  }
+
+  if (!config->keep_open && config->redirect == IEXEC_REDIRECT_LEAN) {
+    iexec_redirect_lean(launch);
+  }
+
+  /** If the file descriptors were not supposed to be kept open, close
+      them and reopen them according to the options -i, -o, and -e.*/
+  if (!config->keep_open && config->redirect == IEXEC_REDIRECT_COMPAT) {
+    if (close(STDIN_FILENO) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_CLOSE_STDIN, errno, 0);
+    }
+    if (close(STDOUT_FILENO) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_CLOSE_STDOUT, errno, 0);
+    }
+    if (close(STDERR_FILENO) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_CLOSE_STDERR, errno, 0);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_CLOSE_STDIN);
+    /** Try reopening standard input using the file specified -i. */
+    if (iexec_open_onto(config->use_stdin_file, O_RDONLY, STDIN_FILENO) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_REDIRECT_STDIN, errno, 0);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_REDIRECT_STDIN);
+    /** If both the standard output and standard error refer to the same
+         file, truncate the file and use append mode in the later open
+         calls. Otherwise, use write with truncate*/
+    int outerr_same = 0;
+    int open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    if (launch->log_fds[0] < 0 && launch->log_fds[1] < 0) {
+      outerr_same = same_file(config->use_stdout_file, config->use_stderr_file);
+      open_flags = O_WRONLY | O_CREAT | O_APPEND;
+      iexec_launch_mark(launch, IEXEC_STAGE_STAT);
+    }
+    if (outerr_same < 0) { /*** An error occurred. */
+      if (errno != ENOENT) {
+        iexec_launch_fail(launch, IEXEC_STAGE_STAT, errno, 0);
+      }
+      open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (outerr_same == 0) { /*** DIFFERENT: use write with truncate mode. */
+      open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    /** Try reopening standard output using the file specified with -o,
+        or the pipe to its log collector. */
+    if (launch->log_fds[0] >= 0) {
+      if (dup2(launch->log_fds[0], STDOUT_FILENO) < 0) {
+        iexec_launch_fail(launch, IEXEC_STAGE_REDIRECT_STDOUT, errno, 0);
+      }
+    }
+    else if (iexec_open_onto(config->use_stdout_file, open_flags, STDOUT_FILENO) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_REDIRECT_STDOUT, errno, 0);
+    }
+    else if (outerr_same == 1) { /** Truncate the file. */
+      struct stat out_stat;
+      if (fstat(STDOUT_FILENO, &out_stat) < 0) {
+        iexec_launch_fail(launch, IEXEC_STAGE_STAT, errno, 0);
+      }
+      if (S_ISREG(out_stat.st_mode) && ftruncate(STDOUT_FILENO, 0) < 0) {
+        iexec_launch_report(launch, IEXEC_STAGE_TRUNCATE, errno, 0);
+      }
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_REDIRECT_STDOUT);
+    /** Try reopening standard error using the file specified with -e. */
+    if (launch->log_fds[1] >= 0) {
+      if (dup2(launch->log_fds[1], STDERR_FILENO) < 0) {
+        iexec_launch_fail(launch, IEXEC_STAGE_REDIRECT_STDERR, errno, 0);
+      }
+    }
+    else if (iexec_open_onto(config->use_stderr_file, open_flags, STDERR_FILENO) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_REDIRECT_STDERR, errno, 0);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_REDIRECT_STDERR);
+  }
+
+  /** Pass the bound sockets from IEXEC_LISTEN_FDS_START on; dup2()
+      leaves the copies open across execvp(). Everything the child still
+      needs was put above them by the launching process. */
+  for (k = 0; k < config->num_listen; k++) {
+    if (dup2(launch->listen_fds[k], IEXEC_LISTEN_FDS_START + k) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_LISTEN, errno, k);
+    }
+  }
+  if (launch->ready_fds[1] >= 0) {
+    int ready_fd = config->ready_fd;
+    if (launch->ready_fds[1] == ready_fd ? fcntl(ready_fd, F_SETFD, 0) < 0
+        : dup2(launch->ready_fds[1], ready_fd) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_READY_FD, errno, ready_fd);
+    }
+  }
+  if (launch->listen_pid != 0) {
+    char digits[24];
+    int num_digits = 0;
+    for (pid_t pid = getpid(); pid > 0; pid /= 10) {
+      digits[num_digits++] = '0' + pid % 10;
+    }
+    for (int i = 0; i < num_digits; i++) {
+      launch->listen_pid[i] = digits[num_digits - 1 - i];
+    }
+    launch->listen_pid[num_digits] = 0;
+  }
+  if (config->num_listen > 0 || launch->ready_fds[1] >= 0) {
+    iexec_launch_mark(launch, IEXEC_STAGE_LISTEN);
+  }
+
+  /** Pin the program to its CPUs and memory nodes, so it runs there
+      from its first instruction. Both are kept across execvp(). */
+  if (launch->cpus_set) {
+    if (sched_setaffinity(0, sizeof(cpu_set_t), &launch->cpus) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_SCHED_SETAFFINITY, errno, 0);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_SCHED_SETAFFINITY);
+  }
+  if (launch->mempolicy != MPOL_DEFAULT) {
+    if (syscall(SYS_set_mempolicy, launch->mempolicy, launch->nodes, IEXEC_MAX_NODES + 1) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_SET_MEMPOLICY, errno, 0);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_SET_MEMPOLICY);
+  }
+
+  /** If the umask option was specified. */
+  if (config->umask >= 0) {
+    umask(config->umask);
+  }
+
+  if (config->no_daemonize == 0) {
+    /** Create a new session and make the child the process group
+        leader and session leader. */
+    if (setsid() < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_SETSID, errno, 0);
+    }
+    iexec_launch_mark(launch, IEXEC_STAGE_SETSID);
+  }
+
+  /** Set the CPU and I/O scheduling of the program, after the resource
+      limits and the user that they are checked against. */
+  if (config->sched_policy >= 0) {
+    struct sched_param param;
+    param.sched_priority = config->sched_priority > 0 ? config->sched_priority : 0;
+    if (sched_setscheduler(0, config->sched_policy, &param) < 0) {
+      iexec_launch_fail(launch, IEXEC_STAGE_SCHED, errno, 0);
+    }
+  }
+  if (config->nice != INT_MIN && setpriority(PRIO_PROCESS, 0, config->nice) < 0) {
+    iexec_launch_fail(launch, IEXEC_STAGE_NICE, errno, 0);
+  }
+  if (launch->ioprio >= 0 && syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, launch->ioprio) < 0) {
+    iexec_launch_fail(launch, IEXEC_STAGE_IOPRIO, errno, 0);
+  }
+  if (config->timerslack >= 0 && prctl(PR_SET_TIMERSLACK, config->timerslack, 0, 0, 0) < 0) {
+    iexec_launch_fail(launch, IEXEC_STAGE_TIMERSLACK, errno, 0);
+  }
+  if (config->sched_policy >= 0 || config->nice != INT_MIN || launch->ioprio >= 0 || config->timerslack >= 0) {
+    iexec_launch_mark(launch, IEXEC_STAGE_SCHED);
+  }
+
+  /** A monitor sending output to a tee socket ignores SIGPIPE; the
+      program must not inherit that. */
+  if (!launch->sigpipe_ignored) {
+    signal(SIGPIPE, SIG_DFL);
+  }
+
+  /** The launching process blocked all signals; give the program the
+      mask iexec started with. */
+  sigprocmask(SIG_SETMASK, &launch->sigmask, 0);
+
+  if (launch->perf_fd >= 0) {
+    iexec_launch_open_perf(launch);
+  }
+
+  /* Run the desired comand in the new session. */
+  if (launch->binary_fd >= 0) {
+    char **envp = launch->envp != 0 ? launch->envp : environ;
+    /** The interpreter of a script opens it as /dev/fd/N, so the
+        descriptor is left open across the exec, and the script run is
+        the file checked too. */
+    fcntl(launch->binary_fd, F_SETFD, 0);
+    syscall(SYS_execveat, launch->binary_fd, "", config->remaining_argv, envp, AT_EMPTY_PATH);
+  } else if (launch->envp != 0) {
+    execvpe(config->remaining_argv[0], config->remaining_argv, launch->envp);
+  } else {
+    execvp(config->remaining_argv[0], config->remaining_argv);
+  }
+  iexec_launch_fail(launch, IEXEC_STAGE_EXEC, errno, 0);
+  return EXIT_FAILURE;
+}
+
+/**
+ * Prints the error described by a record read from the report pipe.
+ */
+void iexec_launch_print_report(const iexec_launch *launch, const iexec_report *report) {
+  const iexec_config *config = launch->config;
+  int i = report->arg;
+  char value[32];
+  switch (report->stage) {
+  case IEXEC_STAGE_CGROUP:
+    error(0, report->err, "unable to move into cgroup `%s'", config->cgroup_path);
+    break;
+  case IEXEC_STAGE_SETRLIMIT_SOFT:
+    error(0, report->err, "error setting resource limit %s_SOFT=%s", limit_names[i],
+          iexec_format_rlimit(value, sizeof(value), config->soft_limits[i]));
+    break;
+  case IEXEC_STAGE_SETRLIMIT_HARD:
+    error(0, report->err, "error setting resource limit %s_HARD=%s", limit_names[i],
+          iexec_format_rlimit(value, sizeof(value), config->hard_limits[i]));
+    break;
+  case IEXEC_STAGE_SETUID:
+    error(0, report->err, "could not change to different user");
+    break;
+  case IEXEC_STAGE_CHDIR:
+    error(0, report->err, "unable to change directory to `%s'", config->use_working_dir);
+    break;
+  case IEXEC_STAGE_LISTEN:
+    error(0, report->err, "unable to pass the socket of --listen `%s'", config->listen[report->arg]);
+    break;
+  case IEXEC_STAGE_READY_FD:
+    error(0, report->err, "unable to pass the readiness descriptor %d", report->arg);
+    break;
+  case IEXEC_STAGE_SCHED_SETAFFINITY:
+    if (config->cpus != 0) {
+      error(0, report->err, "unable to run on CPUs `%s'", config->cpus);
+    } else {
+      error(0, report->err, "unable to run on the CPUs of NUMA node %d", config->numa_node);
+    }
+    break;
+  case IEXEC_STAGE_SET_MEMPOLICY:
+    error(0, report->err, "unable to set the NUMA memory policy");
+    break;
+  case IEXEC_STAGE_ACCESS_STDIN:
+    error(0, report->err, "file specified with -i (%s) is not readable", config->use_stdin_file);
+    break;
+  case IEXEC_STAGE_ACCESS_STDOUT:
+    error(0, report->err, "file specified with -o (%s) is not writable", config->use_stdout_file);
+    break;
+  case IEXEC_STAGE_ACCESS_STDERR:
+    error(0, report->err, "file specified with -e (%s) is not writable", config->use_stderr_file);
+    break;
+  case IEXEC_STAGE_CLOSE:
+    error(0, report->err, "unable to close file descriptor %d", report->arg);
+    break;
+  case IEXEC_STAGE_CLOSE_FROM:
+    error(0, report->err, "unable to close file descriptors from %d", report->arg);
+    break;
+  case IEXEC_STAGE_CLOSE_STDIN:
+    error(0, report->err, "unable to close stdin");
+    break;
+  case IEXEC_STAGE_CLOSE_STDOUT:
+    error(0, report->err, "unable to close stdout");
+    break;
+  case IEXEC_STAGE_CLOSE_STDERR:
+    error(0, report->err, "failed to close standard error");
+    break;
+  case IEXEC_STAGE_REDIRECT_STDIN:
+    error(0, report->err, "failed to redirect standard input");
+    break;
+  case IEXEC_STAGE_REDIRECT_STDOUT:
+    error(0, report->err, "failed to redirect standard output");
+    break;
+  case IEXEC_STAGE_REDIRECT_STDERR:
+    error(0, report->err, "failed to redirect standard error");
+    break;
+  case IEXEC_STAGE_STAT:
+    error(0, report->err, "stat() error");
+    break;
+  case IEXEC_STAGE_TRUNCATE:
+    error(0, report->err, "truncate() error");
+    break;
+  case IEXEC_STAGE_PERF:
+    error(0, report->err, "perf counter `%s' is not available", perf_names[i]);
+    break;
+  case IEXEC_STAGE_SETSID:
+    error(0, report->err, "setsid() failed");
+    break;
+  case IEXEC_STAGE_SCHED:
+    error(0, report->err, "unable to set the scheduling policy");
+    break;
+  case IEXEC_STAGE_NICE:
+    error(0, report->err, "unable to set the nice value to %d", config->nice);
+    break;
+  case IEXEC_STAGE_IOPRIO:
+    error(0, report->err, "unable to set the I/O priority");
+    break;
+  case IEXEC_STAGE_TIMERSLACK:
+    error(0, report->err, "unable to set the timer slack to %ldns", config->timerslack);
+    break;
+  case IEXEC_STAGE_THP:
+    error(0, report->err, "unable to set the transparent hugepage mode to %s", thp_names[config->thp]);
+    break;
+  case IEXEC_STAGE_KSM:
+    error(0, report->err, "unable to enable KSM merging");
+    break;
+  case IEXEC_STAGE_EXEC:
+    if (launch->binary_fd >= 0) {
+      error(0, report->err, "execveat() on `%s' (resolved from `%s') failed",
+            launch->binary_path, config->remaining_argv[0]);
+    } else {
+      error(0, report->err, "execvp() on `%s' failed", config->remaining_argv[0]);
+    }
+    break;
+  }
+}
+
+/**
+ * Compares two ints for qsort().
+ */
+int iexec_compare_ints(const void *a, const void *b) {
+  int x = *(const int *)a, y = *(const int *)b;
+  return (x > y) - (x < y);
+}
+
+/**
+ * Parses a list of CPUs or NUMA nodes, eg 0-3,8,10-11, into a bit mask.
+ * Exits if it is not such a list.
+ *
+ * @param option The option the list was given to.
+ * @param list   The list.
+ * @param mask   The mask to set the bits of (cleared first).
+ * @param max    The number of bits in the mask.
+ */
+void iexec_parse_list(const char *option, const char *list, unsigned long *mask, int max) {
+  const int bits = 8 * sizeof(unsigned long);
+  memset(mask, 0, max / 8);
+  const char *p = list;
+  while (1) {
+    char *end = 0;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (end != p && *end == '-') {
+      p = end + 1;
+      last = strtol(p, &end, 10);
+    }
+    if (end == p || first < 0 || last < first || last >= max || (*end != ',' && *end != 0)) {
+      error(0, 0, "invalid list `%s' given to --%s", list, option);
+      exit(EXIT_FAILURE);
+    }
+    for (long i = first; i <= last; i++) {
+      mask[i / bits] |= 1UL << (i % bits);
+    }
+    if (*end == 0) {
+      break;
+    }
+    p = end + 1;
+  }
+}
+
+/**
+ * Moves a descriptor of the launching process to IEXEC_LISTEN_FDS_START
+ * plus the number of passed sockets or above, so it does not sit where
+ * the child puts a passed socket. Keeps it close-on-exec.
+ *
+ * Returns the descriptor, moved or not.
+ */
+int iexec_launch_move_fd_up(const iexec_launch *launch, int fd) {
+  int lowest = IEXEC_LISTEN_FDS_START + launch->config->num_listen;
+  if (fd < 0 || fd >= lowest || launch->config->num_listen == 0) {
+    return fd;
+  }
+  int moved = fcntl(fd, F_DUPFD_CLOEXEC, lowest);
+  if (moved < 0) {
+    return fd;
+  }
+  close(fd);
+  return moved;
+}
+
+/**
+ * Creates, binds and listens on the socket of a --listen address:
+ * tcp:ADDR:PORT (ADDR may be empty or * for any, or an IPv6 address in
+ * brackets) or unix:PATH (a stale socket file at PATH is replaced).
+ * Exits on error.
+ *
+ * Returns the listening socket.
+ */
+int iexec_listen(const iexec_config *config, const char *spec) {
+  int fd = -1;
+  if (strncmp(spec, "unix:", 5) == 0) {
+    struct sockaddr_un address;
+    struct stat path_stat;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(spec + 5) >= sizeof(address.sun_path)) {
+      error(0, 0, "socket path of --listen `%s' is too long", spec);
+      exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, spec + 5);
+    if (stat(address.sun_path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+      unlink(address.sun_path);
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+      error(0, errno, "unable to bind --listen `%s'", spec);
+      exit(EXIT_FAILURE);
+    }
+  } else {
+    char host[256];
+    snprintf(host, sizeof(host), "%s", spec + 4);
+    char *port = strrchr(host, ':');
+    if (port == 0) {
+      error(0, 0, "no port in --listen `%s'", spec);
+      exit(EXIT_FAILURE);
+    }
+    *port++ = 0;
+    char *name = host;
+    if (name[0] == '[' && port - host >= 3 && port[-2] == ']') {
+      name++;
+      port[-2] = 0;
+    }
+    if (name[0] == 0 || strcmp(name, "*") == 0) {
+      name = 0;
+    }
+    struct addrinfo hints, *addresses = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int gai_error = getaddrinfo(name, port, &hints, &addresses);
+    if (gai_error != 0) {
+      error(0, 0, "unable to resolve --listen `%s': %s", spec, gai_strerror(gai_error));
+      exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    fd = socket(addresses->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0
+        || (config->listen_reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)
+        || bind(fd, addresses->ai_addr, addresses->ai_addrlen) < 0) {
+      error(0, errno, "unable to bind --listen `%s'", spec);
+      exit(EXIT_FAILURE);
+    }
+    freeaddrinfo(addresses);
+    if (config->listen_fastopen > 0
+        && setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN, &config->listen_fastopen, sizeof(config->listen_fastopen)) < 0) {
+      error(0, errno, "unable to enable TCP_FASTOPEN on --listen `%s'", spec);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (listen(fd, config->listen_backlog) < 0) {
+    error(0, errno, "unable to listen on --listen `%s'", spec);
+    exit(EXIT_FAILURE);
+  }
+  return fd;
+}
+
+/**
+ * Binds the sockets of --listen for a launch, or with --upgrade, uses
+ * those taken over from the program replaced. The sockets stay bound
+ * across restarts. Exits on error.
+ */
+void iexec_launch_prepare_listen(const iexec_config *config, iexec_launch *launch) {
+  launch->listen_fds = 0;
+  if (config->num_listen == 0) {
+    return;
+  }
+  launch->listen_fds = malloc(sizeof(int) * config->num_listen);
+  if (launch->listen_fds == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < config->num_listen; i++) {
+    int fd = config->upgrade_fds != 0 ? config->upgrade_fds[i] : iexec_listen(config, config->listen[i]);
+    launch->listen_fds[i] = iexec_launch_move_fd_up(launch, fd);
+  }
+}
+
+/**
+ * Creates what the program reports readiness on with --wait-ready: a
+ * datagram socket bound to an autobound abstract address, which the
+ * program finds in NOTIFY_SOCKET and sends READY=1 to as with
+ * sd_notify(3), or with --ready-fd a pipe the program writes a line to.
+ * Both stay open across restarts. Exits on error, or if --ready-fd is
+ * one of the descriptors of the sockets passed to the program.
+ */
+void iexec_launch_prepare_ready(const iexec_config *config, iexec_launch *launch) {
+  launch->ready_fds[0] = -1;
+  launch->ready_fds[1] = -1;
+  if (config->wait_ready < 0) {
+    return;
+  }
+  if (config->ready_fd >= 0) {
+    /** The sockets of --listen (or those taken over with --upgrade)
+        become the descriptors from IEXEC_LISTEN_FDS_START on. */
+    if (config->ready_fd >= IEXEC_LISTEN_FDS_START
+        && config->ready_fd < IEXEC_LISTEN_FDS_START + config->num_listen) {
+      error(0, 0, "--ready-fd %d is taken by the sockets passed to the program (descriptors %d to %d)",
+            config->ready_fd, IEXEC_LISTEN_FDS_START, IEXEC_LISTEN_FDS_START + config->num_listen - 1);
+      exit(EXIT_FAILURE);
+    }
+    if (pipe2(launch->ready_fds, O_CLOEXEC) < 0) {
+      error(0, errno, "pipe() failed");
+      exit(EXIT_FAILURE);
+    }
+    fcntl(launch->ready_fds[0], F_SETFL, O_NONBLOCK);
+    launch->ready_fds[1] = iexec_launch_move_fd_up(launch, launch->ready_fds[1]);
+    return;
+  }
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  launch->ready_fds[0] = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+  /** Binding just the family makes the kernel pick a unique abstract
+      address. */
+  if (launch->ready_fds[0] < 0
+      || bind(launch->ready_fds[0], (struct sockaddr *)&address, sizeof(sa_family_t)) < 0) {
+    error(0, errno, "unable to create the notify socket");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * Builds the environment of the program when iexec passes it sockets
+ * or a notify socket: iexec's own, without the LISTEN_FDS, LISTEN_PID,
+ * LISTEN_FDNAMES or NOTIFY_SOCKET it replaces, plus LISTEN_FDS=<number>
+ * and LISTEN_PID, which the child fills in with its own pid, and
+ * NOTIFY_SOCKET. With --mlockall or --prefault, the shim is put in
+ * front of LD_PRELOAD and told what to do by IEXEC_MLOCKALL and
+ * IEXEC_PREFAULT. Exits on error.
+ */
+void iexec_launch_prepare_env(const iexec_config *config, iexec_launch *launch) {
+  int notifies = launch->ready_fds[0] >= 0 && config->ready_fd < 0;
+  int preloads = config->mlockall != 0 || config->prefault;
+  launch->envp = 0;
+  launch->listen_pid = 0;
+  if (config->num_listen == 0 && !notifies && !preloads) {
+    return;
+  }
+
+  int num_vars = 0;
+  while (environ[num_vars] != 0) {
+    num_vars++;
+  }
+  launch->envp = malloc(sizeof(char *) * (num_vars + 7));
+  if (launch->envp == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  int j = 0;
+  for (int i = 0; i < num_vars; i++) {
+    if ((config->num_listen == 0
+         || (strncmp(environ[i], "LISTEN_FDS=", 11) != 0 && strncmp(environ[i], "LISTEN_PID=", 11) != 0
+             && strncmp(environ[i], "LISTEN_FDNAMES=", 15) != 0))
+        && (!notifies || strncmp(environ[i], "NOTIFY_SOCKET=", 14) != 0)
+        && (!preloads
+            || (strncmp(environ[i], "LD_PRELOAD=", 11) != 0 && strncmp(environ[i], "IEXEC_MLOCKALL=", 15) != 0
+                && strncmp(environ[i], "IEXEC_PREFAULT=", 15) != 0))) {
+      launch->envp[j++] = environ[i];
+    }
+  }
+  if (config->num_listen > 0) {
+    char *listen_fds = malloc(32);
+    char *listen_pid = malloc(32);
+    if (listen_fds == 0 || listen_pid == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    snprintf(listen_fds, 32, "LISTEN_FDS=%d", config->num_listen);
+    strcpy(listen_pid, "LISTEN_PID=");
+    launch->envp[j++] = listen_fds;
+    launch->envp[j++] = listen_pid;
+    launch->listen_pid = listen_pid + strlen(listen_pid);
+  }
+  if (notifies) {
+    /** An abstract address starts with a NUL byte, which NOTIFY_SOCKET
+        spells @. */
+    struct sockaddr_un address;
+    socklen_t address_len = sizeof(address);
+    if (getsockname(launch->ready_fds[0], (struct sockaddr *)&address, &address_len) < 0) {
+      error(0, errno, "unable to get the address of the notify socket");
+      exit(EXIT_FAILURE);
+    }
+    int name_len = address_len - offsetof(struct sockaddr_un, sun_path) - 1;
+    char *notify_socket = malloc(strlen("NOTIFY_SOCKET=@") + name_len + 1);
+    if (notify_socket == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    sprintf(notify_socket, "NOTIFY_SOCKET=@%.*s", name_len, address.sun_path + 1);
+    launch->envp[j++] = notify_socket;
+  }
+  if (preloads) {
+    const char *shim = getenv("IEXEC_PRELOAD");
+    const char *preload = getenv("LD_PRELOAD");
+    if (shim == 0 || shim[0] == 0) {
+      shim = IEXEC_PRELOAD_PATH;
+    }
+    if (access(shim, R_OK) < 0) {
+      error(0, errno, "unable to use the preload shim `%s' (for --mlockall and --prefault)", shim);
+      exit(EXIT_FAILURE);
+    }
+    char *ld_preload = malloc(strlen("LD_PRELOAD=") + strlen(shim) + (preload != 0 ? strlen(preload) + 1 : 0) + 1);
+    if (ld_preload == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    sprintf(ld_preload, "LD_PRELOAD=%s%s%s", shim, preload != 0 && preload[0] != 0 ? " " : "",
+            preload != 0 ? preload : "");
+    launch->envp[j++] = ld_preload;
+    if (config->mlockall != 0) {
+      char *mlockall_flags = malloc(64);
+      if (mlockall_flags == 0) {
+        error(0, errno, "malloc failed");
+        exit(EXIT_FAILURE);
+      }
+      snprintf(mlockall_flags, 64, "IEXEC_MLOCKALL=%s%s%s",
+               config->mlockall & MCL_CURRENT ? "current," : "",
+               config->mlockall & MCL_FUTURE ? "future," : "",
+               config->mlockall & MCL_ONFAULT ? "onfault," : "");
+      /** Drop the last comma. */
+      mlockall_flags[strlen(mlockall_flags) - 1] = 0;
+      launch->envp[j++] = mlockall_flags;
+    }
+    if (config->prefault) {
+      launch->envp[j++] = "IEXEC_PREFAULT=1";
+    }
+  }
+  launch->envp[j] = 0;
+}
+
+/**
+ * Opens the cgroup given with --cgroup-path, creating it and its missing
+ * parents. A path not starting with / is relative to the root of the
+ * cgroup v2 hierarchy, wherever it is mounted. Exits on error.
+ *
+ * Returns a descriptor of the cgroup's directory.
+ */
+int iexec_cgroup_open(const char *cgroup_path) {
+  char path[PATH_MAX];
+  if (cgroup_path[0] == '/') {
+    snprintf(path, sizeof(path), "%s", cgroup_path);
+  } else {
+    FILE *mounts = setmntent("/proc/self/mounts", "r");
+    struct mntent *mount = 0;
+    while (mounts != 0 && (mount = getmntent(mounts)) != 0 && strcmp(mount->mnt_type, "cgroup2") != 0) {
+    }
+    if (mount == 0) {
+      error(0, 0, "no cgroup v2 hierarchy is mounted for --cgroup-path `%s'", cgroup_path);
+      exit(EXIT_FAILURE);
+    }
+    snprintf(path, sizeof(path), "%s/%s", mount->mnt_dir, cgroup_path);
+    endmntent(mounts);
+  }
+
+  /** Create the cgroup and its parents, like mkdir -p. */
+  for (char *slash = strchr(path + 1, '/'); ; slash = strchr(slash + 1, '/')) {
+    if (slash != 0) {
+      *slash = 0;
+    }
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+      error(0, errno, "unable to create cgroup `%s'", path);
+      exit(EXIT_FAILURE);
+    }
+    if (slash == 0) {
+      break;
+    }
+    *slash = '/';
+  }
+
+  /** An O_PATH descriptor would do for openat() but not for
+      CLONE_INTO_CGROUP. */
+  int cgroup_fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (cgroup_fd < 0) {
+    error(0, errno, "unable to open cgroup `%s'", path);
+    exit(EXIT_FAILURE);
+  }
+  return cgroup_fd;
+}
+
+/**
+ * Writes a value to a cgroup interface file.
+ *
+ * Returns 0, or a negative value if an error occurred.
+ */
+int iexec_cgroup_write(int dir_fd, const char *file, const char *value) {
+  int fd = openat(dir_fd, file, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t length = strlen(value);
+  ssize_t nwritten = write(fd, value, length);
+  int saved_errno = errno;
+  close(fd);
+  errno = saved_errno;
+  return nwritten == length ? 0 : -1;
+}
+
+/**
+ * Sets one of the resource knobs of a cgroup. When its controller is
+ * not enabled for the cgroup, it is enabled in the parent's
+ * cgroup.subtree_control first. Exits on error.
+ *
+ * @param cgroup_fd  A descriptor of the cgroup.
+ * @param controller The controller of the knob, eg memory.
+ * @param file       The knob, eg memory.max.
+ * @param value      The value to write.
+ */
+void iexec_cgroup_set(int cgroup_fd, const char *controller, const char *file, const char *value) {
+  if (iexec_cgroup_write(cgroup_fd, file, value) == 0) {
+    return;
+  }
+  if (errno == ENOENT) {
+    char enable[32];
+    snprintf(enable, sizeof(enable), "+%s", controller);
+    int parent_fd = openat(cgroup_fd, "..", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (parent_fd < 0 || iexec_cgroup_write(parent_fd, "cgroup.subtree_control", enable) < 0) {
+      error(0, errno, "unable to enable the %s controller for %s", controller, file);
+      exit(EXIT_FAILURE);
+    }
+    close(parent_fd);
+    if (iexec_cgroup_write(cgroup_fd, file, value) == 0) {
+      return;
+    }
+  }
+  error(0, errno, "unable to set %s to `%s'", file, value);
+  exit(EXIT_FAILURE);
+}
+
+/**
+ * Returns non-zero if iexec has a capability in its effective set.
+ */
+int iexec_has_capability(int capability) {
+  struct __user_cap_header_struct header = {_LINUX_CAPABILITY_VERSION_3, 0};
+  struct __user_cap_data_struct data[_LINUX_CAPABILITY_U32S_3];
+  if (syscall(SYS_capget, &header, data) < 0) {
+    return 0;
+  }
+  return (data[CAP_TO_INDEX(capability)].effective & CAP_TO_MASK(capability)) != 0;
+}
+
+/**
+ * Validates the scheduling options of a launch. Without privileges, a
+ * real-time priority must be within RLIMIT_RTPRIO and a nice value
+ * within RLIMIT_NICE, as the limits will be once the child set them, so
+ * a launch that is bound to fail stops here with a clear error. The
+ * program is privileged if it runs as root, or without -u if iexec has
+ * CAP_SYS_NICE, which the program keeps. Exits on error.
+ *
+ * @param config The configuration to launch.
+ * @param launch The launch being prepared, with its limits and user.
+ */
+void iexec_launch_prepare_sched(const iexec_config *config, iexec_launch *launch) {
+  int realtime = config->sched_policy == SCHED_FIFO || config->sched_policy == SCHED_RR;
+  if (config->sched_priority >= 0) {
+    if (!realtime) {
+      error(0, 0, "--sched-priority needs --sched=fifo or --sched=rr");
+      exit(EXIT_FAILURE);
+    }
+    int min = sched_get_priority_min(config->sched_policy);
+    int max = sched_get_priority_max(config->sched_policy);
+    if (config->sched_priority < min || config->sched_priority > max) {
+      error(0, 0, "invalid scheduling priority %d (must be from %d to %d)", config->sched_priority, min, max);
+      exit(EXIT_FAILURE);
+    }
+  } else if (realtime) {
+    error(0, 0, "--sched=fifo and --sched=rr need --sched-priority");
+    exit(EXIT_FAILURE);
+  }
+
+  int privileged = config->username != 0 ? launch->uid == 0
+    : geteuid() == 0 || iexec_has_capability(CAP_SYS_NICE);
+  if (!privileged) {
+    struct rlimit rtprio, nice;
+    if (launch->limits_set[RLIMIT_RTPRIO]) {
+      rtprio = launch->limits[RLIMIT_RTPRIO];
+    } else {
+      getrlimit(RLIMIT_RTPRIO, &rtprio);
+    }
+    if (launch->limits_set[RLIMIT_NICE]) {
+      nice = launch->limits[RLIMIT_NICE];
+    } else {
+      getrlimit(RLIMIT_NICE, &nice);
+    }
+    if (realtime && rtprio.rlim_cur != RLIM_INFINITY && (rlim_t)config->sched_priority > rtprio.rlim_cur) {
+      error(0, 0, "scheduling priority %d exceeds RLIMIT_RTPRIO=%ld", config->sched_priority, (long)rtprio.rlim_cur);
+      exit(EXIT_FAILURE);
+    }
+    /** RLIMIT_NICE caps the nice value at 20 - limit. */
+    if (config->nice != INT_MIN && config->nice < 0 && nice.rlim_cur != RLIM_INFINITY
+        && 20 - config->nice > (long)nice.rlim_cur) {
+      error(0, 0, "nice value %d exceeds RLIMIT_NICE=%ld", config->nice, (long)nice.rlim_cur);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /** An I/O priority level alone is within the best-effort class; the
+      idle class has no levels. */
+  launch->ioprio = -1;
+  if (config->ioprio_class >= 0 || config->ioprio_level >= 0) {
+    int ioprio_class = config->ioprio_class >= 0 ? config->ioprio_class : IEXEC_IOPRIO_CLASS_BEST_EFFORT;
+    int ioprio_level = config->ioprio_level >= 0 ? config->ioprio_level : 4;
+    if (ioprio_class == IEXEC_IOPRIO_CLASS_IDLE) {
+      ioprio_level = 0;
+    }
+    launch->ioprio = (ioprio_class << IEXEC_IOPRIO_CLASS_SHIFT) | ioprio_level;
+  }
+}
+
+/**
+ * Works out the resource limits to set from the --rlimit-* options and
+ * the current limits of a process. A soft limit must not exceed the
+ * hard limit it is set with (the current one unless that is changed
+ * too), and a soft limit left above a lowered hard limit is lowered to
+ * it. Exits if a soft limit is too high or the limits cannot be read.
+ *
+ * @param config     The configuration with the limits.
+ * @param pid        The process whose limits are changed (0 = iexec,
+ *                   whose limits the child inherits).
+ * @param limits     Where to store the limits to set.
+ * @param limits_set Set to non-zero for each limit to set.
+ */
+void iexec_limits_prepare(const iexec_config *config, pid_t pid, struct rlimit *limits, int *limits_set) {
+  char soft_value[32], hard_value[32];
+
+  /** For each resource limit, */
+  for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+    /* If the soft_limit or hard_limit is specified as an option, process it. */
+    const rlim_t soft_limit = config->soft_limits[i];
+    const rlim_t hard_limit = config->hard_limits[i];
+    struct rlimit *current_limit = &limits[i];
+    limits_set[i] = 0;
+    if (soft_limit != IEXEC_RLIMIT_UNCHANGED || hard_limit != IEXEC_RLIMIT_UNCHANGED) {
+      if (prlimit(pid, i, 0, current_limit) < 0) {
+        error(0, errno, "unable to get %s of process %d", limit_names[i], pid != 0 ? pid : getpid());
+        exit(EXIT_FAILURE);
+      }
+      /* If the hard limit was specified, set it in the structure. */
+      if (hard_limit != IEXEC_RLIMIT_UNCHANGED) {
+        current_limit->rlim_max = hard_limit;
+      }
+      /* If the soft limit was specified, check for validity, and then set it in the structure. */
+      if (soft_limit != IEXEC_RLIMIT_UNCHANGED) {
+        /* Check to see if the soft limit is valid. */
+        if (current_limit->rlim_max != RLIM_INFINITY
+            && (soft_limit == RLIM_INFINITY || soft_limit > current_limit->rlim_max)) {
+          error(0, 0, "specified %s_SOFT=%s exceeds %s_HARD=%s",
+                limit_names[i], iexec_format_rlimit(soft_value, sizeof(soft_value), soft_limit),
+                limit_names[i], iexec_format_rlimit(hard_value, sizeof(hard_value), current_limit->rlim_max));
+          exit(EXIT_FAILURE);
+        }
+        current_limit->rlim_cur = soft_limit;
+      }
+      /* If the soft limit is greater than the hard limit option, set
+         the soft limit to the hard limit. */
+      if (current_limit->rlim_max != RLIM_INFINITY
+          && (current_limit->rlim_cur == RLIM_INFINITY || current_limit->rlim_cur > current_limit->rlim_max)) {
+        current_limit->rlim_cur = current_limit->rlim_max;
+      }
+      limits_set[i] = 1;
+    }
+  }
+}
+
+/** A program looked up for --resolve-binary, kept open for the other
+    launches of the same name from the same working directory: the
+    instances, the programs of a manifest and restarts. */
+typedef struct iexec_resolved_binary {
+  const char *name;     /** The name the program is given as. */
+  const char *working_dir; /** The working directory it is relative to (0 = iexec's). */
+  char *path;           /** Where it was found. */
+  int fd;               /** An O_PATH descriptor of it. */
+} iexec_resolved_binary;
+
+/** The programs looked up so far. */
+iexec_resolved_binary *iexec_binary_cache = 0;
+int iexec_num_cached_binaries = 0;
+
+/**
+ * Looks up the program of a launch with --resolve-binary the way
+ * execvp() does, in the directories of PATH unless its name has a
+ * slash, relative to the working directory it is launched in, and
+ * opens the first executable regular file found with O_PATH. The child
+ * executes the open file with execveat(), so the search is done once
+ * and every launch runs the file that was found, even if another one
+ * is put in its place. Without --resolve-binary, execvp() looks the
+ * program up in the child. Exits if it is not found.
+ *
+ * @param config The configuration to launch.
+ * @param launch The launch to prepare; its working directory is open.
+ */
+void iexec_launch_prepare_binary(const iexec_config *config, iexec_launch *launch) {
+  const char *name = config->remaining_argv[0];
+  launch->binary_fd = -1;
+  launch->binary_path = name;
+  if (!config->resolve_binary) {
+    return;
+  }
+  int lowest = IEXEC_LISTEN_FDS_START + config->num_listen;
+  for (int i = 0; i < iexec_num_cached_binaries; i++) {
+    const iexec_resolved_binary *cached = &iexec_binary_cache[i];
+    if (strcmp(cached->name, name) == 0
+        && (cached->working_dir == 0 ? config->use_working_dir == 0
+            : config->use_working_dir != 0 && strcmp(cached->working_dir, config->use_working_dir) == 0)) {
+      /** A launch passing more sockets needs it above them. */
+      launch->binary_fd = cached->fd >= lowest || config->num_listen == 0 ? cached->fd
+                          : fcntl(cached->fd, F_DUPFD_CLOEXEC, lowest);
+      launch->binary_path = cached->path;
+      if (launch->binary_fd < 0) {
+        error(0, errno, "unable to duplicate the descriptor of `%s'", cached->path);
+        exit(EXIT_FAILURE);
+      }
+      return;
+    }
+  }
+
+  /** An empty entry of PATH is the working directory, and without PATH
+      the default search path is used, as with execvp(). */
+  int dir_fd = launch->working_dir_fd >= 0 ? launch->working_dir_fd : AT_FDCWD;
+  const char *search = strchr(name, '/') != 0 ? "" : getenv("PATH");
+  char default_search[256];
+  if (search == 0) {
+    confstr(_CS_PATH, default_search, sizeof(default_search));
+    search = default_search;
+  }
+  size_t name_len = strlen(name);
+  char *path = malloc(strlen(search) + name_len + 3);
+  if (path == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  int err = ENOENT, fd = -1;
+  while (fd < 0) {
+    size_t len = strcspn(search, ":");
+    if (strchr(name, '/') != 0) {
+      strcpy(path, name);
+    } else if (len == 0) {
+      snprintf(path, name_len + 3, "./%s", name);
+    } else {
+      sprintf(path, "%.*s/%s", (int)len, search, name);
+    }
+    fd = openat(dir_fd, path, O_PATH | O_CLOEXEC);
+    struct stat st;
+    if (fd >= 0 && (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)
+                    || faccessat(dir_fd, path, X_OK, 0) < 0)) {
+      close(fd);
+      fd = -1;
+      err = EACCES;
+    } else if (fd < 0 && errno == EACCES) {
+      err = EACCES;
+    }
+    if (fd < 0 && search[len] == 0) {
+      error(0, err, "unable to find `%s' for --resolve-binary", name);
+      exit(EXIT_FAILURE);
+    }
+    search += len + 1;
+  }
+
+  launch->binary_fd = iexec_launch_move_fd_up(launch, fd);
+  launch->binary_path = path;
+  iexec_resolved_binary *temp_cache = realloc(iexec_binary_cache, sizeof(iexec_resolved_binary) * (iexec_num_cached_binaries + 1));
+  if (temp_cache != 0) {
+    iexec_binary_cache = temp_cache;
+    iexec_binary_cache[iexec_num_cached_binaries].name = name;
+    iexec_binary_cache[iexec_num_cached_binaries].working_dir = config->use_working_dir;
+    iexec_binary_cache[iexec_num_cached_binaries].path = path;
+    iexec_binary_cache[iexec_num_cached_binaries].fd = launch->binary_fd;
+    iexec_num_cached_binaries++;
+  }
+}
+
+/**
+ * Prepares a launch of the program in the configuration. Everything
+ * that may need the C library beyond plain system calls (validating
+ * the resource limits, looking up the user, resolving the working
+ * directory) is done here, once, so that the launched child does not
+ * have to. Exits on error.
+ *
+ * @param config The configuration to launch.
+ * @param launch The launch to prepare.
+ */
+void iexec_launch_prepare(const iexec_config *config, iexec_launch *launch) {
+  launch->config = config;
+  launch->report_fd = -1;
+  launch->engine = IEXEC_ENGINE_AUTO;
+  launch->pid = 0;
+  launch->in_cgroup = 0;
+  launch->log_fds[0] = -1;
+  launch->log_fds[1] = -1;
+  launch->perf_fd = -1;
+  for (int i = 0; i < IEXEC_NUM_PERF_COUNTERS; i++) {
+    launch->perf_fds[i] = -1;
+  }
+  /** The counters are disabled until execvp(), so iexec's own work is
+      not counted, and read with the times they ran to scale them when
+      they had to share the hardware. */
+  memset(&launch->perf_attr, 0, sizeof(launch->perf_attr));
+  launch->perf_attr.size = sizeof(launch->perf_attr);
+  launch->perf_attr.disabled = 1;
+  launch->perf_attr.enable_on_exec = 1;
+  launch->perf_attr.inherit = 1;
+  launch->perf_attr.exclude_hv = 1;
+  launch->perf_attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+  long long traced = config->trace_timings ? iexec_trace_ns() : 0;
+
+  iexec_limits_prepare(config, 0, launch->limits, launch->limits_set);
+  traced = iexec_trace(config, "getrlimit", traced);
+
+  /** Look up the user to change to. */
+  if (config->username != 0) {
+    launch->uid = iexec_lookup_user(config->username);
+    traced = iexec_trace(config, "getpwnam", traced);
+  }
+
+  launch->working_dir_fd = -1;
+  if (config->use_working_dir != 0) {
+    launch->working_dir_fd = open(config->use_working_dir, O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (launch->working_dir_fd < 0) {
+      error(0, errno, "unable to change directory to `%s'", config->use_working_dir);
+      exit(EXIT_FAILURE);
+    }
+    traced = iexec_trace(config, "open-working-dir", traced);
+  }
+
+  iexec_launch_prepare_binary(config, launch);
+  if (config->resolve_binary) {
+    traced = iexec_trace(config, "resolve-binary", traced);
+  }
+
+  /** Create the cgroup and set its limits. cpu.max also takes a
+      QUOTA/PERIOD or a percentage of one CPU. */
+  launch->cgroup_fd = -1;
+  if (config->cgroup_path != 0) {
+    launch->cgroup_fd = iexec_cgroup_open(config->cgroup_path);
+    if (config->cpu_max != 0) {
+      char cpu_max[64];
+      char *percent = 0;
+      double share = strtod(config->cpu_max, &percent);
+      if (percent != config->cpu_max && strcmp(percent, "%") == 0) {
+        snprintf(cpu_max, sizeof(cpu_max), "%ld 100000", (long)(share * 1000));
+      } else {
+        snprintf(cpu_max, sizeof(cpu_max), "%s", config->cpu_max);
+        char *slash = strchr(cpu_max, '/');
+        if (slash != 0) {
+          *slash = ' ';
+        }
+      }
+      iexec_cgroup_set(launch->cgroup_fd, "cpu", "cpu.max", cpu_max);
+    }
+    if (config->memory_high != 0) {
+      iexec_cgroup_set(launch->cgroup_fd, "memory", "memory.high", config->memory_high);
+    }
+    if (config->memory_max != 0) {
+      iexec_cgroup_set(launch->cgroup_fd, "memory", "memory.max", config->memory_max);
+    }
+    if (config->io_weight != 0) {
+      iexec_cgroup_set(launch->cgroup_fd, "io", "io.weight", config->io_weight);
+    }
+    if (config->pids_max != 0) {
+      iexec_cgroup_set(launch->cgroup_fd, "pids", "pids.max", config->pids_max);
+    }
+    traced = iexec_trace(config, "cgroup-setup", traced);
+  } else if (config->cpu_max != 0 || config->memory_high != 0 || config->memory_max != 0
+             || config->io_weight != 0 || config->pids_max != 0) {
+    error(0, 0, "--cpu-max, --memory-high, --memory-max, --io-weight and --pids-max need --cgroup-path");
+    exit(EXIT_FAILURE);
+  }
+
+  /** Parse the CPUs and nodes to run on. --numa-node is a shorthand for
+      the CPUs of the node and --membind on it. */
+  if (config->membind != 0 && config->interleave != 0) {
+    error(0, 0, "--membind and --interleave cannot be used together");
+    exit(EXIT_FAILURE);
+  }
+  launch->cpus_set = 0;
+  launch->mempolicy = MPOL_DEFAULT;
+  char node_cpus[4096];
+  const char *cpus = config->cpus;
+  if (config->numa_node >= 0) {
+    if (config->numa_node >= IEXEC_MAX_NODES) {
+      error(0, 0, "invalid NUMA node %d", config->numa_node);
+      exit(EXIT_FAILURE);
+    }
+    if (cpus == 0) {
+      char path[64];
+      snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", config->numa_node);
+      FILE *cpulist = fopen(path, "re");
+      if (cpulist == 0 || fgets(node_cpus, sizeof(node_cpus), cpulist) == 0) {
+        error(0, cpulist == 0 ? errno : 0, "unable to read the CPUs of NUMA node %d", config->numa_node);
+        exit(EXIT_FAILURE);
+      }
+      fclose(cpulist);
+      node_cpus[strcspn(node_cpus, "\n")] = 0;
+      /** A node with memory only has no CPUs to pin to. */
+      cpus = node_cpus[0] != 0 ? node_cpus : 0;
+    }
+    if (config->membind == 0 && config->interleave == 0) {
+      launch->mempolicy = MPOL_BIND;
+      memset(launch->nodes, 0, sizeof(launch->nodes));
+      launch->nodes[config->numa_node / (8 * sizeof(unsigned long))] |= 1UL << (config->numa_node % (8 * sizeof(unsigned long)));
+    }
+  }
+  if (cpus != 0) {
+    unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))];
+    iexec_parse_list("cpus", cpus, mask, CPU_SETSIZE);
+    CPU_ZERO(&launch->cpus);
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (mask[i / (8 * sizeof(unsigned long))] & (1UL << (i % (8 * sizeof(unsigned long))))) {
+        CPU_SET(i, &launch->cpus);
+      }
+    }
+    launch->cpus_set = 1;
+  }
+  /** Pin instance i to the i-th of the CPUs it may run on, wrapping
+      around when there are more instances than CPUs. */
+  if (config->pin_instances && config->instance >= 0) {
+    if (!launch->cpus_set && sched_getaffinity(0, sizeof(launch->cpus), &launch->cpus) < 0) {
+      error(0, errno, "sched_getaffinity() failed");
+      exit(EXIT_FAILURE);
+    }
+    int num_cpus = CPU_COUNT(&launch->cpus);
+    if (num_cpus == 0) {
+      error(0, 0, "no CPUs to pin instance %d to", config->instance);
+      exit(EXIT_FAILURE);
+    }
+    int wanted = config->instance % num_cpus, nth = 0;
+    for (int i = 0; i < CPU_SETSIZE; i++) {
+      if (CPU_ISSET(i, &launch->cpus) && nth++ != wanted) {
+        CPU_CLR(i, &launch->cpus);
+      }
+    }
+    launch->cpus_set = 1;
+  }
+  if (config->membind != 0) {
+    launch->mempolicy = MPOL_BIND;
+    iexec_parse_list("membind", config->membind, launch->nodes, IEXEC_MAX_NODES);
+  } else if (config->interleave != 0) {
+    launch->mempolicy = MPOL_INTERLEAVE;
+    iexec_parse_list("interleave", config->interleave, launch->nodes, IEXEC_MAX_NODES);
+  }
+
+  traced = iexec_trace(config, "parse-cpus", traced);
+
+  iexec_launch_prepare_sched(config, launch);
+  traced = iexec_trace(config, "check-sched", traced);
+  iexec_launch_prepare_listen(config, launch);
+  traced = iexec_trace(config, "bind-listen", traced);
+  iexec_launch_prepare_ready(config, launch);
+  iexec_launch_prepare_env(config, launch);
+  iexec_trace(config, "environ", traced);
+
+  /** Sort the descriptors to keep so the child can close the runs
+      between them in order. */
+  launch->fds_to_keep = 0;
+  if (config->num_fds_to_keep > 0) {
+    launch->fds_to_keep = malloc(sizeof(int) * config->num_fds_to_keep);
+    if (launch->fds_to_keep == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(launch->fds_to_keep, config->fds_to_keep, sizeof(int) * config->num_fds_to_keep);
+    qsort(launch->fds_to_keep, config->num_fds_to_keep, sizeof(int), iexec_compare_ints);
+  }
+
+  /** The program starts with the signal mask iexec was started with. */
+  sigprocmask(SIG_SETMASK, 0, &launch->sigmask);
+  struct sigaction sigpipe_action;
+  sigaction(SIGPIPE, 0, &sigpipe_action);
+  launch->sigpipe_ignored = sigpipe_action.sa_handler == SIG_IGN;
+}
+
+/**
+ * Launches the program with the vfork engine: a clone() sharing the
+ * launching process's memory (CLONE_VM) that suspends the launching
+ * process until the child execs or exits (CLONE_VFORK). No page tables
+ * are copied.
+ *
+ * Returns the child pid or a negative value if clone() failed.
+ */
+pid_t iexec_launch_vfork(iexec_launch *launch) {
+  /** The stack is allocated once and reused since the launching process
+      is suspended for as long as a child runs on it. */
+  static char *stack = 0;
+  if (stack == 0) {
+    void *mapping = mmap(0, IEXEC_VFORK_STACK_SIZE, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (mapping == MAP_FAILED) {
+      return -1;
+    }
+    stack = mapping;
+  }
+  return clone(iexec_launch_child, stack + IEXEC_VFORK_STACK_SIZE,
+               CLONE_VM | CLONE_VFORK | SIGCHLD, launch);
+}
+
+/**
+ * Launches the program with the clone3 engine: a fork-like clone3()
+ * that, with --cgroup-path, spawns the child straight into the cgroup
+ * (CLONE_INTO_CGROUP), so it never runs outside of it and is not
+ * migrated.
+ *
+ * Returns the child pid (0 in the child) or a negative value if
+ * clone3() failed.
+ */
+pid_t iexec_launch_clone3(iexec_launch *launch) {
+#ifdef CLONE_INTO_CGROUP
+  struct clone_args args;
+  memset(&args, 0, sizeof(args));
+  args.exit_signal = SIGCHLD;
+  if (launch->cgroup_fd >= 0) {
+    args.flags = CLONE_INTO_CGROUP;
+    args.cgroup = launch->cgroup_fd;
+  }
+  return syscall(SYS_clone3, &args, sizeof(args));
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+/**
+ * Closes both ends of the socket the counters of --perf-counters come
+ * over, when the launch failed before the child started.
+ *
+ * @param launch    The launch, holding the child's end.
+ * @param parent_fd The launching process's end (-1 = none).
+ */
+void iexec_launch_close_perf_sockets(iexec_launch *launch, int parent_fd) {
+  if (parent_fd >= 0) {
+    close(parent_fd);
+  }
+  if (launch->perf_fd >= 0) {
+    close(launch->perf_fd);
+    launch->perf_fd = -1;
+  }
+}
+
+/**
+ * Receives the counters of --perf-counters the child sent before it
+ * exec'd into launch->perf_fds, without waiting: if the child sent
+ * none, none could be opened.
+ *
+ * @param launch    The launch.
+ * @param parent_fd The launching process's end of the socket.
+ */
+void iexec_launch_receive_perf(iexec_launch *launch, int parent_fd) {
+  int counters[IEXEC_NUM_PERF_COUNTERS], fds[IEXEC_NUM_PERF_COUNTERS];
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = counters, .iov_len = sizeof(counters) };
+  struct msghdr header = { .msg_iov = &iov, .msg_iovlen = 1,
+                           .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+  ssize_t n = recvmsg(parent_fd, &header, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&header) : 0;
+  if (cmsg == 0 || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+    return;
+  }
+  int num_fds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * num_fds);
+  for (int i = 0; i < num_fds; i++) {
+    if (i < n / (ssize_t)sizeof(int) && counters[i] >= 0 && counters[i] < IEXEC_NUM_PERF_COUNTERS
+        && launch->perf_fds[counters[i]] < 0) {
+      launch->perf_fds[counters[i]] = fds[i];
+    } else {
+      close(fds[i]);
+    }
+  }
+}
+
+/**
+ * Launches a prepared program. The vfork engine is tried first unless
+ * another engine was requested, or --cgroup-path was given, in which
+ * case the clone3 engine is; fork() is the fallback for when clone() or
+ * clone3() is not permitted or not available. Errors reported by the
+ * child are printed here.
+ *
+ * Returns the pid of the program, which has exec'd by the time this
+ * returns, or a negative value if the launch failed.
+ *
+ * @param launch The prepared launch.
+ */
+pid_t iexec_launch_start(iexec_launch *launch) {
+  const iexec_config *config = launch->config;
+  int report_pipe[2];
+  sigset_t all_signals, saved_mask;
+  pid_t child_pid = -1;
+  int engine = IEXEC_ENGINE_FORK;
+  int failed = 0;
+
+  if (pipe2(report_pipe, O_CLOEXEC) < 0) {
+    error(0, errno, "pipe() failed");
+    return -1;
+  }
+  report_pipe[1] = iexec_launch_move_fd_up(launch, report_pipe[1]);
+  launch->report_fd = report_pipe[1];
+  /** The counters of --perf-counters come over a socket of their own. */
+  int perf_sockets[2] = {-1, -1};
+  if (config->perf_counters != 0) {
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, perf_sockets) < 0) {
+      error(0, errno, "socketpair() failed");
+      perf_sockets[0] = -1;
+    } else {
+      launch->perf_fd = iexec_launch_move_fd_up(launch, perf_sockets[1]);
+    }
+  }
+  long long traced = config->trace_timings ? iexec_trace_ns() : 0;
+
+  /** Signal handlers must not run in a child that shares our memory. */
+  sigfillset(&all_signals);
+  sigprocmask(SIG_SETMASK, &all_signals, &saved_mask);
+
+  int wanted = config->engine;
+  if (wanted == IEXEC_ENGINE_AUTO) {
+    wanted = launch->cgroup_fd >= 0 ? IEXEC_ENGINE_CLONE3 : IEXEC_ENGINE_VFORK;
+  }
+  if (wanted == IEXEC_ENGINE_CLONE3) {
+    launch->in_cgroup = launch->cgroup_fd >= 0;
+    child_pid = iexec_launch_clone3(launch);
+    engine = IEXEC_ENGINE_CLONE3;
+    if (child_pid == 0) {
+      iexec_launch_child(launch);
+    }
+    launch->in_cgroup = 0;
+    /** Only a kernel without clone3() (or CLONE_INTO_CGROUP) falls back. */
+    if (child_pid < 0 && (config->engine == IEXEC_ENGINE_CLONE3 || (errno != ENOSYS && errno != E2BIG))) {
+      int saved_errno = errno;
+      sigprocmask(SIG_SETMASK, &saved_mask, 0);
+      close(report_pipe[0]);
+      close(report_pipe[1]);
+      iexec_launch_close_perf_sockets(launch, perf_sockets[0]);
+      error(0, saved_errno, "clone3() failed");
+      return -1;
+    }
+  } else if (wanted == IEXEC_ENGINE_VFORK) {
+    child_pid = iexec_launch_vfork(launch);
+    engine = IEXEC_ENGINE_VFORK;
+    if (child_pid < 0 && config->engine == IEXEC_ENGINE_VFORK) {
+      int saved_errno = errno;
+      sigprocmask(SIG_SETMASK, &saved_mask, 0);
+      close(report_pipe[0]);
+      close(report_pipe[1]);
+      iexec_launch_close_perf_sockets(launch, perf_sockets[0]);
+      error(0, saved_errno, "clone() failed");
+      return -1;
+    }
+  }
+  /** Fall back to the fork engine. */
+  if (child_pid < 0) {
+    child_pid = fork();
+    engine = IEXEC_ENGINE_FORK;
+    if (child_pid == 0) {
+      iexec_launch_child(launch);
+    }
+  }
+  int saved_errno = errno;
+  sigprocmask(SIG_SETMASK, &saved_mask, 0);
+  close(report_pipe[1]);
+  launch->report_fd = -1;
+  if (launch->perf_fd >= 0) {
+    close(launch->perf_fd);
+    launch->perf_fd = -1;
+  }
+
+  /** If the forking was unsuccessful, return an error message. */
+  if (child_pid < 0) {
+    close(report_pipe[0]);
+    iexec_launch_close_perf_sockets(launch, perf_sockets[0]);
+    error(0, saved_errno, "fork() failed");
+    return -1;
+  }
+
+  /** The report pipe is closed on exec, so read records until then. */
+  iexec_report report;
+  ssize_t nread;
+  while ((nread = read(report_pipe[0], &report, sizeof(report))) != 0) {
+    if (nread < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    /** A timing ends the phase since the previous one; each limit set
+        is a phase of its own, named after it (eg setrlimit-nofile). */
+    if (report.err == 0) {
+      char phase[32];
+      const char *name = stage_names[report.stage];
+      if (report.stage == IEXEC_STAGE_SETRLIMIT_SOFT) {
+        snprintf(phase, sizeof(phase), "setrlimit-%s", limit_names[report.arg] + strlen("RLIMIT_"));
+        for (char *c = phase; *c != 0; c++) {
+          *c = tolower((unsigned char)*c);
+        }
+        name = phase;
+      }
+      iexec_trace_phase(config, name, traced, report.time);
+      traced = report.time;
+      continue;
+    }
+    iexec_launch_print_report(launch, &report);
+    if (report.stage != IEXEC_STAGE_TRUNCATE && report.stage != IEXEC_STAGE_PERF) {
+      failed = 1;
+    }
+  }
+  close(report_pipe[0]);
+  if (perf_sockets[0] >= 0) {
+    if (!failed) {
+      iexec_launch_receive_perf(launch, perf_sockets[0]);
+    }
+    close(perf_sockets[0]);
+  }
+
+  if (failed) {
+    waitpid(child_pid, 0, 0);
+    return -1;
+  }
+  /** The report pipe was closed by a successful execvp(). */
+  iexec_trace(config, stage_names[IEXEC_STAGE_EXEC], traced);
+  launch->engine = engine;
+  if (config->verbose) {
+    fprintf(stderr, "%s: launched `%s' (pid %d) with the %s engine\n",
+            program_invocation_name, config->remaining_argv[0], child_pid,
+            engine_names[engine]);
+  }
+  return child_pid;
+}
+
+/**
+ * Returns the directory descriptor to resolve the pid and status files
+ * against: the working directory, which they have always been relative to.
+ */
+int iexec_working_dir_at(const iexec_launch *launch) {
+  return launch->working_dir_fd >= 0 ? launch->working_dir_fd : AT_FDCWD;
+}
+
+/**
+ * Opens a file for writing relative to the launch's working directory.
+ *
+ * Returns the opened file or 0 if an error occurred.
+ */
+FILE *iexec_fopen_at_working_dir(const iexec_launch *launch, const char *filename) {
+  int fd = openat(iexec_working_dir_at(launch), filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return 0;
+  }
+  FILE *file = fdopen(fd, "w");
+  if (file == 0) {
+    close(fd);
+  }
+  return file;
+}
+
+/**
+ * Returns the name a file replacing another with --upgrade is written
+ * under before it is renamed over the other, in a buffer of PATH_MAX.
+ */
+char *iexec_replacement_name(char *buffer, const char *filename) {
+  snprintf(buffer, PATH_MAX, "%s.upgrade", filename);
+  return buffer;
+}
+
+/**
+ * Writes the pid of a launched program to the pid file given with -p.
+ * With --upgrade, the pid is written to a new file renamed over the pid
+ * file, so that it names the replaced program or the new one, and
+ * never neither.
+ *
+ * Returns 0, or a negative value if an error occurred (and was printed).
+ *
+ * @param launch          The launch that started the program.
+ * @param child_pid       The pid of the program.
+ * @param saved_stderr_fd Where to print errors.
+ */
+int iexec_write_pid_file(const iexec_launch *launch, pid_t child_pid, int saved_stderr_fd) {
+  const iexec_config *config = launch->config;
+  long long traced = config->trace_timings ? iexec_trace_ns() : 0;
+  if (faccessat(iexec_working_dir_at(launch), config->use_pid_file, W_OK, 0) != 0 && errno != ENOENT) {
+    int saved_errno = errno;
+    if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+      error(0, saved_errno, "file specified with -p (%s) is not writable", config->use_pid_file);
+    }
+    return -1;
+  }
+
+  char replacement[PATH_MAX];
+  const char *filename = config->upgrade_pid_file != 0 ? iexec_replacement_name(replacement, config->use_pid_file)
+    : config->use_pid_file;
+  FILE *pid_file = iexec_fopen_at_working_dir(launch, filename);
+
+  /** If an error occurred when trying to open the pid_file, return it. */
+  if (pid_file == 0) {
+    int saved_errno = errno;
+    if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+      error(0, saved_errno, "unable to write pid file `%s'", config->use_pid_file);
+    }
+    return -1;
+  }
+  /** Write the pid to the pid file. */
+  int nc = fprintf(pid_file, "%d\n", child_pid);
+  if (nc == 0) {
+    int saved_errno = errno;
+    if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+      error(0, saved_errno, "unable to write data to pid file `%s'", config->use_pid_file);
+    }
+    fclose(pid_file);
+    return -1;
+  }
+
+  /** Close the pid file. */
+  if (fclose(pid_file) != 0
+      || (filename != config->use_pid_file
+          && renameat(iexec_working_dir_at(launch), filename, iexec_working_dir_at(launch), config->use_pid_file) < 0)) {
+    int saved_errno = errno;
+    if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+      error(0, saved_errno, "unable to write pid file `%s'", config->use_pid_file);
+    }
+    return -1;
+  }
+  iexec_trace(config, "pid-file", traced);
+  return 0;
+}
+
+/**
+ * Returns non-zero if the -o/-e files of a program are logs the monitor
+ * collects and rotates.
+ */
+int iexec_rotates_logs(const iexec_config *config) {
+  return !config->keep_open && (config->log_rotate_size > 0 || config->log_rotate_interval > 0);
+}
+
+/**
+ * Returns non-zero if the monitor collects the stdout or stderr of a
+ * program: to rotate its logs or to tee it to a socket.
+ */
+int iexec_collects_output(const iexec_config *config) {
+  return iexec_rotates_logs(config)
+    || (!config->keep_open && (config->stdout_tee != 0 || config->stderr_tee != 0));
+}
+
+/**
+ * Returns non-zero if a program needs a monitor process, ie a parent
+ * that stays around after the launch to watch it.
+ */
+int iexec_needs_monitor(const iexec_config *config) {
+  return config->use_status_file != 0 || config->restart != IEXEC_RESTART_NO
+    || iexec_collects_output(config) || config->wait_ready >= 0 || config->num_psi_triggers > 0
+    || config->timeout > 0 || config->ordered || config->perf_counters != 0
+    || config->subreaper;
+}
+
+/**
+ * Sends a signal to a launched program: to its whole process group if
+ * it leads one, as it does after setsid() unless -n was given, so the
+ * processes it started go with it. A stopped group is continued so it
+ * can act on the signal.
+ *
+ * @param pid   The pid of the program.
+ * @param group Non-zero if the program leads its process group.
+ * @param sig   The signal.
+ */
+int iexec_signal_program(pid_t pid, int group, int sig) {
+  int result = kill(group ? -pid : pid, sig);
+  if (result == 0 && sig != SIGKILL && sig != SIGCONT) {
+    kill(group ? -pid : pid, SIGCONT);
+  }
+  return result;
+}
+
+/**
+ * Kills a launched program and what is left of its process group with
+ * SIGKILL, and everything in its cgroup with cgroup.kill (Linux 5.14),
+ * which also catches the processes that left the group.
+ *
+ * @param cgroup_fd A descriptor of the program's cgroup (-1 = none).
+ * @param pid       The pid of the program.
+ * @param group     Non-zero if the program leads its process group.
+ * @param exited    Non-zero if the program itself has exited, so that
+ *                  its pid, which may be reused, is not signaled alone.
+ */
+void iexec_kill_program(int cgroup_fd, pid_t pid, int group, int exited) {
+  if (group || !exited) {
+    kill(group ? -pid : pid, SIGKILL);
+  }
+  if (cgroup_fd >= 0) {
+    iexec_cgroup_write(cgroup_fd, "cgroup.kill", "1");
+  }
+}
+
+/**
+ * Returns the time of the monotonic clock in milliseconds.
+ */
+long long iexec_now_ms() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+struct iexec_monitor;
+
+/**
+ * A file descriptor the monitor waits on, and what to do when it is
+ * ready. The watch itself is the epoll data, so it must stay where it is
+ * for as long as it is watched.
+ */
+typedef struct iexec_watch {
+  int fd;               /** The file descriptor to wait on. */
+  void (*handler)(struct iexec_monitor *monitor, struct iexec_watch *watch,
+                  uint32_t events); /** Called when the descriptor is ready. */
+  void *data;           /** What the descriptor belongs to. */
+} iexec_watch;
+
+/**
+ * A launched program watched by the monitor.
+ */
+typedef struct iexec_child {
+  iexec_launch *launch; /** The launch that started the program. */
+  pid_t pid;            /** The pid of the program. */
+  iexec_watch pid_watch;/** A pidfd of the program (fd -1 if pidfds are
+                            not available). */
+  FILE *status_file;    /** The status file (0 = none). */
+  iexec_status_record *status_record; /** The mapped status file of
+                            --status-format=mmap (0 = none). */
+  int running;          /** Non-zero while the program runs. */
+  int starts;           /** How many times the program was started. */
+  long long started_at; /** When the program was last started (ms). */
+  long long start_time; /** Ditto, in ns since the epoch. */
+  long long backoff;    /** The last delay before a restart (ms, 0 = none). */
+  long long window_start; /** When the current restart window began (ms). */
+  int window_restarts;  /** The restarts within the current window. */
+  iexec_watch restart_watch; /** The timerfd of a pending restart (fd -1 = none). */
+  iexec_watch sample_watch; /** The timerfd of --sample-interval (fd -1 = none). */
+  int stat_fd;          /** /proc/<pid>/stat of the run, kept open for
+                            sampling (-1 = not opened). */
+  iexec_watch ready_watch; /** The notify socket or --ready-fd pipe (fd -1 = none). */
+  iexec_watch ready_timer; /** The timerfd of the --wait-ready timeout (fd -1 = none). */
+  iexec_watch *psi_watches; /** The pressure files of --psi-watch, one
+                            per trigger (fd -1 = gone). */
+  iexec_watch timeout_watch; /** The timerfd of --timeout (fd -1 = none). */
+  iexec_watch grace_watch; /** The timerfd of --stop-grace while the run
+                            is being stopped (fd -1 = not stopping). */
+  int unready;          /** Non-zero while the run has not reported ready. */
+  int awaited;          /** Non-zero while the launching process waits
+                            for the first run to be ready. */
+  iexec_watch cap_watch; /** The timerfd of --max-descendants (fd -1 = none). */
+  pid_t *sessions;      /** The sessions of the runs whose descendants
+                            may still run, for --subreaper. */
+  int num_sessions;     /** The number of those sessions. */
+  int num_descendants;  /** The descendants of --subreaper reaped since
+                            the last C<descendants> line. */
+  int descendants_pending; /** Non-zero if a run terminated while some
+                            of its descendants still ran. */
+  int lingering;        /** Non-zero if the program is done, but watched
+                            until its descendants are gone. */
+  struct rusage descendants_usage; /** The resources they used, added up
+                            (the largest ru_maxrss). */
+  int retired;          /** Non-zero if the program is not restarted: the
+                            first run of --upgrade did not become ready. */
+} iexec_child;
+
+/**
+ * A log the monitor collects: the output a program writes to a pipe,
+ * written to the -o or -e file in batches and rotated by renaming the
+ * file and opening a new one.
+ */
+typedef struct iexec_log {
+  const iexec_launch *launch; /** The launch whose output this is. */
+  const char *name;     /** Which output this is: stdout, stderr or both. */
+  const char *path;     /** The log file, relative to the working directory. */
+  int rotates;          /** Non-zero if the file is rotated (it is regular
+                            and rotation was asked for). */
+  int fd;               /** The log file (-1 = closed). */
+  long long size;       /** The size of the log file. */
+  iexec_watch pipe_watch; /** The read end of the pipe (fd -1 = closed). */
+  iexec_watch flush_watch; /** The timerfd of a pending write (fd -1 = none). */
+  iexec_watch rotate_watch; /** The timerfd of --log-rotate-interval (fd -1 = none). */
+  char buffer[IEXEC_LOG_BUFFER_SIZE]; /** Output not written yet. */
+  size_t buffered;      /** The number of bytes in buffer. */
+  const char *tee;      /** The address of the tee socket (0 = none). With
+                            a tee, output is moved with splice() and
+                            tee() and never buffered. */
+  iexec_watch tee_watch;/** The tee socket (fd -1 = not connected). */
+  int tee_pipe[2];      /** The pipe holding output for the socket. */
+  size_t tee_pending;   /** The number of bytes in tee_pipe. */
+  long long tee_sent;   /** The number of bytes sent to the socket. */
+  long long tee_dropped;/** The number of bytes dropped for the socket. */
+  long long tee_connected_at; /** When the socket was last connected (ms). */
+} iexec_log;
+
+/**
+ * The monitor: a single event loop, built on epoll, that watches every
+ * launched program until it terminates. Each program is watched through
+ * a pidfd; on kernels without pidfd_open(), a signalfd for SIGCHLD is
+ * watched instead and the programs are polled with waitpid() when it
+ * fires. One monitor process can so watch any number of programs.
+ */
+typedef struct iexec_monitor {
+  int epoll_fd;         /** The epoll instance. */
+  iexec_child **children; /** The programs watched. */
+  int num_children;     /** The number of programs watched. */
+  int num_active;       /** The number of programs running or waiting to
+                            be restarted. */
+  iexec_watch signal_watch; /** The SIGCHLD signalfd (fd -1 = unused). */
+  iexec_log **logs;     /** The logs collected. */
+  int num_logs;         /** The number of logs collected. */
+  int saved_stderr_fd;  /** Where to print errors. */
+  int exit_status;      /** The exit status for iexec with -n: the last
+                            non-zero status of a program, 0 if none. */
+  long clock_ticks;     /** The unit of the times in /proc/<pid>/stat. */
+  long page_size;       /** The unit of the rss in /proc/<pid>/stat. */
+  int launched_fd;      /** Where to tell the launching process how many
+                            programs failed, once none is awaited (-1 =
+                            told already or nobody waits). */
+  int num_awaited;      /** The programs the launching process waits to
+                            be ready. */
+  int num_failed;       /** The programs that failed to launch or to
+                            become ready. */
+  int num_unlaunched;   /** The programs that failed to launch, or were
+                            not launched as a program they require failed. */
+  iexec_program *programs; /** The programs launched, in dependency order
+                            if they have dependencies (0 = none). */
+  int num_programs;     /** The number of those programs. */
+  int scheduling;       /** If non-zero, iexec_monitor_schedule() runs. */
+  int reschedule;       /** If non-zero, a program settled while it ran. */
+  int subreaper;        /** If non-zero, the monitor is a child subreaper
+                            and reaps the descendants reparented to it. */
+} iexec_monitor;
+
+/**
+ * Initializes a monitor. Exits if epoll is not available.
+ *
+ * @param monitor         The monitor to initialize.
+ * @param saved_stderr_fd Where to print errors.
+ */
+void iexec_monitor_init(iexec_monitor *monitor, int saved_stderr_fd) {
+  monitor->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (monitor->epoll_fd < 0) {
+    error(0, errno, "epoll_create1() failed");
+    exit(EXIT_FAILURE);
+  }
+  monitor->children = 0;
+  monitor->num_children = 0;
+  monitor->num_active = 0;
+  monitor->signal_watch.fd = -1;
+  monitor->logs = 0;
+  monitor->num_logs = 0;
+  monitor->saved_stderr_fd = saved_stderr_fd;
+  monitor->exit_status = 0;
+  monitor->clock_ticks = sysconf(_SC_CLK_TCK);
+  monitor->page_size = sysconf(_SC_PAGESIZE);
+  monitor->launched_fd = -1;
+  monitor->num_awaited = 0;
+  monitor->num_failed = 0;
+  monitor->num_unlaunched = 0;
+  monitor->programs = 0;
+  monitor->num_programs = 0;
+  monitor->scheduling = 0;
+  monitor->reschedule = 0;
+  monitor->subreaper = 0;
+  srandom(getpid() ^ iexec_now_ms());
+}
+
+/**
+ * Starts waiting on a watch's file descriptor.
+ *
+ * Returns 0, or a negative value if epoll_ctl() failed.
+ */
+int iexec_monitor_watch(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  struct epoll_event event;
+  event.events = events;
+  event.data.ptr = watch;
+  return epoll_ctl(monitor->epoll_fd, EPOLL_CTL_ADD, watch->fd, &event);
+}
+
+/**
+ * Starts a timerfd and waits on it: it fires first after delay
+ * milliseconds, then every interval milliseconds (0 = only once).
+ *
+ * Returns 0, or a negative value if an error occurred.
+ */
+int iexec_monitor_watch_timer(iexec_monitor *monitor, iexec_watch *watch, long long delay, long long interval) {
+  /** A zero it_value would disarm the timer, so the delay is at least a
+      nanosecond. */
+  struct itimerspec timer;
+  timer.it_value.tv_sec = delay / 1000;
+  timer.it_value.tv_nsec = (delay % 1000) * 1000000 + 1;
+  timer.it_interval.tv_sec = interval / 1000;
+  timer.it_interval.tv_nsec = (interval % 1000) * 1000000;
+  watch->fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+  if (watch->fd < 0) {
+    return -1;
+  }
+  if (timerfd_settime(watch->fd, 0, &timer, 0) < 0 || iexec_monitor_watch(monitor, watch, EPOLLIN) < 0) {
+    int saved_errno = errno;
+    close(watch->fd);
+    watch->fd = -1;
+    errno = saved_errno;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Stops waiting on a watch's file descriptor and closes it.
+ */
+void iexec_monitor_unwatch(iexec_monitor *monitor, iexec_watch *watch) {
+  if (watch->fd >= 0) {
+    epoll_ctl(monitor->epoll_fd, EPOLL_CTL_DEL, watch->fd, 0);
+    close(watch->fd);
+    watch->fd = -1;
+  }
+}
+
+/**
+ * Opens a log file for appending, relative to the launch's working
+ * directory.
+ *
+ * Returns 0, or a negative value if an error occurred.
+ */
+int iexec_log_open(iexec_log *log) {
+  struct stat log_stat;
+  /** splice() refuses files opened for appending, so a log with a tee
+      seeks to the end instead. */
+  log->fd = openat(iexec_working_dir_at(log->launch), log->path,
+                   O_WRONLY | O_CREAT | O_CLOEXEC | (log->tee != 0 ? 0 : O_APPEND), 0666);
+  if (log->fd < 0) {
+    return -1;
+  }
+  if (log->tee != 0) {
+    lseek(log->fd, 0, SEEK_END);
+  }
+  log->size = fstat(log->fd, &log_stat) == 0 ? log_stat.st_size : 0;
+  return 0;
+}
+
+/**
+ * Rotates a log: path.N-1 becomes path.N and so on, path becomes path.1
+ * and a new path is opened. Nothing is copied, and the program keeps
+ * writing to its pipe meanwhile.
+ */
+void iexec_log_rotate(iexec_monitor *monitor, iexec_log *log) {
+  int dir_fd = iexec_working_dir_at(log->launch);
+  int keep = log->launch->config->log_keep;
+  char from[PATH_MAX], to[PATH_MAX];
+  for (int i = keep - 1; i >= 1; i--) {
+    snprintf(from, sizeof(from), "%s.%d", log->path, i);
+    snprintf(to, sizeof(to), "%s.%d", log->path, i + 1);
+    renameat(dir_fd, from, dir_fd, to);
+  }
+  if (keep > 0) {
+    snprintf(to, sizeof(to), "%s.1", log->path);
+    renameat(dir_fd, log->path, dir_fd, to);
+  } else {
+    unlinkat(dir_fd, log->path, 0);
+  }
+  close(log->fd);
+  if (iexec_log_open(log) < 0) {
+    int saved_errno = errno;
+    if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+      error(0, saved_errno, "unable to reopen log `%s'", log->path);
+    }
+  }
+}
+
+/**
+ * Writes the buffered output of a log to its file. With
+ * --log-rotate-size, the output is split at the last line that still
+ * fits, the log rotated and the rest written to the new file, so logs
+ * do not grow beyond the size unless a single line does.
+ */
+void iexec_log_flush(iexec_monitor *monitor, iexec_log *log) {
+  const long long rotate_size = log->rotates ? log->launch->config->log_rotate_size : 0;
+  iexec_monitor_unwatch(monitor, &log->flush_watch);
+  char *start = log->buffer;
+  size_t left = log->buffered;
+  /** Output to a log that cannot be reopened is dropped. */
+  while (left > 0 && log->fd >= 0) {
+    size_t chunk = left;
+    if (rotate_size > 0 && log->size + (long long)chunk > rotate_size) {
+      size_t room = log->size < rotate_size ? rotate_size - log->size : 0;
+      char *newline = room > 0 ? memrchr(start, '\n', room) : 0;
+      if (newline != 0) {
+        chunk = newline + 1 - start;
+      } else if (log->size > 0) {
+        iexec_log_rotate(monitor, log);
+        continue;
+      } else {
+        chunk = room;
+      }
+    }
+    ssize_t nwritten = write(log->fd, start, chunk);
+    if (nwritten < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+    log->size += nwritten;
+    start += nwritten;
+    left -= nwritten;
+  }
+  log->buffered = 0;
+}
+
+/**
+ * Called when the buffered output of a log has waited long enough.
+ */
+void iexec_monitor_on_log_flush(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_log_flush(monitor, watch->data);
+}
+
+/**
+ * Called every --log-rotate-interval: rotates a log unless it is empty.
+ */
+void iexec_monitor_on_log_rotate(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_log *log = watch->data;
+  uint64_t expirations;
+  if (read(watch->fd, &expirations, sizeof(expirations)) < 0) {
+    /* Spurious wakeup. */
+  }
+  iexec_log_flush(monitor, log);
+  if (log->size > 0) {
+    iexec_log_rotate(monitor, log);
+  }
+}
+
+/**
+ * Writes the rest of a log and stops collecting it.
+ */
+void iexec_log_close(iexec_monitor *monitor, iexec_log *log) {
+  iexec_log_flush(monitor, log);
+  iexec_monitor_unwatch(monitor, &log->pipe_watch);
+  iexec_monitor_unwatch(monitor, &log->rotate_watch);
+  if (log->tee != 0) {
+    iexec_monitor_unwatch(monitor, &log->tee_watch);
+    log->tee_dropped += log->tee_pending;
+    log->tee_pending = 0;
+    close(log->tee_pipe[0]);
+    close(log->tee_pipe[1]);
+    log->tee = 0;
+  }
+  if (log->fd >= 0) {
+    close(log->fd);
+    log->fd = -1;
+  }
+}
+
+/**
+ * Connects a log's tee socket, without blocking: output is dropped
+ * until the connection is up.
+ *
+ * Returns 0, or a negative value if an error occurred.
+ */
+int iexec_log_tee_connect(iexec_monitor *monitor, iexec_log *log) {
+  int fd = -1;
+  log->tee_connected_at = iexec_now_ms();
+  if (strncmp(log->tee, "unix:", 5) == 0) {
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    snprintf(address.sun_path, sizeof(address.sun_path), "%s", log->tee + 5);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno != EINPROGRESS) {
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    /** tcp:HOST:PORT, where HOST may be an IPv6 address in brackets. */
+    char host[256];
+    snprintf(host, sizeof(host), "%s", log->tee + 4);
+    char *port = strrchr(host, ':');
+    if (port == 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    *port++ = 0;
+    char *name = host;
+    if (name[0] == '[' && port - host >= 3 && port[-2] == ']') {
+      name++;
+      port[-2] = 0;
+    }
+    struct addrinfo hints, *addresses = 0;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(name, port, &hints, &addresses) != 0) {
+      errno = EHOSTUNREACH;
+      return -1;
+    }
+    for (struct addrinfo *address = addresses; address != 0 && fd < 0; address = address->ai_next) {
+      fd = socket(address->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+      if (fd >= 0 && connect(fd, address->ai_addr, address->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(fd);
+        fd = -1;
+      }
+    }
+    freeaddrinfo(addresses);
+  }
+  if (fd < 0) {
+    return -1;
+  }
+  log->tee_watch.fd = fd;
+  if (iexec_monitor_watch(monitor, &log->tee_watch, 0) < 0) {
+    close(fd);
+    log->tee_watch.fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Closes a log's tee socket after an error, dropping the output held
+ * for it.
+ */
+void iexec_log_tee_disconnect(iexec_monitor *monitor, iexec_log *log) {
+  iexec_monitor_unwatch(monitor, &log->tee_watch);
+  while (log->tee_pending > 0) {
+    ssize_t nread = read(log->tee_pipe[0], log->buffer, sizeof(log->buffer));
+    if (nread <= 0) {
+      break;
+    }
+    log->tee_pending -= nread;
+    log->tee_dropped += nread;
+  }
+  log->tee_dropped += log->tee_pending;
+  log->tee_pending = 0;
+}
+
+/**
+ * Moves the output held for a log's tee socket into the socket. When
+ * the socket does not take it all, the monitor waits for it to become
+ * writable; meanwhile more output piles up in the tee pipe, and what no
+ * longer fits is dropped, so a slow socket never blocks the program. A
+ * lost connection drops what is held and is reconnected later.
+ */
+void iexec_log_tee_send(iexec_monitor *monitor, iexec_log *log) {
+  while (log->tee_pending > 0) {
+    ssize_t nsent = splice(log->tee_pipe[0], 0, log->tee_watch.fd, 0, log->tee_pending,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (nsent > 0) {
+      log->tee_sent += nsent;
+      log->tee_pending -= nsent;
+      continue;
+    }
+    if (nsent < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nsent < 0 && errno == EAGAIN) {
+      struct epoll_event event;
+      event.events = EPOLLOUT;
+      event.data.ptr = &log->tee_watch;
+      epoll_ctl(monitor->epoll_fd, EPOLL_CTL_MOD, log->tee_watch.fd, &event);
+      return;
+    }
+    iexec_log_tee_disconnect(monitor, log);
+    return;
+  }
+  struct epoll_event event;
+  event.events = 0;
+  event.data.ptr = &log->tee_watch;
+  epoll_ctl(monitor->epoll_fd, EPOLL_CTL_MOD, log->tee_watch.fd, &event);
+}
+
+/**
+ * Called when a log's tee socket becomes writable (or fails).
+ */
+void iexec_monitor_on_log_tee(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  if (events & (EPOLLERR | EPOLLHUP)) {
+    iexec_log_tee_disconnect(monitor, watch->data);
+  } else {
+    iexec_log_tee_send(monitor, watch->data);
+  }
+}
+
+/**
+ * Moves the output in a log's pipe without copying it to user space:
+ * tee() duplicates it into the tee pipe, as far as that has room, and
+ * splice() then moves it into the log file (which may be /dev/null).
+ *
+ * Returns the number of bytes moved, 0 if the pipe was empty.
+ */
+ssize_t iexec_log_splice(iexec_monitor *monitor, iexec_log *log) {
+  int available = 0;
+  if (ioctl(log->pipe_watch.fd, FIONREAD, &available) < 0 || available == 0) {
+    return 0;
+  }
+  if (log->tee_watch.fd < 0
+      && iexec_now_ms() - log->tee_connected_at >= IEXEC_TEE_RECONNECT_DELAY) {
+    iexec_log_tee_connect(monitor, log);
+  }
+  ssize_t nteed = 0;
+  if (log->tee_watch.fd >= 0) {
+    nteed = tee(log->pipe_watch.fd, log->tee_pipe[1], available, SPLICE_F_NONBLOCK);
+    if (nteed < 0) {
+      nteed = 0;
+    }
+    log->tee_pending += nteed;
+  }
+  log->tee_dropped += available - nteed;
+  if (nteed > 0) {
+    iexec_log_tee_send(monitor, log);
+  }
+
+  const iexec_config *config = log->launch->config;
+  if (log->rotates && config->log_rotate_size > 0 && log->size > 0
+      && log->size + available > config->log_rotate_size) {
+    iexec_log_rotate(monitor, log);
+  }
+  ssize_t left = available;
+  while (left > 0) {
+    ssize_t nmoved = log->fd >= 0 ? splice(log->pipe_watch.fd, 0, log->fd, 0, left, SPLICE_F_MOVE) : -1;
+    if (nmoved < 0 && errno == EINTR) {
+      continue;
+    }
+    if (nmoved <= 0) {
+      /** Output to a log that cannot be written is dropped. */
+      nmoved = read(log->pipe_watch.fd, log->buffer, left < (ssize_t)sizeof(log->buffer) ? left : (ssize_t)sizeof(log->buffer));
+      if (nmoved <= 0) {
+        break;
+      }
+    } else {
+      log->size += nmoved;
+    }
+    left -= nmoved;
+  }
+  return available;
+}
+
+/**
+ * Collects output from a log's pipe. Without a tee, it is read into the
+ * buffer, which is written when full or IEXEC_LOG_FLUSH_DELAY after
+ * output first arrived, so a chatty program costs a write to the log
+ * file per batch rather than per line. End of file means every writer
+ * is gone, and closes the log.
+ *
+ * Returns the number of bytes collected, 0 if there was none.
+ */
+ssize_t iexec_log_collect(iexec_monitor *monitor, iexec_log *log) {
+  if (log->tee != 0) {
+    ssize_t nmoved = iexec_log_splice(monitor, log);
+    if (nmoved == 0) {
+      /** Readable but empty: every writer is gone. */
+      char byte;
+      if (read(log->pipe_watch.fd, &byte, 1) == 0) {
+        iexec_log_close(monitor, log);
+      }
+    }
+    return nmoved;
+  }
+  ssize_t nread = read(log->pipe_watch.fd, log->buffer + log->buffered, sizeof(log->buffer) - log->buffered);
+  if (nread == 0 || (nread < 0 && errno != EAGAIN && errno != EINTR)) {
+    iexec_log_close(monitor, log);
+    return 0;
+  }
+  if (nread < 0) {
+    return 0;
+  }
+  log->buffered += nread;
+  if (log->buffered == sizeof(log->buffer)) {
+    iexec_log_flush(monitor, log);
+  } else if (log->flush_watch.fd < 0) {
+    log->flush_watch.handler = iexec_monitor_on_log_flush;
+    log->flush_watch.data = log;
+    if (iexec_monitor_watch_timer(monitor, &log->flush_watch, IEXEC_LOG_FLUSH_DELAY, 0) < 0) {
+      iexec_log_flush(monitor, log);
+    }
+  }
+  return nread;
+}
+
+/**
+ * Called when a log's pipe becomes readable.
+ */
+void iexec_monitor_on_log_output(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_log_collect(monitor, watch->data);
+}
+
+/**
+ * Gives a log a tee socket to also send the output to. Connecting is
+ * retried while output arrives if it fails here.
+ *
+ * Returns 0, or a negative value if an error occurred (and was printed).
+ */
+int iexec_log_tee_open(iexec_monitor *monitor, iexec_log *log, const char *tee) {
+  log->tee = tee;
+  log->tee_watch.fd = -1;
+  log->tee_watch.handler = iexec_monitor_on_log_tee;
+  log->tee_watch.data = log;
+  log->tee_pending = 0;
+  log->tee_sent = 0;
+  log->tee_dropped = 0;
+  if (pipe2(log->tee_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+    error(0, errno, "pipe() failed");
+    log->tee = 0;
+    return -1;
+  }
+  /** A larger pipe absorbs bursts while the socket is slow. */
+  fcntl(log->tee_pipe[1], F_SETPIPE_SZ, IEXEC_TEE_PIPE_SIZE);
+  /** An open log appending to its file stops appending for splice(). */
+  if (log->fd >= 0) {
+    fcntl(log->fd, F_SETFL, fcntl(log->fd, F_GETFL) & ~O_APPEND);
+    lseek(log->fd, 0, SEEK_END);
+  }
+  /** A tee socket closed by its peer is an error, not a signal. */
+  signal(SIGPIPE, SIG_IGN);
+  if (iexec_log_tee_connect(monitor, log) < 0) {
+    int saved_errno = errno;
+    if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+      error(0, saved_errno, "unable to connect to `%s', dropping %s until it can be", tee, log->name);
+    }
+  }
+  return 0;
+}
+
+/**
+ * Sets up the log collectors of a program whose -o/-e files are rotated
+ * or whose output is teed to a socket: a pipe per file, which the launch
+ * puts onto stdout or stderr, and which the monitor keeps open across
+ * restarts. Standard output and error given the same regular file share
+ * a pipe, and a tee. Called before the first launch.
+ *
+ * Returns 0, or a negative value if an error occurred (and was printed).
+ */
+int iexec_monitor_open_logs(iexec_monitor *monitor, iexec_launch *launch) {
+  const iexec_config *config = launch->config;
+  const char *paths[2] = {config->use_stdout_file, config->use_stderr_file};
+  const char *tees[2] = {config->stdout_tee, config->stderr_tee};
+  const char *names[2] = {"stdout", "stderr"};
+  iexec_log *stdout_log = 0;
+  if (!iexec_collects_output(config)) {
+    return 0;
+  }
+  for (int i = 0; i < 2; i++) {
+    /** /dev/null and other files that are not regular are not rotated,
+        and only collected for a tee. */
+    struct stat path_stat;
+    int regular = fstatat(iexec_working_dir_at(launch), paths[i], &path_stat, 0) != 0
+      || S_ISREG(path_stat.st_mode);
+    if (!(regular && iexec_rotates_logs(config)) && tees[i] == 0) {
+      continue;
+    }
+    if (i == 1 && regular && stdout_log != 0 && strcmp(paths[0], paths[1]) == 0) {
+      launch->log_fds[1] = launch->log_fds[0];
+      stdout_log->name = "stdout+stderr";
+      if (stdout_log->tee == 0 && tees[1] != 0 && iexec_log_tee_open(monitor, stdout_log, tees[1]) < 0) {
+        return -1;
+      }
+      continue;
+    }
+    iexec_log *log = malloc(sizeof(iexec_log));
+    iexec_log **temp_logs = realloc(monitor->logs, sizeof(iexec_log *) * (monitor->num_logs + 1));
+    if (log == 0 || temp_logs == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    monitor->logs = temp_logs;
+    monitor->logs[monitor->num_logs++] = log;
+    log->launch = launch;
+    log->name = names[i];
+    log->path = paths[i];
+    log->rotates = regular && iexec_rotates_logs(config);
+    log->buffered = 0;
+    log->flush_watch.fd = -1;
+    log->rotate_watch.fd = -1;
+    log->pipe_watch.fd = -1;
+    log->tee = 0;
+    log->fd = -1;
+    if (i == 0) {
+      stdout_log = log;
+    }
+    if (tees[i] != 0 && iexec_log_tee_open(monitor, log, tees[i]) < 0) {
+      return -1;
+    }
+    if (iexec_log_open(log) < 0) {
+      int saved_errno = errno;
+      if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+        error(0, saved_errno, "unable to open log `%s'", log->path);
+      }
+      return -1;
+    }
+    int log_pipe[2];
+    if (pipe2(log_pipe, O_CLOEXEC) < 0) {
+      error(0, errno, "pipe() failed");
+      return -1;
+    }
+    fcntl(log_pipe[0], F_SETFL, O_NONBLOCK);
+    launch->log_fds[i] = iexec_launch_move_fd_up(launch, log_pipe[1]);
+    log->pipe_watch.fd = log_pipe[0];
+    log->pipe_watch.handler = iexec_monitor_on_log_output;
+    log->pipe_watch.data = log;
+    if (iexec_monitor_watch(monitor, &log->pipe_watch, EPOLLIN) < 0) {
+      error(0, errno, "epoll_ctl() failed");
+      exit(EXIT_FAILURE);
+    }
+    if (log->rotates && config->log_rotate_interval > 0) {
+      log->rotate_watch.handler = iexec_monitor_on_log_rotate;
+      log->rotate_watch.data = log;
+      if (iexec_monitor_watch_timer(monitor, &log->rotate_watch, config->log_rotate_interval,
+                                    config->log_rotate_interval) < 0) {
+        error(0, errno, "unable to rotate log `%s'", log->path);
+        exit(EXIT_FAILURE);
+      }
+    }
+  }
+  return 0;
+}
+
+/**
+ * Closes the monitor's write ends of a program's log pipes once it is
+ * not going to be restarted, so its logs end when the last process
+ * writing to them does.
+ */
+void iexec_launch_close_logs(iexec_launch *launch) {
+  if (launch->log_fds[0] >= 0) {
+    close(launch->log_fds[0]);
+  }
+  if (launch->log_fds[1] >= 0 && launch->log_fds[1] != launch->log_fds[0]) {
+    close(launch->log_fds[1]);
+  }
+  launch->log_fds[0] = -1;
+  launch->log_fds[1] = -1;
+}
+
+/**
+ * The names --status-format=jsonl gives the values of an event that come
+ * without a name= in the text format, in order.
+ */
+const struct {
+  const char *event;
+  const char *names[3];
+} status_value_names[] = {
+  {"pid", {"pid"}},
+  {"engine", {"engine"}},
+  {"start", {"count"}},
+  {"exit", {"code"}},
+  {"kill", {"signal"}},
+  {"stop", {"signal"}},
+  {"cont", {"signal"}},
+  {"backoff", {"ms"}},
+  {"giveup", {"restarts"}},
+  {"ready", {"ms"}},
+  {"timeout", {"ms"}},
+  {"grace-expired", {"ms"}},
+  {"tee", {"stream"}},
+  {"pressure", {"resource", "kind", "trigger"}},
+  {"descendant", {"pid", "how", "code"}},
+  {"upgrade", {"pid"}}
+};
+
+/**
+ * Writes a string to a file as a JSON string.
+ */
+void iexec_json_string(FILE *file, const char *value) {
+  fputc('"', file);
+  for (; *value != 0; value++) {
+    unsigned char c = *value;
+    if (c == '"' || c == '\\') {
+      fprintf(file, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(file, "\\u%04x", c);
+    } else {
+      fputc(c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+/**
+ * Writes a word of a status line to a file as a JSON value: a number if
+ * it is one, a string otherwise.
+ */
+void iexec_json_value(FILE *file, const char *value) {
+  char *end = 0;
+  strtod(value, &end);
+  if (end != value && *end == 0 && strspn(value, "-0123456789.") == strlen(value)) {
+    fputs(value, file);
+  } else {
+    iexec_json_string(file, value);
+  }
+}
+
+/**
+ * Writes a status line as a JSON object for --status-format=jsonl: the
+ * wall-clock and monotonic time in ns, the instance of --instances, the
+ * event (the first word) and its values, named by status_value_names
+ * or by their name=. The pid event also gives the binary launched.
+ *
+ * @param child The program.
+ * @param line  The line of the text format.
+ */
+void iexec_child_status_json(iexec_child *child, char *line) {
+  const iexec_launch *launch = child->launch;
+  FILE *file = child->status_file;
+  struct timespec wall, mono;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  clock_gettime(CLOCK_MONOTONIC, &mono);
+  fprintf(file, "{\"wall_ns\":%lld,\"mono_ns\":%lld",
+          (long long)wall.tv_sec * 1000000000 + wall.tv_nsec,
+          (long long)mono.tv_sec * 1000000000 + mono.tv_nsec);
+  if (launch->config->instance >= 0) {
+    fprintf(file, ",\"instance\":%d", launch->config->instance);
+  }
+  char *save = 0;
+  char *event = strtok_r(line, " ", &save);
+  const char *const *names = 0;
+  /** A timed-out readiness is an event of its own rather than a
+      duration. */
+  if (strcmp(event, "ready") == 0 && strcmp(save, "timeout") == 0) {
+    event = "ready-timeout";
+    save = "";
+  }
+  for (int i = 0; i < (int)(sizeof(status_value_names) / sizeof(status_value_names[0])); i++) {
+    if (strcmp(status_value_names[i].event, event) == 0) {
+      names = status_value_names[i].names;
+    }
+  }
+  fputs(",\"event\":", file);
+  iexec_json_string(file, event);
+  int position = 0;
+  for (char *word = strtok_r(0, " ", &save); word != 0; word = strtok_r(0, " ", &save)) {
+    char *value = strchr(word, '=');
+    fputc(',', file);
+    if (value != 0) {
+      *value++ = 0;
+      iexec_json_string(file, word);
+    } else {
+      iexec_json_string(file, names != 0 && position < 3 && names[position] != 0 ? names[position] : "value");
+      position++;
+      value = word;
+    }
+    fputc(':', file);
+    iexec_json_value(file, value);
+  }
+  if (strcmp(event, "pid") == 0) {
+    fputs(",\"binary\":", file);
+    iexec_json_string(file, launch->binary_path);
+  }
+  fputs("}\n", file);
+  fflush(file);
+}
+
+/**
+ * Writes a line to a program's status file, or with
+ * --status-format=jsonl a JSON object (see iexec_child_status_json()).
+ * Every line is flushed, so it is on disk as soon as the event happened.
+ */
+void iexec_child_status(iexec_child *child, const char *format, ...) {
+  if (child->status_file == 0) {
+    return;
+  }
+  va_list args;
+  va_start(args, format);
+  if (child->launch->config->status_format == IEXEC_STATUS_FORMAT_JSONL) {
+    char line[1024];
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    iexec_child_status_json(child, line);
+    return;
+  }
+  vfprintf(child->status_file, format, args);
+  va_end(args);
+  fputc('\n', child->status_file);
+  fflush(child->status_file);
+}
+
+/**
+ * Updates a program's mapped status record. The sequence is made odd
+ * during the update and even again after it, with the fields stored in
+ * between, so a poller never takes a half-updated record for a
+ * consistent one.
+ *
+ * @param child  The program.
+ * @param state  Its new state (IEXEC_STATUS_*).
+ * @param value  The exit code for IEXEC_STATUS_EXITED, the signal for
+ *               IEXEC_STATUS_KILLED and IEXEC_STATUS_STOPPED, the delay
+ *               for IEXEC_STATUS_BACKOFF (unused otherwise).
+ */
+void iexec_child_record(iexec_child *child, int state, long long value) {
+  iexec_status_record *record = child->status_record;
+  if (record == 0) {
+    return;
+  }
+  uint64_t sequence = record->sequence;
+  __atomic_store_n(&record->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&record->pid, child->pid, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->state, state, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->restarts, child->starts > 0 ? child->starts - 1 : 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->start_time, child->start_time, __ATOMIC_RELAXED);
+  if (state == IEXEC_STATUS_EXITED) {
+    __atomic_store_n(&record->exit_code, value, __ATOMIC_RELAXED);
+  } else if (state == IEXEC_STATUS_KILLED || state == IEXEC_STATUS_STOPPED) {
+    __atomic_store_n(&record->signal, value, __ATOMIC_RELAXED);
+  } else if (state == IEXEC_STATUS_BACKOFF) {
+    __atomic_store_n(&record->backoff, value, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&record->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Creates the status file of --status-format=mmap, relative to the
+ * launch's working directory, and maps its record.
+ *
+ * Returns the mapped record or 0 if an error occurred.
+ */
+iexec_status_record *iexec_map_status_record(const iexec_launch *launch, const char *filename) {
+  int fd = openat(iexec_working_dir_at(launch), filename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    return 0;
+  }
+  iexec_status_record *record = MAP_FAILED;
+  if (ftruncate(fd, sizeof(iexec_status_record)) == 0) {
+    record = mmap(0, sizeof(iexec_status_record), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+  int saved_errno = errno;
+  close(fd);
+  if (record == MAP_FAILED) {
+    errno = saved_errno;
+    return 0;
+  }
+  strcpy(record->magic, IEXEC_STATUS_MAGIC);
+  record->version = IEXEC_STATUS_VERSION;
+  record->size = sizeof(iexec_status_record);
+  return record;
+}
+
+/**
+ * Writes the counts of --perf-counters of a run to the status file: a
+ * C<perf> line with name=count for each counter open, the count scaled
+ * up when the counter had to share the hardware with others.
+ */
+void iexec_child_perf(iexec_child *child) {
+  const iexec_launch *launch = child->launch;
+  char counts[IEXEC_NUM_PERF_COUNTERS * 48];
+  int len = 0;
+  for (int i = 0; i < IEXEC_NUM_PERF_COUNTERS; i++) {
+    uint64_t values[3]; /* The count, the time enabled and the time running. */
+    if (launch->perf_fds[i] < 0 || read(launch->perf_fds[i], values, sizeof(values)) != sizeof(values)) {
+      continue;
+    }
+    uint64_t count = values[0];
+    if (values[2] > 0 && values[2] < values[1]) {
+      count = (uint64_t)((double)count * values[1] / values[2]);
+    }
+    len += snprintf(counts + len, sizeof(counts) - len, " %s=%llu", perf_names[i], (unsigned long long)count);
+  }
+  if (len > 0) {
+    iexec_child_status(child, "perf%s", counts);
+  }
+}
+
+/**
+ * Called every --sample-interval while a program runs: reads its
+ * /proc/<pid>/stat and writes a C<sample> line with its CPU times (us),
+ * resident set (KiB), threads and page faults so far, after the counts
+ * of --perf-counters. The stat file is opened once per run and read
+ * again with pread().
+ */
+void iexec_monitor_on_sample(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_child *child = watch->data;
+  uint64_t expirations;
+  if (read(watch->fd, &expirations, sizeof(expirations)) < 0) {
+    /* Spurious wakeup. */
+  }
+  iexec_child_perf(child);
+  if (child->stat_fd < 0) {
+    char path[32];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)child->pid);
+    child->stat_fd = open(path, O_RDONLY | O_CLOEXEC);
+  }
+  char buffer[1024];
+  ssize_t length = child->stat_fd < 0 ? -1 : pread(child->stat_fd, buffer, sizeof(buffer) - 1, 0);
+  if (length <= 0) {
+    return;
+  }
+  buffer[length] = 0;
+
+  /** The command name may contain anything, so the fields are counted
+      from its closing parenthesis, with the state as field 3. */
+  char *fields = strrchr(buffer, ')');
+  unsigned long minflt, majflt, utime, stime;
+  long threads, rss;
+  if (fields == 0
+      || sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %lu %*u %lu %*u %lu %lu %*d %*d %*d %*d %ld %*d %*u %*u %ld",
+                &minflt, &majflt, &utime, &stime, &threads, &rss) != 6) {
+    return;
+  }
+  iexec_child_status(child, "sample utime=%lld stime=%lld rss=%ld threads=%ld minflt=%lu majflt=%lu",
+                     (long long)utime * 1000000 / monitor->clock_ticks,
+                     (long long)stime * 1000000 / monitor->clock_ticks,
+                     rss * (monitor->page_size / 1024), threads, minflt, majflt);
+}
+
+/**
+ * Tells the launching process how many programs failed, once it waits
+ * for none of them any more.
+ */
+void iexec_monitor_tell_launched(iexec_monitor *monitor) {
+  if (monitor->launched_fd < 0 || monitor->num_awaited > 0) {
+    return;
+  }
+  if (write(monitor->launched_fd, &monitor->num_failed, sizeof(monitor->num_failed)) < 0) {
+    /* The launching process is gone, keep monitoring. */
+  }
+  close(monitor->launched_fd);
+  monitor->launched_fd = -1;
+}
+
+void iexec_monitor_settle(iexec_monitor *monitor, const iexec_launch *launch, int succeeded);
+void iexec_monitor_stop_child(iexec_monitor *monitor, iexec_child *child);
+
+/**
+ * Puts the first run of --upgrade in place of the program it replaces,
+ * once ready: writes C<upgrade> and the pid of the replaced program to
+ * its status file, renames it over the one of the replaced program, and
+ * writes the pid file.
+ *
+ * Returns 0, or a negative value if an error occurred (and was printed).
+ */
+int iexec_monitor_child_upgraded(iexec_monitor *monitor, iexec_child *child) {
+  const iexec_launch *launch = child->launch;
+  const iexec_config *config = launch->config;
+  char replacement[PATH_MAX];
+  iexec_child_status(child, "upgrade %d", (int)config->upgrade_pid);
+  if (config->use_status_file != 0
+      && renameat(iexec_working_dir_at(launch), iexec_replacement_name(replacement, config->use_status_file),
+                  iexec_working_dir_at(launch), config->use_status_file) < 0) {
+    int saved_errno = errno;
+    if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+      error(0, saved_errno, "unable to write status file `%s'", config->use_status_file);
+    }
+    return -1;
+  }
+  if (config->use_pid_file != 0 && iexec_write_pid_file(launch, child->pid, monitor->saved_stderr_fd) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Settles whether a run became ready: writes C<ready> and the
+ * milliseconds since it started to the status file if it did, or
+ * C<ready timeout> if it timed out, and lets the launching process go
+ * once no program is awaited any more. With --upgrade, the first run
+ * writes the pid file once ready, and is stopped and not restarted
+ * otherwise, leaving the program it was to replace running.
+ *
+ * @param monitor The monitor.
+ * @param child   The program.
+ * @param ready   Non-zero if it reported ready, zero if it timed out or
+ *                terminated before.
+ */
+void iexec_monitor_child_ready(iexec_monitor *monitor, iexec_child *child, int ready) {
+  long long elapsed = iexec_now_ms() - child->started_at;
+  child->unready = 0;
+  iexec_monitor_unwatch(monitor, &child->ready_timer);
+  if (ready) {
+    iexec_child_status(child, "ready %lld", elapsed);
+  } else if (child->running) {
+    iexec_child_status(child, "ready timeout");
+  }
+  const iexec_config *config = child->launch->config;
+  if (config->upgrade_pid_file != 0 && child->starts == 1) {
+    if (ready && iexec_monitor_child_upgraded(monitor, child) < 0) {
+      ready = 0;
+    }
+    if (!ready) {
+      child->retired = 1;
+      if (child->running) {
+        iexec_monitor_stop_child(monitor, child);
+      }
+    }
+  }
+  if (child->awaited) {
+    child->awaited = 0;
+    monitor->num_awaited--;
+    if (!ready) {
+      monitor->num_failed++;
+      if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+        error(0, 0, child->running ? "child `%d' did not become ready in time"
+              : "child `%d' terminated before it became ready", child->pid);
+      }
+    }
+    iexec_monitor_tell_launched(monitor);
+  }
+  iexec_monitor_settle(monitor, child->launch, ready);
+}
+
+/**
+ * Called when the notify socket or the --ready-fd pipe of a program is
+ * readable: a run is ready once it sends a READY=1 line to the socket,
+ * or writes a line to the pipe.
+ */
+void iexec_monitor_on_ready(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_child *child = watch->data;
+  char message[4096];
+  ssize_t len;
+  int ready = 0;
+  while ((len = read(watch->fd, message, sizeof(message) - 1)) > 0) {
+    message[len] = 0;
+    if (child->launch->config->ready_fd >= 0) {
+      ready |= memchr(message, '\n', len) != 0;
+    } else {
+      for (char *line = message; line != 0; line = strchr(line, '\n')) {
+        line += *line == '\n';
+        ready |= strncmp(line, "READY=1", 7) == 0 && (line[7] == 0 || line[7] == '\n');
+      }
+    }
+  }
+  if (len == 0) {
+    /** Every writer is gone; the launch keeps the pipe's write end, so
+        this does not happen while the program is to be restarted. */
+    iexec_monitor_unwatch(monitor, watch);
+  }
+  if (ready && child->unready) {
+    iexec_monitor_child_ready(monitor, child, 1);
+  }
+}
+
+/**
+ * Called when a run did not report ready within --wait-ready.
+ */
+void iexec_monitor_on_ready_timeout(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_monitor_child_ready(monitor, watch->data, 0);
+}
+
+/**
+ * Called when a run being stopped outlived --stop-grace: kills it and
+ * the rest of its process group or cgroup.
+ */
+void iexec_monitor_on_grace(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_child *child = watch->data;
+  const iexec_config *config = child->launch->config;
+  iexec_monitor_unwatch(monitor, watch);
+  iexec_child_status(child, "grace-expired %lld", config->stop_grace);
+  iexec_kill_program(child->launch->cgroup_fd, child->pid, !config->no_daemonize, 0);
+}
+
+/**
+ * Stops a run, sending --stop-signal to its process group and killing
+ * what is left of it after --stop-grace, or once the program itself has
+ * exited.
+ */
+void iexec_monitor_stop_child(iexec_monitor *monitor, iexec_child *child) {
+  const iexec_config *config = child->launch->config;
+  iexec_signal_program(child->pid, !config->no_daemonize, config->stop_signal);
+  child->grace_watch.handler = iexec_monitor_on_grace;
+  child->grace_watch.data = child;
+  if (iexec_monitor_watch_timer(monitor, &child->grace_watch, config->stop_grace, 0) < 0) {
+    iexec_kill_program(child->launch->cgroup_fd, child->pid, !config->no_daemonize, 0);
+  }
+}
+
+/**
+ * Called when a run lasted --timeout: writes C<timeout> and the
+ * timeout to the status file and stops the run.
+ */
+void iexec_monitor_on_timeout(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_child *child = watch->data;
+  iexec_monitor_unwatch(monitor, watch);
+  iexec_child_status(child, "timeout %lld", child->launch->config->timeout);
+  iexec_monitor_stop_child(monitor, child);
+}
+
+/**
+ * The fields of /proc/<pid>/stat the monitor needs to attribute a
+ * process to a program.
+ */
+typedef struct iexec_process {
+  pid_t pid;            /** The pid. */
+  pid_t ppid;           /** The pid of its parent. */
+  pid_t pgrp;           /** Its process group. */
+  pid_t session;        /** Its session. */
+  char state;           /** Its state, eg R, S or Z. */
+  unsigned long long start_time; /** When it started (clock ticks after boot). */
+} iexec_process;
+
+/**
+ * Reads the stat of a process, which a zombie still has.
+ *
+ * Returns 0, or -1 if the process is gone.
+ */
+int iexec_read_process(pid_t pid, iexec_process *process) {
+  char path[32], buffer[1024];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (length <= 0) {
+    return -1;
+  }
+  buffer[length] = 0;
+  char *fields = strrchr(buffer, ')');
+  int ppid, pgrp, session;
+  if (fields == 0
+      || sscanf(fields + 1, " %c %d %d %d %*d %*d %*u %*u %*u %*u %*u %*u %*u %*d %*d %*d %*d %*d %*d %llu",
+                &process->state, &ppid, &pgrp, &session, &process->start_time) != 5) {
+    return -1;
+  }
+  process->pid = pid;
+  process->ppid = ppid;
+  process->pgrp = pgrp;
+  process->session = session;
+  return 0;
+}
+
+/**
+ * Returns the running program with a pid, or 0 if there is none.
+ */
+iexec_child *iexec_monitor_running_child(iexec_monitor *monitor, pid_t pid) {
+  for (int i = 0; i < monitor->num_children; i++) {
+    if (monitor->children[i]->running && monitor->children[i]->pid == pid) {
+      return monitor->children[i];
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns the program of --subreaper a process reparented to the monitor
+ * descends from: the one a run of which led its session or process
+ * group, or with B<-n>, when they are the monitor's own, the only such
+ * program.
+ * A descendant that started a session of its own (eg a --psi-hook) is
+ * nobody's.
+ *
+ * Returns the program, or 0 if the process is nobody's.
+ */
+iexec_child *iexec_monitor_descendant_owner(iexec_monitor *monitor, const iexec_process *process) {
+  iexec_child *only = 0;
+  int num_subreapers = 0;
+  for (int i = 0; i < monitor->num_children; i++) {
+    iexec_child *child = monitor->children[i];
+    if (!child->launch->config->subreaper) {
+      continue;
+    }
+    for (int j = 0; j < child->num_sessions; j++) {
+      if (child->sessions[j] == process->session || child->sessions[j] == process->pgrp) {
+        return child;
+      }
+    }
+    only = child;
+    num_subreapers++;
+  }
+  return num_subreapers == 1 && process->session == getsid(0) ? only : 0;
+}
+
+/**
+ * Orders processes by pid.
+ */
+int iexec_compare_processes(const void *a, const void *b) {
+  const iexec_process *process_a = a, *process_b = b;
+  return (process_a->pid > process_b->pid) - (process_a->pid < process_b->pid);
+}
+
+/**
+ * Orders processes newest first.
+ */
+int iexec_compare_newest(const void *a, const void *b) {
+  const iexec_process *process_a = *(const iexec_process * const *)a;
+  const iexec_process *process_b = *(const iexec_process * const *)b;
+  if (process_a->start_time != process_b->start_time) {
+    return process_a->start_time < process_b->start_time ? 1 : -1;
+  }
+  return (process_a->pid < process_b->pid) - (process_a->pid > process_b->pid);
+}
+
+/**
+ * Finds the live descendants of a program of --subreaper from the
+ * parents in /proc/<pid>/stat, including those reparented to the
+ * monitor.
+ *
+ * Returns the number of descendants, or -1 if /proc could not be read.
+ *
+ * @param monitor     The monitor.
+ * @param child       The program.
+ * @param found       Where to store the processes read, to be freed.
+ * @param found_descendants Where to store the descendants among them
+ *                    (0 = just count them), to be freed.
+ */
+int iexec_monitor_find_descendants(iexec_monitor *monitor, const iexec_child *child,
+                                   iexec_process **found, const iexec_process ***found_descendants) {
+  DIR *proc = opendir("/proc");
+  if (proc == 0) {
+    return -1;
+  }
+  iexec_process *processes = 0;
+  int num_processes = 0, capacity = 0;
+  struct dirent *entry;
+  while ((entry = readdir(proc)) != 0) {
+    char *end = 0;
+    long pid = strtol(entry->d_name, &end, 10);
+    if (end == entry->d_name || *end != 0 || pid <= 0) {
+      continue;
+    }
+    if (num_processes == capacity) {
+      capacity = capacity == 0 ? 256 : capacity * 2;
+      iexec_process *temp = realloc(processes, sizeof(iexec_process) * capacity);
+      if (temp == 0) {
+        break;
+      }
+      processes = temp;
+    }
+    num_processes += iexec_read_process(pid, &processes[num_processes]) == 0;
+  }
+  closedir(proc);
+  qsort(processes, num_processes, sizeof(iexec_process), iexec_compare_processes);
+
+  /** A process descends from the program if its parents lead to the
+      running program, or to a child of the monitor that is not a
+      program but is the program's. Zombies are as good as gone, but
+      for those the monitor is yet to reap. */
+  const iexec_process **descendants = malloc(sizeof(iexec_process *) * (num_processes + 1));
+  int num_descendants = 0;
+  pid_t self = getpid();
+  for (int i = 0; descendants != 0 && i < num_processes; i++) {
+    const iexec_process *process = &processes[i];
+    for (int depth = 0; process != 0 && depth < num_processes
+           && (processes[i].state != 'Z' || processes[i].ppid == self); depth++) {
+      if (child->running && process->ppid == child->pid) {
+        descendants[num_descendants++] = &processes[i];
+        break;
+      }
+      if (process->ppid == self) {
+        if (iexec_monitor_running_child(monitor, process->pid) == 0
+            && iexec_monitor_descendant_owner(monitor, process) == child) {
+          descendants[num_descendants++] = &processes[i];
+        }
+        break;
+      }
+      iexec_process parent = {.pid = process->ppid};
+      process = bsearch(&parent, processes, num_processes, sizeof(iexec_process), iexec_compare_processes);
+    }
+  }
+  if (found_descendants != 0) {
+    *found_descendants = descendants;
+  } else {
+    free(descendants);
+  }
+  *found = processes;
+  return num_descendants;
+}
+
+/**
+ * Returns the number of live descendants of a program of --subreaper,
+ * or 0 if /proc could not be read.
+ */
+int iexec_monitor_count_descendants(iexec_monitor *monitor, const iexec_child *child) {
+  iexec_process *processes = 0;
+  int num_descendants = iexec_monitor_find_descendants(monitor, child, &processes, 0);
+  free(processes);
+  return num_descendants > 0 ? num_descendants : 0;
+}
+
+void iexec_monitor_settle_descendants(iexec_monitor *monitor);
+
+/**
+ * Called every IEXEC_DESCENDANTS_INTERVAL while a program of
+ * --max-descendants or its descendants run: kills the newest of its
+ * live descendants with SIGKILL when there are too many, writing
+ * C<descendants-capped> with how many there were and how many were
+ * killed to the status file.
+ */
+void iexec_monitor_on_cap(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_child *child = watch->data;
+  uint64_t expirations;
+  if (read(watch->fd, &expirations, sizeof(expirations)) < 0) {
+    /* Spurious wakeup. */
+  }
+  iexec_process *processes = 0;
+  const iexec_process **descendants = 0;
+  int num_descendants = iexec_monitor_find_descendants(monitor, child, &processes, &descendants);
+  int max = child->launch->config->max_descendants;
+  if (num_descendants > max) {
+    qsort(descendants, num_descendants, sizeof(iexec_process *), iexec_compare_newest);
+    for (int i = 0; i < num_descendants - max; i++) {
+      kill(descendants[i]->pid, SIGKILL);
+    }
+    iexec_child_status(child, "descendants-capped live=%d killed=%d", num_descendants, num_descendants - max);
+  }
+  free(descendants);
+  free(processes);
+  if (num_descendants == 0 && child->descendants_pending) {
+    iexec_monitor_settle_descendants(monitor);
+  }
+}
+
+/**
+ * Stops watching a run of a program, once it has terminated.
+ */
+void iexec_monitor_child_ended(iexec_monitor *monitor, iexec_child *child) {
+  child->running = 0;
+  iexec_monitor_unwatch(monitor, &child->timeout_watch);
+  if (child->grace_watch.fd >= 0) {
+    iexec_monitor_unwatch(monitor, &child->grace_watch);
+    iexec_kill_program(child->launch->cgroup_fd, child->pid, !child->launch->config->no_daemonize, 1);
+  }
+  if (child->unready) {
+    iexec_monitor_child_ready(monitor, child, 0);
+  }
+  iexec_monitor_unwatch(monitor, &child->pid_watch);
+  iexec_monitor_unwatch(monitor, &child->sample_watch);
+  for (int i = 0; i < IEXEC_NUM_PERF_COUNTERS; i++) {
+    if (child->launch->perf_fds[i] >= 0) {
+      close(child->launch->perf_fds[i]);
+      child->launch->perf_fds[i] = -1;
+    }
+  }
+  if (child->stat_fd >= 0) {
+    close(child->stat_fd);
+    child->stat_fd = -1;
+  }
+}
+
+/**
+ * Stops watching a program for good, once it has terminated and is not
+ * going to be restarted. With --subreaper, the program lingers, still
+ * counted as active, until its descendants are gone too.
+ */
+void iexec_monitor_child_done(iexec_monitor *monitor, iexec_child *child) {
+  iexec_monitor_child_ended(monitor, child);
+  iexec_monitor_unwatch(monitor, &child->restart_watch);
+  if (child->descendants_pending) {
+    child->lingering = 1;
+    return;
+  }
+  iexec_monitor_unwatch(monitor, &child->cap_watch);
+  free(child->sessions);
+  child->sessions = 0;
+  child->num_sessions = 0;
+  iexec_monitor_unwatch(monitor, &child->ready_watch);
+  for (int i = 0; i < child->launch->config->num_psi_triggers; i++) {
+    iexec_monitor_unwatch(monitor, &child->psi_watches[i]);
+  }
+  if (child->status_file != 0) {
+    fclose(child->status_file);
+    child->status_file = 0;
+  }
+  if (child->status_record != 0) {
+    munmap(child->status_record, sizeof(iexec_status_record));
+    child->status_record = 0;
+  }
+  iexec_launch_close_logs(child->launch);
+  monitor->num_active--;
+}
+
+int iexec_monitor_child_started(iexec_monitor *monitor, iexec_child *child, pid_t child_pid);
+void iexec_monitor_child_exited(iexec_monitor *monitor, iexec_child *child, int failed);
+
+/**
+ * Called when the delay before a restart is over: launches the program
+ * again from its prepared launch, so the limits, user, working directory
+ * and redirections are not worked out again.
+ */
+void iexec_monitor_on_restart(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_child *child = watch->data;
+  iexec_monitor_unwatch(monitor, watch);
+  if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) != STDERR_FILENO) {
+    /* Errors of the launch are lost. */
+  }
+  pid_t child_pid = iexec_launch_start(child->launch);
+  if (child_pid < 0) {
+    /** A program that cannot be launched is a failed run. */
+    iexec_child_status(child, "err");
+    iexec_child_record(child, IEXEC_STATUS_ERROR, 0);
+    iexec_monitor_child_exited(monitor, child, 1);
+    return;
+  }
+  iexec_monitor_child_started(monitor, child, child_pid);
+}
+
+/**
+ * Returns the pid the pid file of a program names if it is not that of
+ * its last run, ie the program was replaced with --upgrade, or 0.
+ */
+pid_t iexec_child_successor(const iexec_child *child) {
+  const iexec_config *config = child->launch->config;
+  char buffer[32];
+  if (config->use_pid_file == 0) {
+    return 0;
+  }
+  int fd = openat(iexec_working_dir_at(child->launch), config->use_pid_file, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  ssize_t length = read(fd, buffer, sizeof(buffer) - 1);
+  close(fd);
+  if (length <= 0) {
+    return 0;
+  }
+  buffer[length] = 0;
+  long value = strtol(buffer, 0, 10);
+  return value > 0 && value <= INT_MAX && value != child->pid ? value : 0;
+}
+
+/**
+ * Decides whether a terminated program is restarted and, if so, sets a
+ * timer for the restart. A program replaced with --upgrade is not
+ * restarted (the new one records the handover in its status file). The delay starts at --restart-backoff-min and
+ * doubles with every restart, up to --restart-backoff-max; a run that
+ * lasted longer than --restart-backoff-max resets it. Once
+ * --restart-limit restarts happened within --restart-window, the
+ * program is given up on.
+ *
+ * @param monitor The monitor.
+ * @param child   The program that terminated.
+ * @param failed  Non-zero if it exited with a non-zero status or was
+ *                killed by a signal.
+ */
+void iexec_monitor_child_exited(iexec_monitor *monitor, iexec_child *child, int failed) {
+  const iexec_config *config = child->launch->config;
+  long long now = iexec_now_ms();
+
+  if (child->retired || iexec_child_successor(child) != 0 || config->restart == IEXEC_RESTART_NO
+      || (config->restart == IEXEC_RESTART_ON_FAILURE && !failed)) {
+    iexec_monitor_child_done(monitor, child);
+    return;
+  }
+
+  /** Count the restart in the current window, and give up on a program
+      that keeps crashing. */
+  if (now - child->window_start > config->restart_window) {
+    child->window_start = now;
+    child->window_restarts = 0;
+  }
+  if (config->restart_limit > 0 && child->window_restarts >= config->restart_limit) {
+    iexec_child_status(child, "giveup %d", child->window_restarts);
+    iexec_child_record(child, IEXEC_STATUS_GAVE_UP, 0);
+    iexec_monitor_child_done(monitor, child);
+    return;
+  }
+  child->window_restarts++;
+
+  if (child->backoff == 0 || now - child->started_at > config->restart_backoff_max) {
+    child->backoff = config->restart_backoff_min;
+  } else {
+    child->backoff *= 2;
+    if (child->backoff > config->restart_backoff_max) {
+      child->backoff = config->restart_backoff_max;
+    }
+  }
+  long long delay = child->backoff;
+  if (config->restart_jitter > 0) {
+    double spread = (2.0 * random() / RAND_MAX - 1.0) * config->restart_jitter;
+    delay += (long long)(delay * spread);
+  }
+  iexec_child_status(child, "backoff %lld", delay);
+  iexec_child_record(child, IEXEC_STATUS_BACKOFF, delay);
+
+  /** Wait for the delay in the event loop. */
+  child->restart_watch.handler = iexec_monitor_on_restart;
+  child->restart_watch.data = child;
+  if (iexec_monitor_watch_timer(monitor, &child->restart_watch, delay, 0) < 0) {
+    int saved_errno = errno;
+    iexec_child_status(child, "err");
+    iexec_child_record(child, IEXEC_STATUS_ERROR, 0);
+    iexec_monitor_child_done(monitor, child);
+    if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+      error(0, saved_errno, "unable to restart child `%d'", child->pid);
+    }
+  }
+}
+
+/**
+ * Writes what the descendants of --subreaper reaped used, added up like
+ * the RUSAGE_CHILDREN of getrusage(), to the status file: a
+ * C<descendants> line with their count and the fields of C<rusage>. The
+ * count starts again, and only the session of the last run is kept.
+ */
+void iexec_child_descendants(iexec_child *child) {
+  const struct rusage *usage = &child->descendants_usage;
+  iexec_child_status(child, "descendants count=%d utime=%lld stime=%lld maxrss=%ld minflt=%ld majflt=%ld nvcsw=%ld nivcsw=%ld inblock=%ld oublock=%ld",
+                     child->num_descendants,
+                     (long long)usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec,
+                     (long long)usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec,
+                     usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt,
+                     usage->ru_nvcsw, usage->ru_nivcsw, usage->ru_inblock, usage->ru_oublock);
+  child->num_descendants = 0;
+  memset(&child->descendants_usage, 0, sizeof(child->descendants_usage));
+  if (child->num_sessions > 1) {
+    child->sessions[0] = child->sessions[child->num_sessions - 1];
+    child->num_sessions = 1;
+  }
+}
+
+/**
+ * Called when a run of a program terminates: with --subreaper, writes
+ * the C<descendants> line, or if some of its descendants still run,
+ * leaves it to be written once the last of them is reaped.
+ */
+void iexec_monitor_child_descendants(iexec_monitor *monitor, iexec_child *child) {
+  if (!child->launch->config->subreaper) {
+    return;
+  }
+  if (iexec_monitor_count_descendants(monitor, child) > 0) {
+    child->descendants_pending = 1;
+    return;
+  }
+  child->descendants_pending = 0;
+  iexec_child_descendants(child);
+}
+
+/**
+ * Writes the resources a terminated run used, as wait4() returned them,
+ * to the status file: a C<rusage> line with the CPU times in
+ * microseconds, the maximum resident set in KiB, page faults, context
+ * switches and blocks read and written.
+ */
+void iexec_child_rusage(iexec_child *child, const struct rusage *usage) {
+  long long utime = (long long)usage->ru_utime.tv_sec * 1000000 + usage->ru_utime.tv_usec;
+  long long stime = (long long)usage->ru_stime.tv_sec * 1000000 + usage->ru_stime.tv_usec;
+  iexec_child_status(child, "rusage utime=%lld stime=%lld maxrss=%ld minflt=%ld majflt=%ld nvcsw=%ld nivcsw=%ld inblock=%ld oublock=%ld",
+                     utime, stime, usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt,
+                     usage->ru_nvcsw, usage->ru_nivcsw, usage->ru_inblock, usage->ru_oublock);
+
+  iexec_status_record *record = child->status_record;
+  if (record == 0) {
+    return;
+  }
+  /** Stored under the sequence like iexec_child_record(), which is
+      called right after. */
+  uint64_t sequence = record->sequence;
+  __atomic_store_n(&record->sequence, sequence + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&record->utime, utime, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->stime, stime, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->max_rss, usage->ru_maxrss, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->minflt, usage->ru_minflt, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->majflt, usage->ru_majflt, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->nvcsw, usage->ru_nvcsw, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->nivcsw, usage->ru_nivcsw, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->inblock, usage->ru_inblock, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->oublock, usage->ru_oublock, __ATOMIC_RELAXED);
+  __atomic_store_n(&record->sequence, sequence + 2, __ATOMIC_RELEASE);
+}
+
+/**
+ * Writes how much of a program's output went to its tee sockets, and
+ * how much was dropped, to the status file.
+ */
+void iexec_monitor_child_tees(iexec_monitor *monitor, iexec_child *child) {
+  for (int i = 0; i < monitor->num_logs; i++) {
+    iexec_log *log = monitor->logs[i];
+    if (log->launch == child->launch && log->tee != 0) {
+      iexec_child_status(child, "tee %s sent=%lld dropped=%lld", log->name, log->tee_sent, log->tee_dropped);
+    }
+  }
+}
+
+/**
+ * Settles a program that exited or was killed, unless it is to be
+ * restarted: without --wait-ready, the programs that come after it wait
+ * for it to exit.
+ *
+ * @param monitor   The monitor.
+ * @param child     The program.
+ * @param succeeded Non-zero if it exited with status 0.
+ */
+void iexec_monitor_child_settle_exit(iexec_monitor *monitor, iexec_child *child, int succeeded) {
+  if (child->restart_watch.fd < 0) {
+    iexec_monitor_settle(monitor, child->launch, succeeded);
+  }
+}
+
+/**
+ * Records a status change of a program in its status file.
+ *
+ * @param monitor The monitor.
+ * @param child   The program whose status changed.
+ * @param status  The status, as returned by wait4().
+ * @param usage   The resources it used, if it terminated.
+ */
+void iexec_monitor_child_status(iexec_monitor *monitor, iexec_child *child, int status, const struct rusage *usage) {
+  /** If the child exited, write the exit status. */
+  if (WIFEXITED(status)) {
+    int estatus = WEXITSTATUS(status);
+    iexec_child_status(child, "exit %d", estatus);
+    iexec_child_rusage(child, usage);
+    iexec_child_perf(child);
+    iexec_monitor_child_descendants(monitor, child);
+    iexec_monitor_child_tees(monitor, child);
+    iexec_child_record(child, IEXEC_STATUS_EXITED, estatus);
+    if (estatus != 0) {
+      monitor->exit_status = estatus;
+    }
+    iexec_monitor_child_ended(monitor, child);
+    iexec_monitor_child_exited(monitor, child, estatus != 0);
+    iexec_monitor_child_settle_exit(monitor, child, estatus == 0);
+  }
+  /** If the child was signaled and terminated, write the signal code. */
+  else if (WIFSIGNALED(status)) {
+    int esignal = WTERMSIG(status);
+    iexec_child_status(child, "kill %d", esignal);
+    iexec_child_rusage(child, usage);
+    iexec_child_perf(child);
+    iexec_monitor_child_descendants(monitor, child);
+    iexec_monitor_child_tees(monitor, child);
+    iexec_child_record(child, IEXEC_STATUS_KILLED, esignal);
+    monitor->exit_status = 128 + esignal;
+    iexec_monitor_child_ended(monitor, child);
+    iexec_monitor_child_exited(monitor, child, 1);
+    iexec_monitor_child_settle_exit(monitor, child, 0);
+  }
+  /** If the child was signaled and stopped, write the signal code. */
+  else if (WIFSTOPPED(status)) {
+    int esignal = WSTOPSIG(status);
+    iexec_child_status(child, "stop %d", esignal);
+    iexec_child_record(child, IEXEC_STATUS_STOPPED, esignal);
+  }
+  /** If the child was continued, write the signal code. */
+  else if (WIFCONTINUED(status)) {
+    int esignal = 18;
+    iexec_child_status(child, "cont %d", esignal);
+    iexec_child_record(child, IEXEC_STATUS_RUNNING, 0);
+  }
+}
+
+/**
+ * Collects the status of a program if it has changed, without blocking.
+ */
+void iexec_monitor_reap(iexec_monitor *monitor, iexec_child *child) {
+  /** Slots to store the status and the resources used. */
+  int status;
+  struct rusage usage;
+  int wret = wait4(child->pid, &status, WNOHANG, &usage);
+  /** If successful in reading a status change... */
+  if (wret > 0) {
+    iexec_monitor_child_status(monitor, child, status, &usage);
+  }
+  /** If there was an error, report it. */
+  else if (wret < 0) {
+    int saved_errno = errno;
+    iexec_child_status(child, "err");
+    iexec_child_record(child, IEXEC_STATUS_ERROR, 0);
+    iexec_monitor_child_done(monitor, child);
+    monitor->exit_status = EXIT_FAILURE;
+    if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+      error(0, saved_errno, "error waiting for child `%d'", child->pid);
+    }
+    iexec_monitor_settle(monitor, child->launch, 0);
+  }
+}
+
+/**
+ * Reaps a descendant of a program that was reparented to the monitor
+ * and terminated: writes C<descendant> with its pid and how it
+ * terminated to the status file of its program, and adds what it used
+ * to the program's C<descendants>.
+ */
+void iexec_monitor_reap_descendant(iexec_monitor *monitor, pid_t pid) {
+  iexec_process process;
+  int known = iexec_read_process(pid, &process) == 0;
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, WNOHANG, &usage) <= 0 || !known) {
+    return;
+  }
+  iexec_child *child = iexec_monitor_descendant_owner(monitor, &process);
+  if (child == 0) {
+    return;
+  }
+  if (WIFEXITED(status)) {
+    iexec_child_status(child, "descendant %d exit %d", (int)pid, WEXITSTATUS(status));
+  } else {
+    iexec_child_status(child, "descendant %d kill %d", (int)pid, WTERMSIG(status));
+  }
+  struct rusage *total = &child->descendants_usage;
+  child->num_descendants++;
+  timeradd(&total->ru_utime, &usage.ru_utime, &total->ru_utime);
+  timeradd(&total->ru_stime, &usage.ru_stime, &total->ru_stime);
+  if (usage.ru_maxrss > total->ru_maxrss) {
+    total->ru_maxrss = usage.ru_maxrss;
+  }
+  total->ru_minflt += usage.ru_minflt;
+  total->ru_majflt += usage.ru_majflt;
+  total->ru_nvcsw += usage.ru_nvcsw;
+  total->ru_nivcsw += usage.ru_nivcsw;
+  total->ru_inblock += usage.ru_inblock;
+  total->ru_oublock += usage.ru_oublock;
+}
+
+/**
+ * Reaps every child of the monitor that terminated, when it is a
+ * subreaper: the programs, and the descendants reparented to it. A
+ * child is looked at with WNOWAIT first, so a descendant's stat is
+ * still there to attribute it.
+ */
+void iexec_monitor_reap_descendants(iexec_monitor *monitor) {
+  siginfo_t info;
+  for (;;) {
+    info.si_pid = 0;
+    if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) < 0 || info.si_pid == 0) {
+      return;
+    }
+    iexec_child *child = iexec_monitor_running_child(monitor, info.si_pid);
+    if (child != 0) {
+      iexec_monitor_reap(monitor, child);
+    } else {
+      iexec_monitor_reap_descendant(monitor, info.si_pid);
+    }
+  }
+}
+
+/**
+ * Writes the C<descendants> line of the programs whose terminated runs
+ * left descendants, once none of them runs any more, and lets go of
+ * the programs that lingered for them.
+ */
+void iexec_monitor_settle_descendants(iexec_monitor *monitor) {
+  for (int i = 0; i < monitor->num_children; i++) {
+    iexec_child *child = monitor->children[i];
+    if (!child->descendants_pending || iexec_monitor_count_descendants(monitor, child) > 0) {
+      continue;
+    }
+    child->descendants_pending = 0;
+    iexec_child_descendants(child);
+    if (child->lingering) {
+      child->lingering = 0;
+      iexec_monitor_child_done(monitor, child);
+    }
+  }
+}
+
+/**
+ * Called when a program's pidfd becomes readable, ie it terminated.
+ */
+void iexec_monitor_on_pidfd(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_monitor_reap(monitor, watch->data);
+}
+
+/**
+ * Called when SIGCHLD arrives on the signalfd. Signals are merged, so
+ * every running program is polled, and with --subreaper, every
+ * descendant reparented to the monitor.
+ */
+void iexec_monitor_on_sigchld(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  struct signalfd_siginfo info;
+  while (read(watch->fd, &info, sizeof(info)) == sizeof(info)) {
+  }
+  for (int i = 0; i < monitor->num_children; i++) {
+    if (monitor->children[i]->running) {
+      iexec_monitor_reap(monitor, monitor->children[i]);
+    }
+  }
+  if (monitor->subreaper) {
+    iexec_monitor_reap_descendants(monitor);
+    iexec_monitor_settle_descendants(monitor);
+  }
+}
+
+/**
+ * Switches the monitor to watching SIGCHLD through a signalfd, for
+ * kernels without pidfd_open(). SIGCHLD is blocked in the monitor only;
+ * launched programs get the signal mask from their launch.
+ *
+ * Returns 0, or a negative value if an error occurred.
+ */
+int iexec_monitor_use_signalfd(iexec_monitor *monitor) {
+  if (monitor->signal_watch.fd >= 0) {
+    return 0;
+  }
+  sigset_t sigchld;
+  sigemptyset(&sigchld);
+  sigaddset(&sigchld, SIGCHLD);
+  sigprocmask(SIG_BLOCK, &sigchld, 0);
+  monitor->signal_watch.fd = signalfd(-1, &sigchld, SFD_CLOEXEC | SFD_NONBLOCK);
+  monitor->signal_watch.handler = iexec_monitor_on_sigchld;
+  monitor->signal_watch.data = 0;
+  if (monitor->signal_watch.fd < 0
+      || iexec_monitor_watch(monitor, &monitor->signal_watch, EPOLLIN) < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Records a (re)started program: writes its pid file and the first lines
+ * for the run to its status file, and starts waiting for it to
+ * terminate.
+ *
+ * Returns 0, or a negative value if the pid file could not be written.
+ *
+ * @param monitor    The monitor.
+ * @param child      The program.
+ * @param child_pid  The pid of the new run.
+ */
+int iexec_monitor_child_started(iexec_monitor *monitor, iexec_child *child, pid_t child_pid) {
+  const iexec_config *config = child->launch->config;
+  int result = 0;
+
+  child->pid = child_pid;
+  child->running = 1;
+  child->starts++;
+  child->started_at = iexec_now_ms();
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  child->start_time = (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+
+  /** The pid file of the first run was written before the status file
+      was opened, rewrite it for a restart. */
+  if (config->use_pid_file != 0 && child->starts > 1
+      && iexec_write_pid_file(child->launch, child_pid, monitor->saved_stderr_fd) < 0) {
+    result = -1;
+  }
+
+  iexec_child_status(child, "pid %d", child_pid);
+  iexec_child_status(child, "engine %s", engine_names[child->launch->engine]);
+  if (config->restart != IEXEC_RESTART_NO) {
+    iexec_child_status(child, "start %d", child->starts);
+  }
+  iexec_child_record(child, IEXEC_STATUS_RUNNING, 0);
+
+  /** Wait for the program to terminate through a pidfd, or through
+      SIGCHLD if pidfds are not available. */
+  child->pid_watch.fd = pidfd_open(child_pid, 0);
+  child->pid_watch.handler = iexec_monitor_on_pidfd;
+  child->pid_watch.data = child;
+  if (child->pid_watch.fd >= 0) {
+    if (iexec_monitor_watch(monitor, &child->pid_watch, EPOLLIN) < 0) {
+      error(0, errno, "epoll_ctl() failed");
+      exit(EXIT_FAILURE);
+    }
+  } else if (iexec_monitor_use_signalfd(monitor) < 0) {
+    error(0, errno, "unable to watch child `%d'", child_pid);
+    exit(EXIT_FAILURE);
+  }
+
+  if (config->wait_ready >= 0) {
+    child->unready = 1;
+    child->ready_timer.handler = iexec_monitor_on_ready_timeout;
+    child->ready_timer.data = child;
+    if (config->wait_ready > 0
+        && iexec_monitor_watch_timer(monitor, &child->ready_timer, config->wait_ready, 0) < 0) {
+      error(0, errno, "unable to wait for child `%d' to be ready", child_pid);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (config->timeout > 0) {
+    child->timeout_watch.handler = iexec_monitor_on_timeout;
+    child->timeout_watch.data = child;
+    if (iexec_monitor_watch_timer(monitor, &child->timeout_watch, config->timeout, 0) < 0) {
+      error(0, errno, "unable to time child `%d'", child_pid);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /** Descendants are told apart by the session of the run, unless it
+      is the monitor's own (-n). */
+  pid_t session = getsid(child_pid);
+  if (config->subreaper && session != getsid(0)) {
+    pid_t *temp_sessions = realloc(child->sessions, sizeof(pid_t) * (child->num_sessions + 1));
+    if (temp_sessions == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    child->sessions = temp_sessions;
+    child->sessions[child->num_sessions++] = session > 0 ? session : child_pid;
+  }
+  if (config->max_descendants > 0 && child->cap_watch.fd < 0) {
+    child->cap_watch.handler = iexec_monitor_on_cap;
+    child->cap_watch.data = child;
+    if (iexec_monitor_watch_timer(monitor, &child->cap_watch, IEXEC_DESCENDANTS_INTERVAL, IEXEC_DESCENDANTS_INTERVAL) < 0) {
+      error(0, errno, "unable to count the descendants of child `%d'", child_pid);
+    }
+  }
+  if (config->sample_interval > 0) {
+    child->sample_watch.handler = iexec_monitor_on_sample;
+    child->sample_watch.data = child;
+    if (iexec_monitor_watch_timer(monitor, &child->sample_watch, config->sample_interval, config->sample_interval) < 0) {
+      error(0, errno, "unable to sample child `%d'", child_pid);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (child->pid_watch.fd < 0) {
+    /** The program may have exited before SIGCHLD was blocked. */
+    iexec_monitor_reap(monitor, child);
+  }
+  return result;
+}
+
+/**
+ * Opens the pressure file of each trigger of --psi-watch and registers
+ * the trigger on it: the file of the program's cgroup with
+ * --cgroup-path, the system-wide one in /proc/pressure otherwise. The
+ * kernel then wakes the monitor with EPOLLPRI when the trigger fires.
+ * The triggers are registered once and kept across restarts.
+ *
+ * Returns the watches of the files, or 0 if there are no triggers or an
+ * error occurred (and was printed).
+ *
+ * @param launch          The launch of the program.
+ * @param saved_stderr_fd Where to print errors.
+ */
+iexec_watch *iexec_psi_open_triggers(const iexec_launch *launch, int saved_stderr_fd) {
+  const iexec_config *config = launch->config;
+  if (config->num_psi_triggers == 0) {
+    return 0;
+  }
+  iexec_watch *watches = malloc(sizeof(iexec_watch) * config->num_psi_triggers);
+  if (watches == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < config->num_psi_triggers; i++) {
+    const iexec_psi_trigger *trigger = &config->psi_triggers[i];
+    char path[64], spec[64];
+    snprintf(path, sizeof(path), launch->cgroup_fd >= 0 ? "%s.pressure" : "/proc/pressure/%s",
+             psi_names[trigger->resource]);
+    int length = snprintf(spec, sizeof(spec), "%s %lld %lld", trigger->full ? "full" : "some",
+                          trigger->stall, trigger->window);
+    /** The trigger lives as long as the descriptor it was written to. */
+    watches[i].fd = openat(launch->cgroup_fd >= 0 ? launch->cgroup_fd : AT_FDCWD, path,
+                           O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (watches[i].fd < 0 || write(watches[i].fd, spec, length + 1) < 0) {
+      int saved_errno = errno;
+      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+        error(0, saved_errno, "unable to watch `%s' for --psi-watch", path);
+      }
+      for (int j = 0; j <= i; j++) {
+        if (watches[j].fd >= 0) {
+          close(watches[j].fd);
+        }
+      }
+      free(watches);
+      return 0;
+    }
+  }
+  return watches;
+}
+
+/**
+ * Runs the --psi-hook command with /bin/sh in the background, with the
+ * pid of the program in IEXEC_PID and the trigger that fired in
+ * IEXEC_PRESSURE. The command runs in a grandchild of the monitor, which
+ * only reaps the child in between, so the monitor never waits for it.
+ *
+ * @param command The command.
+ * @param pid     The pid of the program.
+ * @param event   The trigger, eg "memory some 150000/1000000".
+ */
+void iexec_monitor_run_hook(const char *command, pid_t pid, const char *event) {
+  pid_t hook_pid = fork();
+  if (hook_pid == 0) {
+    if (fork() == 0) {
+      char pid_text[16];
+      sigset_t mask;
+      snprintf(pid_text, sizeof(pid_text), "%d", (int)pid);
+      setenv("IEXEC_PID", pid_text, 1);
+      setenv("IEXEC_PRESSURE", event, 1);
+      sigemptyset(&mask);
+      sigprocmask(SIG_SETMASK, &mask, 0);
+      setsid();
+      execl("/bin/sh", "sh", "-c", command, (char *)0);
+      _exit(127);
+    }
+    _exit(0);
+  }
+  if (hook_pid > 0) {
+    waitpid(hook_pid, 0, 0);
+  }
+}
+
+/**
+ * Called when a trigger of --psi-watch fires, at most once per window:
+ * writes C<pressure> with the trigger and the avg10 and total of the
+ * pressure file to the status file, then sends --psi-signal to the
+ * program and runs --psi-hook if it is running. A file whose cgroup was
+ * removed is no longer watched.
+ */
+void iexec_monitor_on_pressure(iexec_monitor *monitor, iexec_watch *watch, uint32_t events) {
+  iexec_child *child = watch->data;
+  const iexec_config *config = child->launch->config;
+  const iexec_psi_trigger *trigger = &config->psi_triggers[watch - child->psi_watches];
+  if (events & EPOLLERR) {
+    iexec_monitor_unwatch(monitor, watch);
+    return;
+  }
+  /** The file holds a line per kind, eg
+      some avg10=1.52 avg60=0.80 avg300=0.20 total=4290146 */
+  char buffer[256], avg10[16] = "?";
+  unsigned long long total = 0;
+  ssize_t length = pread(watch->fd, buffer, sizeof(buffer) - 1, 0);
+  if (length > 0) {
+    buffer[length] = 0;
+    const char *line = trigger->full ? strstr(buffer, "full ") : strstr(buffer, "some ");
+    if (line != 0) {
+      sscanf(line, "%*s avg10=%15s %*s %*s total=%llu", avg10, &total);
+    }
+  }
+  char event[64];
+  snprintf(event, sizeof(event), "%s %s %lld/%lld", psi_names[trigger->resource],
+           trigger->full ? "full" : "some", trigger->stall, trigger->window);
+  iexec_child_status(child, "pressure %s avg10=%s total=%llu", event, avg10, total);
+  if (!child->running) {
+    return;
+  }
+  if (config->psi_signal > 0) {
+    kill(child->pid, config->psi_signal);
+  }
+  if (config->psi_hook != 0) {
+    iexec_monitor_run_hook(config->psi_hook, child->pid, event);
+  }
+}
+
+/**
+ * Takes a launched program under the monitor's watch: opens its status
+ * file, writes its pid file and the first lines of the status file and
+ * starts waiting for it to terminate.
+ *
+ * Returns 0, or a negative value if an error occurred (and was printed).
+ *
+ * @param monitor    The monitor.
+ * @param launch     The launch that started the program.
+ * @param child_pid  The pid of the program.
+ */
+int iexec_monitor_child_as_parent(iexec_monitor *monitor, iexec_launch *launch, pid_t child_pid) {
+  const iexec_config *config = launch->config;
+  int saved_stderr_fd = monitor->saved_stderr_fd;
+  FILE *status_file = 0;
+  iexec_status_record *status_record = 0;
+
+  /** The pid file is written before the status file is opened; with
+      --upgrade, once the program is ready. */
+  if (config->use_pid_file != 0 && config->upgrade_pid_file == 0
+      && iexec_write_pid_file(launch, child_pid, saved_stderr_fd) < 0) {
+    return -1;
+  }
+
+  if (config->use_status_file != 0) {
+    if (faccessat(iexec_working_dir_at(launch), config->use_status_file, W_OK, 0) != 0 && errno != ENOENT) {
+      int saved_errno = errno;
+      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+        error(0, saved_errno, "file specified with -s (%s) is not writable", config->use_status_file);
+      }
+      return -1;
+    }
+
+    /** With --upgrade, the status file is a new one, renamed over the
+        one the monitor of the replaced program writes once ready. */
+    char replacement[PATH_MAX];
+    const char *filename = config->upgrade_pid_file != 0
+      ? iexec_replacement_name(replacement, config->use_status_file) : config->use_status_file;
+    if (config->status_format == IEXEC_STATUS_FORMAT_MMAP) {
+      status_record = iexec_map_status_record(launch, filename);
+    } else {
+      status_file = iexec_fopen_at_working_dir(launch, filename);
+    }
+
+    /** If an error occurred when trying to open the status file, return it. */
+    if (status_file == 0 && status_record == 0) {
+      int saved_errno = errno;
+      if (dup2(saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+        error(0, saved_errno, "unable to write status file `%s'", config->use_status_file);
+      }
+      return -1;
+    }
+  }
+
+  iexec_watch *psi_watches = iexec_psi_open_triggers(launch, saved_stderr_fd);
+  if (psi_watches == 0 && config->num_psi_triggers > 0) {
+    if (status_file != 0) {
+      fclose(status_file);
+    }
+    if (status_record != 0) {
+      munmap(status_record, sizeof(iexec_status_record));
+    }
+    return -1;
+  }
+
+  iexec_child *child = malloc(sizeof(iexec_child));
+  iexec_child **temp_children = realloc(monitor->children, sizeof(iexec_child *) * (monitor->num_children + 1));
+  if (child == 0 || temp_children == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  monitor->children = temp_children;
+  monitor->children[monitor->num_children++] = child;
+  memset(child, 0, sizeof(iexec_child));
+  child->launch = launch;
+  child->status_file = status_file;
+  child->status_record = status_record;
+  child->restart_watch.fd = -1;
+  child->timeout_watch.fd = -1;
+  child->grace_watch.fd = -1;
+  child->sample_watch.fd = -1;
+  child->stat_fd = -1;
+  child->window_start = iexec_now_ms();
+  child->ready_watch.fd = -1;
+  child->ready_timer.fd = -1;
+  child->cap_watch.fd = -1;
+  monitor->num_active++;
+
+  /** Messages the program sent before this are queued in the socket or
+      the pipe, so none is missed. */
+  if (config->wait_ready >= 0) {
+    child->ready_watch.fd = launch->ready_fds[0];
+    child->ready_watch.handler = iexec_monitor_on_ready;
+    child->ready_watch.data = child;
+    if (iexec_monitor_watch(monitor, &child->ready_watch, EPOLLIN) < 0) {
+      error(0, errno, "epoll_ctl() failed");
+      exit(EXIT_FAILURE);
+    }
+    child->awaited = 1;
+    monitor->num_awaited++;
+  }
+
+  child->psi_watches = psi_watches;
+  for (int i = 0; i < config->num_psi_triggers; i++) {
+    psi_watches[i].handler = iexec_monitor_on_pressure;
+    psi_watches[i].data = child;
+    if (iexec_monitor_watch(monitor, &psi_watches[i], EPOLLPRI) < 0) {
+      error(0, errno, "epoll_ctl() failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  return iexec_monitor_child_started(monitor, child, child_pid);
+}
+
+/**
+ * Runs the monitor's event loop until every program it watches has
+ * terminated and is not going to be restarted.
+ *
+ * Returns the exit status for iexec with -n.
+ */
+int iexec_monitor_run(iexec_monitor *monitor) {
+  struct epoll_event events[16];
+  while (monitor->num_active > 0) {
+    int num_events = epoll_wait(monitor->epoll_fd, events, 16, -1);
+    if (num_events < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      int saved_errno = errno;
+      if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) == STDERR_FILENO) {
+        error(0, saved_errno, "epoll_wait() failed");
+      }
+      return EXIT_FAILURE;
+    }
+    for (int i = 0; i < num_events; i++) {
+      iexec_watch *watch = events[i].data.ptr;
+      watch->handler(monitor, watch, events[i].events);
+    }
+  }
+  /** Write what is left of the logs; output still in their pipes is
+      read until the pipes are empty, without waiting for more. */
+  for (int i = 0; i < monitor->num_logs; i++) {
+    iexec_log *log = monitor->logs[i];
+    while (log->pipe_watch.fd >= 0 && iexec_log_collect(monitor, log) > 0) {
+    }
+    iexec_log_close(monitor, log);
+  }
+  return monitor->exit_status;
+}
+
+/**
+ * Launches a program and watches it.
+ *
+ * Returns 0, or a negative value if the launch failed (and was
+ * counted and reported).
+ */
+int iexec_monitor_launch_program(iexec_monitor *monitor, iexec_program *program) {
+  iexec_launch *launch = &program->launch;
+  if (iexec_monitor_open_logs(monitor, launch) < 0) {
+    program->state = IEXEC_PROGRAM_FAILED;
+    monitor->num_failed++;
+    monitor->num_unlaunched++;
+    return -1;
+  }
+  pid_t child_pid = iexec_launch_start(launch);
+  program->state = IEXEC_PROGRAM_STARTED;
+  if (child_pid >= 0) {
+    launch->pid = child_pid;
+  }
+  if (child_pid < 0 || iexec_monitor_child_as_parent(monitor, launch, child_pid) < 0) {
+    iexec_launch_close_logs(launch);
+    program->state = IEXEC_PROGRAM_FAILED;
+    monitor->num_failed++;
+    monitor->num_unlaunched++;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Launches the programs of a manifest whose dependencies are settled,
+ * ie ready (with --wait-ready) or exited successfully (without), or
+ * failed. A program that requires one that failed is not launched and
+ * fails in turn, so what depends on it is settled too. Runs until no
+ * program is left to launch, also when launching settles a program.
+ */
+void iexec_monitor_schedule(iexec_monitor *monitor) {
+  if (monitor->scheduling) {
+    monitor->reschedule = 1;
+    return;
+  }
+  monitor->scheduling = 1;
+  do {
+    monitor->reschedule = 0;
+    for (int i = 0; i < monitor->num_programs; i++) {
+      iexec_program *program = &monitor->programs[i];
+      if (program->state != IEXEC_PROGRAM_PENDING) {
+        continue;
+      }
+      int waiting = 0;
+      const iexec_program *failed = 0;
+      for (int j = 0; j < program->num_deps; j++) {
+        const iexec_program *dep = &monitor->programs[program->deps[j].program];
+        if (dep->state == IEXEC_PROGRAM_PENDING || dep->state == IEXEC_PROGRAM_STARTED) {
+          waiting = 1;
+        } else if (dep->state == IEXEC_PROGRAM_FAILED && program->deps[j].required) {
+          failed = dep;
+        }
+      }
+      if (failed == 0 && waiting) {
+        continue;
+      }
+      monitor->num_awaited--;
+      monitor->reschedule = 1;
+      if (dup2(monitor->saved_stderr_fd, STDERR_FILENO) != STDERR_FILENO) {
+        /* Errors of the launch are lost. */
+      }
+      if (failed != 0) {
+        error(0, 0, "not launching `%s': `%s' it requires failed",
+              iexec_program_name(&program->config), iexec_program_name(&failed->config));
+        program->state = IEXEC_PROGRAM_FAILED;
+        monitor->num_failed++;
+        monitor->num_unlaunched++;
+      } else {
+        iexec_monitor_launch_program(monitor, program);
+      }
+    }
+  } while (monitor->reschedule);
+  monitor->scheduling = 0;
+  iexec_monitor_tell_launched(monitor);
+}
+
+/**
+ * Settles a program launched in dependency order, the first time it
+ * becomes ready or fails to, or exits, and launches what waited for it.
+ *
+ * @param monitor   The monitor.
+ * @param launch    The launch of the program.
+ * @param succeeded Non-zero if it became ready or exited successfully.
+ */
+void iexec_monitor_settle(iexec_monitor *monitor, const iexec_launch *launch, int succeeded) {
+  for (int i = 0; i < monitor->num_programs; i++) {
+    iexec_program *program = &monitor->programs[i];
+    if (&program->launch == launch && program->config.ordered
+        && program->state == IEXEC_PROGRAM_STARTED) {
+      program->state = succeeded ? IEXEC_PROGRAM_DONE : IEXEC_PROGRAM_FAILED;
+      iexec_monitor_schedule(monitor);
+      return;
+    }
+  }
+}
+
+/**
+ * Launches the programs that are monitored by this process, and watches
+ * them: those monitored in the background in the monitor process, or
+ * those given -n and -s in the launching process. The programs that
+ * come after others of a manifest are held until they are settled, and
+ * awaited until they are launched. With --subreaper, this process
+ * becomes a child subreaper first.
+ *
+ * @param monitor      The monitor.
+ * @param programs     The programs.
+ * @param num_programs The number of programs.
+ * @param no_daemonize Non-zero to launch the programs given -n.
+ */
+void iexec_monitor_launch(iexec_monitor *monitor, iexec_program *programs, int num_programs, int no_daemonize) {
+  monitor->programs = programs;
+  monitor->num_programs = num_programs;
+  for (int i = 0; i < num_programs && !monitor->subreaper; i++) {
+    const iexec_config *config = &programs[i].config;
+    if (config->subreaper && iexec_needs_monitor(config) && !config->no_daemonize == !no_daemonize) {
+      if (prctl(PR_SET_CHILD_SUBREAPER, 1, 0, 0, 0) < 0 || iexec_monitor_use_signalfd(monitor) < 0) {
+        error(0, errno, "unable to reap the descendants of the programs");
+        break;
+      }
+      monitor->subreaper = 1;
+    }
+  }
+  for (int i = 0; i < num_programs; i++) {
+    const iexec_config *config = &programs[i].config;
+    if (!iexec_needs_monitor(config) || !config->no_daemonize != !no_daemonize) {
+      continue;
+    }
+    if (programs[i].num_deps > 0) {
+      programs[i].state = IEXEC_PROGRAM_PENDING;
+      monitor->num_awaited++;
+      continue;
+    }
+    iexec_monitor_launch_program(monitor, &programs[i]);
+  }
+  iexec_monitor_schedule(monitor);
+}
+
+/**
+ * Forks the one process that monitors every program needing a monitor
+ * in the background (ie given -s without -n). The monitor creates its own
+ * session, launches the programs and writes their status changes. This
+ * process waits until the monitor has launched them and written their
+ * pid and status files.
+ *
+ * Returns the number of programs that failed to launch.
+ *
+ * @param programs     The programs.
+ * @param num_programs The number of programs.
+ * @param num_monitored The number of those that need the monitor.
+ */
+int iexec_fork_monitor(iexec_program *programs, int num_programs, int num_monitored) {
+  int ready_pipe[2];
+  if (pipe2(ready_pipe, O_CLOEXEC) < 0) {
+    error(0, errno, "pipe() failed");
+    return num_monitored;
+  }
+  pid_t monitor_pid = fork();
+  if (monitor_pid < 0) {
+    error(0, errno, "monitoring fork() failed");
+    return num_monitored;
+  }
+  if (monitor_pid == 0) {
+    iexec_monitor monitor;
+    int keep_open = 0;
+    close(ready_pipe[0]);
+    /** The worker of a launch server replies to its client and exits;
+        the monitor holds on to neither it nor the server. */
+    if (iexec_server_channel_fd >= 0) {
+      close(iexec_server_channel_fd);
+      close(iexec_server_client_fd);
+      iexec_server_channel_fd = -1;
+      iexec_server_client_fd = -1;
+    }
+    /** Create a new session so the monitor outlives the terminal. */
+    if (setsid() < 0) {
+      error(0, errno, "setsid() failed");
+      exit(EXIT_FAILURE);
+    }
+    iexec_monitor_init(&monitor, STDERR_FILENO);
+    iexec_monitor_launch(&monitor, programs, num_programs, 0);
+
+    /** Save standard error in case the monitor needs it later, and
+        point the monitor's own standard streams at /dev/null. */
+    for (int i = 0; i < num_programs; i++) {
+      keep_open |= programs[i].config.keep_open;
+    }
+    if (!keep_open) {
+      monitor.saved_stderr_fd = fcntl(STDERR_FILENO, F_DUPFD_CLOEXEC, 3);
+      int null_fd = open("/dev/null", O_RDWR);
+      if (null_fd >= 0) {
+        dup2(null_fd, STDIN_FILENO);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        if (null_fd > STDERR_FILENO) {
+          close(null_fd);
+        }
+      }
+    }
+    /** With --wait-ready, the launching process is told once the
+        programs are ready instead. */
+    monitor.launched_fd = ready_pipe[1];
+    iexec_monitor_tell_launched(&monitor);
+    iexec_monitor_run(&monitor);
+    exit(0);
+  }
+  close(ready_pipe[1]);
+  /** The monitor writes how many launches failed once it is done
+      launching; if it died before that, they all failed. */
+  int num_failed = num_monitored;
+  while (read(ready_pipe[0], &num_failed, sizeof(num_failed)) < 0 && errno == EINTR) {
+  }
+  close(ready_pipe[0]);
+  return num_failed;
+}
+
+/**
+ * Launches prepared programs the way a single iexec invocation launches
+ * one. Programs given -s are launched and watched by one monitor
+ * process in the background, or, with -n, by this process, which then
+ * waits for them. The others are launched directly and their pid files
+ * written.
+ *
+ * Returns the number of programs that failed to launch.
+ *
+ * @param programs     The programs.
+ * @param num_programs The number of programs.
+ * @param exit_status  Set to the exit status for iexec with -n.
+ */
+int iexec_start(iexec_program *programs, int num_programs, int *exit_status) {
+  iexec_monitor monitor;
+  int num_failed = 0, num_monitored = 0;
+
+  *exit_status = EXIT_SUCCESS;
+  for (int i = 0; i < num_programs; i++) {
+    if (iexec_needs_monitor(&programs[i].config) && !programs[i].config.no_daemonize) {
+      num_monitored++;
+    }
+  }
+  if (num_monitored > 0) {
+    num_failed += iexec_fork_monitor(programs, num_programs, num_monitored);
+  }
+
+  iexec_monitor_init(&monitor, STDERR_FILENO);
+  for (int i = 0; i < num_programs; i++) {
+    const iexec_config *config = &programs[i].config;
+    iexec_launch *launch = &programs[i].launch;
+    if (iexec_needs_monitor(config)) {
+      continue;
+    }
+    /** Launch the program, write the pid file and forget the pid. */
+    pid_t child_pid = iexec_launch_start(launch);
+    if (child_pid < 0) {
+      iexec_launch_close_logs(launch);
+      num_failed++;
+      continue;
+    }
+    launch->pid = child_pid;
+    if (config->use_pid_file != 0
+        && iexec_write_pid_file(launch, child_pid, STDERR_FILENO) < 0) {
+      num_failed++;
+    }
+  }
+  /** With -n and -s, this process watches the programs. */
+  iexec_monitor_launch(&monitor, programs, num_programs, 1);
+  if (monitor.num_children > 0) {
+    *exit_status = iexec_monitor_run(&monitor);
+  }
+  close(monitor.epoll_fd);
+  return num_failed + monitor.num_unlaunched;
+}
+
+/**
+ * Copies a configuration, giving the copy its own lists of file
+ * descriptors to close and keep, of sockets to listen on and of
+ * pressure triggers, so that
+ * options applied to it do not change the original.
+ */
+void iexec_config_copy(iexec_config *dst, const iexec_config *src) {
+  *dst = *src;
+  if (src->num_fds_to_close > 0) {
+    dst->fds_to_close = malloc(sizeof(int) * src->num_fds_to_close);
+    if (dst->fds_to_close == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(dst->fds_to_close, src->fds_to_close, sizeof(int) * src->num_fds_to_close);
+  }
+  if (src->num_fds_to_keep > 0) {
+    dst->fds_to_keep = malloc(sizeof(int) * src->num_fds_to_keep);
+    if (dst->fds_to_keep == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(dst->fds_to_keep, src->fds_to_keep, sizeof(int) * src->num_fds_to_keep);
+  }
+  if (src->num_listen > 0) {
+    dst->listen = malloc(sizeof(char *) * src->num_listen);
+    if (dst->listen == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(dst->listen, src->listen, sizeof(char *) * src->num_listen);
+  }
+  if (src->num_psi_triggers > 0) {
+    dst->psi_triggers = malloc(sizeof(iexec_psi_trigger) * src->num_psi_triggers);
+    if (dst->psi_triggers == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    memcpy(dst->psi_triggers, src->psi_triggers, sizeof(iexec_psi_trigger) * src->num_psi_triggers);
+  }
+}
+
+/**
+ * Expands a path template for an instance of --instances: %i becomes the
+ * number of the instance (from 0) and %% a single %.
+ *
+ * Returns the expanded path, or the template itself if it has no %.
+ */
+char *iexec_expand_instance(char *template, int instance) {
+  if (template == 0 || strchr(template, '%') == 0) {
+    return template;
+  }
+  char *path = malloc(strlen(template) * 11 + 1);
+  if (path == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  char *out = path;
+  for (const char *in = template; *in != 0; in++) {
+    if (in[0] == '%' && in[1] == 'i') {
+      out += sprintf(out, "%d", instance);
+      in++;
+    } else if (in[0] == '%' && in[1] == '%') {
+      *out++ = '%';
+      in++;
+    } else {
+      *out++ = *in;
+    }
+  }
+  *out = 0;
+  return path;
+}
+
+/**
+ * Appends the programs of a configuration to a list of programs: the
+ * program itself, or with --instances its copies, each with the paths of
+ * its files, working directory, cgroup and sockets expanded (see
+ * iexec_expand_instance()). Exits if the copies would share a pid or
+ * status file.
+ *
+ * @param programs     The list of programs, grown with realloc().
+ * @param num_programs The number of programs in the list.
+ * @param config       The configuration.
+ */
+void iexec_add_programs(iexec_program **programs, int *num_programs, const iexec_config *config) {
+  iexec_program *temp_programs = realloc(*programs, sizeof(iexec_program) * (*num_programs + config->instances));
+  if (temp_programs == 0) {
+    error(0, errno, "realloc failed");
+    exit(EXIT_FAILURE);
+  }
+  *programs = temp_programs;
+  for (int i = *num_programs; i < *num_programs + config->instances; i++) {
+    (*programs)[i].deps = 0;
+    (*programs)[i].num_deps = 0;
+    (*programs)[i].state = IEXEC_PROGRAM_NEW;
+  }
+  if (config->instances == 1) {
+    (*programs)[(*num_programs)++].config = *config;
+    return;
+  }
+  const char *shared = config->use_pid_file != 0 && strstr(config->use_pid_file, "%i") == 0 ? config->use_pid_file
+    : config->use_status_file != 0 && strstr(config->use_status_file, "%i") == 0 ? config->use_status_file : 0;
+  if (shared != 0) {
+    error(0, 0, "the instances would share `%s' (use %%i in its name)", shared);
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < config->instances; i++) {
+    iexec_config *copy = &(*programs)[(*num_programs)++].config;
+    iexec_config_copy(copy, config);
+    copy->instance = i;
+    copy->use_stdin_file = iexec_expand_instance(config->use_stdin_file, i);
+    copy->use_stdout_file = iexec_expand_instance(config->use_stdout_file, i);
+    copy->use_stderr_file = iexec_expand_instance(config->use_stderr_file, i);
+    copy->use_pid_file = iexec_expand_instance(config->use_pid_file, i);
+    copy->use_status_file = iexec_expand_instance(config->use_status_file, i);
+    copy->use_working_dir = iexec_expand_instance(config->use_working_dir, i);
+    copy->cgroup_path = iexec_expand_instance(config->cgroup_path, i);
+    copy->stdout_tee = iexec_expand_instance(config->stdout_tee, i);
+    copy->stderr_tee = iexec_expand_instance(config->stderr_tee, i);
+    for (int j = 0; j < config->num_listen; j++) {
+      copy->listen[j] = iexec_expand_instance(config->listen[j], i);
+    }
+  }
+}
+
+/**
+ * Splits a manifest line into words in place. Words are separated by
+ * white space; single and double quotes group characters into a word,
+ * a backslash escapes the next character and an unquoted # starts a
+ * comment.
+ *
+ * Returns the number of words, or -1 if a quote is not closed. The word
+ * array is terminated by a null pointer and must have room for
+ * strlen(line) / 2 + 2 entries.
+ */
+int iexec_split_words(char *line, char **words) {
+  int num_words = 0;
+  char *in = line, *out = line;
+  while (1) {
+    /** Skip the white space between words. */
+    while (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r') {
+      in++;
+    }
+    if (*in == 0 || *in == '#') {
+      break;
+    }
+    words[num_words++] = out;
+    char quote = 0;
+    while (*in != 0) {
+      if (quote == 0 && (*in == ' ' || *in == '\t' || *in == '\n' || *in == '\r')) {
+        break;
+      }
+      if (quote == 0 && (*in == '\'' || *in == '"')) {
+        quote = *in++;
+      } else if (quote != 0 && *in == quote) {
+        quote = 0;
+        in++;
+      } else if (*in == '\\' && quote != '\'' && in[1] != 0) {
+        in++;
+        *out++ = *in++;
+      } else {
+        *out++ = *in++;
+      }
+    }
+    if (quote != 0) {
+      return -1;
+    }
+    if (*in != 0) {
+      in++;
+    }
+    *out++ = 0;
+  }
+  words[num_words] = 0;
+  return num_words;
+}
+
+/**
+ * Looks up a long option by name.
+ *
+ * Returns the option or 0 if there is no such option.
+ */
+const struct option *iexec_find_long_option(const char *name) {
+  for (const struct option *option = iexec_long_options; option->name != 0; option++) {
+    if (strcmp(option->name, name) == 0) {
+      return option;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Returns non-zero if a long option may be a setting of a manifest line
+ * or of a profile.
+ */
+int iexec_is_setting(const struct option *option) {
+  return option->val != 'h' && option->val != IEXEC_OPTION_VERSION
+    && option->val != IEXEC_OPTION_BATCH && option->val != IEXEC_OPTION_COMPILE_PROFILES;
+}
+
+/**
+ * Returns a hash of the long options (FNV-1a of their names, whether
+ * they take a value and what getopt_long() returns for them), which
+ * tells compiled profiles from an iexec with other options apart.
+ */
+uint32_t iexec_long_options_hash(void) {
+  uint32_t hash = 2166136261u;
+  for (const struct option *option = iexec_long_options; option->name != 0; option++) {
+    int32_t words[2] = {option->has_arg, option->val};
+    for (const char *c = option->name; *c != 0; c++) {
+      hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    for (size_t i = 0; i < sizeof(words); i++) {
+      hash = (hash ^ ((unsigned char *)words)[i]) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+/**
+ * Parses a setting of a manifest line or of a profile: a long option
+ * name, followed by =value if the option takes one. Exits if the
+ * setting names an option that is not allowed there, or lacks a value
+ * or has one the option does not take.
+ *
+ * Returns the option, or 0 if the word names no option and has no =
+ * (ie it is the program).
+ *
+ * @param word  The setting, split at = in place.
+ * @param value Set to the value, or 0 if there is none.
+ * @param file  The name of the manifest or profiles, for error messages.
+ * @param line  The line number, for error messages.
+ */
+const struct option *iexec_parse_setting(char *word, char **value, const char *file, int line) {
+  *value = strchr(word, '=');
+  if (*value != 0) {
+    *(*value)++ = 0;
+  }
+  const struct option *option = iexec_find_long_option(word);
+  if (option == 0) {
+    if (*value == 0) {
+      return 0;
+    }
+    error_at_line(0, 0, file, line, "unknown option `%s'", word);
+    exit(EXIT_FAILURE);
+  }
+  if (!iexec_is_setting(option)) {
+    error_at_line(0, 0, file, line, "option `%s' cannot be used in a manifest", word);
+    exit(EXIT_FAILURE);
+  }
+  if (option->has_arg == required_argument && *value == 0) {
+    error_at_line(0, 0, file, line, "option `%s' requires a value", word);
+    exit(EXIT_FAILURE);
+  }
+  if (option->has_arg == no_argument && *value != 0) {
+    error_at_line(0, 0, file, line, "option `%s' does not take a value", word);
+    exit(EXIT_FAILURE);
+  }
+  return option;
+}
+
+/**
+ * Applies the words of a manifest line to a configuration. Each setting
+ * is a long option name, followed by =value if the option takes one
+ * (eg stdout=/var/log/app.log or keep-open). The settings end at -- or
+ * at the first word that does not name an option; the remaining words
+ * are the program and its arguments. Profiles given with profile= are
+ * applied first, so that the other settings override them. Exits on
+ * error.
+ *
+ * @param config   The configuration, holding the command line defaults.
+ * @param words    The words of the line.
+ * @param manifest The name of the manifest, for error messages.
+ * @param line     The line number, for error messages.
+ */
+void iexec_batch_parse_line(iexec_config *config, char **words,
+                            const char *manifest, int line) {
+  int i = 0, num_settings = 0;
+  while (words[num_settings] != 0) {
+    num_settings++;
+  }
+  const struct option *options[num_settings + 1];
+  char *values[num_settings + 1];
+  num_settings = 0;
+  for (; words[i] != 0; i++) {
+    if (strcmp(words[i], "--") == 0) {
+      i++;
+      break;
+    }
+    options[num_settings] = iexec_parse_setting(words[i], &values[num_settings], manifest, line);
+    if (options[num_settings] == 0) {
+      break;
+    }
+    num_settings++;
+  }
+  for (int j = 0; j < num_settings; j++) {
+    if (options[j]->val == IEXEC_OPTION_PROFILE) {
+      iexec_apply_profile(config, values[j]);
+    }
+  }
+  for (int j = 0; j < num_settings; j++) {
+    if (options[j]->val != IEXEC_OPTION_PROFILE) {
+      iexec_config_apply_option(config, options[j]->val, values[j]);
+    }
+  }
+  config->remaining_argv = words + i;
+  for (config->remaining_argc = 0; words[i] != 0; i++) {
+    config->remaining_argc++;
+  }
+  if (config->remaining_argc == 0) {
+    error_at_line(0, 0, manifest, line, "a program and its arguments are required!");
+    exit(EXIT_FAILURE);
+  }
+}
+
+/**
+ * A profile read from the text profiles: a name and settings, applied
+ * like those of a manifest line.
+ */
+typedef struct iexec_profile {
+  char *name;           /** The name of the profile. */
+  int *options;         /** The options of the settings. */
+  char **values;        /** Their values (0 = none). */
+  int num_settings;     /** The number of settings. */
+  int line;             /** The line of the profile, for error messages. */
+} iexec_profile;
+
+/**
+ * Returns the text profiles: those named by IEXEC_PROFILES, or
+ * IEXEC_PROFILES_PATH.
+ */
+char *iexec_profiles_path(void) {
+  char *path = getenv("IEXEC_PROFILES");
+  return path != 0 && path[0] != 0 ? path : IEXEC_PROFILES_PATH;
+}
+
+/**
+ * Returns the name of the compiled profiles of text profiles: the name
+ * with .conf replaced by, or else followed by, .bin.
+ */
+char *iexec_compiled_profiles_path(const char *path) {
+  size_t len = strlen(path);
+  char *compiled = malloc(len + 5);
+  if (compiled == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  if (len > 5 && strcmp(path + len - 5, ".conf") == 0) {
+    len -= 5;
+  }
+  memcpy(compiled, path, len);
+  strcpy(compiled + len, ".bin");
+  return compiled;
+}
+
+/**
+ * Reads text profiles. Each non-empty line holds one profile: its name
+ * followed by settings, as on a manifest line (see
+ * iexec_batch_parse_line()) but without a program, eg
+ *
+ *   web user=www umask=027 rlimit-nofile-soft=65536 cpus=2-3
+ *
+ * Exits if a line is not such a profile.
+ *
+ * Returns the number of profiles read, or -1 if the file could not be
+ * read (and the error was printed).
+ *
+ * @param path     The text profiles.
+ * @param only     The one profile to keep (0 = all).
+ * @param profiles Set to the profiles.
+ */
+int iexec_read_profiles(const char *path, const char *only, iexec_profile **profiles) {
+  FILE *file = fopen(path, "re");
+  if (file == 0) {
+    error(0, errno, "unable to open profiles `%s'", path);
+    return -1;
+  }
+  int num_profiles = 0;
+  char *buffer = 0;
+  size_t buffer_size = 0;
+  ssize_t len;
+  int line = 0;
+  *profiles = 0;
+  while ((len = getline(&buffer, &buffer_size, file)) >= 0) {
+    line++;
+    /** The values point into the line, so each profile keeps its line. */
+    char *text = strdup(buffer);
+    char **words = malloc(sizeof(char *) * (len / 2 + 2));
+    if (text == 0 || words == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    int num_words = iexec_split_words(text, words);
+    if (num_words < 0) {
+      error_at_line(0, 0, path, line, "unterminated quote");
+      exit(EXIT_FAILURE);
+    }
+    if (num_words == 0 || (only != 0 && strcmp(words[0], only) != 0)) {
+      free(words);
+      free(text);
+      continue;
+    }
+    iexec_profile *temp_profiles = realloc(*profiles, sizeof(iexec_profile) * (num_profiles + 1));
+    if (temp_profiles == 0) {
+      error(0, errno, "realloc failed");
+      exit(EXIT_FAILURE);
+    }
+    *profiles = temp_profiles;
+    iexec_profile *profile = &(*profiles)[num_profiles++];
+    profile->name = words[0];
+    profile->options = malloc(sizeof(int) * num_words);
+    profile->values = malloc(sizeof(char *) * num_words);
+    profile->num_settings = 0;
+    profile->line = line;
+    if (profile->options == 0 || profile->values == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < num_words; i++) {
+      char *value;
+      const struct option *option = iexec_parse_setting(words[i], &value, path, line);
+      if (option == 0) {
+        error_at_line(0, 0, path, line, "`%s' is not a setting (profiles hold no program)", words[i]);
+        exit(EXIT_FAILURE);
+      }
+      if (option->val == IEXEC_OPTION_PROFILE) {
+        error_at_line(0, 0, path, line, "a profile cannot include another profile");
+        exit(EXIT_FAILURE);
+      }
+      profile->options[profile->num_settings] = option->val;
+      profile->values[profile->num_settings++] = value;
+    }
+    free(words);
+  }
+  free(buffer);
+  fclose(file);
+  return num_profiles;
+}
+
+/**
+ * Applies a profile from compiled profiles (see iexec-profile.h). The
+ * file stays mapped, as the configuration points at the values in it.
+ *
+ * Returns 1 if the profile was applied, 0 if there is no such profile,
+ * or -1 if the compiled profiles cannot be used: they are damaged, or
+ * were compiled by an iexec with other options.
+ *
+ * @param config The configuration.
+ * @param path   The compiled profiles.
+ * @param name   The name of the profile.
+ */
+int iexec_apply_compiled_profile(iexec_config *config, const char *path, const char *name) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(iexec_profile_header)
+      || st.st_size > UINT32_MAX) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  /** A private writable mapping, as options such as --close split
+      their values in place. */
+  char *blob = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (blob == MAP_FAILED) {
+    return -1;
+  }
+  uint64_t size = st.st_size;
+  const iexec_profile_header *header = (const iexec_profile_header *)blob;
+  if (header->magic != IEXEC_PROFILE_MAGIC || header->version != IEXEC_PROFILE_VERSION
+      || header->options_hash != iexec_long_options_hash() || header->size != size || header->entries % 4 != 0 || header->settings % 4 != 0
+      || header->entries + (uint64_t)header->num_profiles * sizeof(iexec_profile_entry) > size
+      || header->settings + (uint64_t)header->num_settings * sizeof(iexec_profile_setting) > size) {
+    munmap(blob, st.st_size);
+    return -1;
+  }
+  const iexec_profile_entry *entries = (const iexec_profile_entry *)(blob + header->entries);
+  const iexec_profile_setting *settings = (const iexec_profile_setting *)(blob + header->settings);
+  int low = 0, high = (int)header->num_profiles - 1;
+  while (low <= high) {
+    int middle = low + (high - low) / 2;
+    const iexec_profile_entry *entry = &entries[middle];
+    if (entry->name == 0 || entry->name >= size || memchr(blob + entry->name, 0, size - entry->name) == 0
+        || (uint64_t)entry->first_setting + entry->num_settings > header->num_settings) {
+      munmap(blob, st.st_size);
+      return -1;
+    }
+    int order = strcmp(name, blob + entry->name);
+    if (order < 0) {
+      high = middle - 1;
+    } else if (order > 0) {
+      low = middle + 1;
+    } else {
+      for (uint32_t i = entry->first_setting; i < entry->first_setting + entry->num_settings; i++) {
+        const struct option *option = iexec_long_options;
+        while (option->name != 0 && option->val != settings[i].option) {
+          option++;
+        }
+        if ((settings[i].value != 0 && (settings[i].value >= size
+                                        || memchr(blob + settings[i].value, 0, size - settings[i].value) == 0))
+            || option->name == 0 || !iexec_is_setting(option)
+            || (option->has_arg == required_argument && settings[i].value == 0)
+            || (option->has_arg == no_argument && settings[i].value != 0)) {
+          munmap(blob, st.st_size);
+          return -1;
+        }
+      }
+      for (uint32_t i = entry->first_setting; i < entry->first_setting + entry->num_settings; i++) {
+        iexec_config_apply_option(config, settings[i].option,
+                                  settings[i].value != 0 ? blob + settings[i].value : 0);
+      }
+      return 1;
+    }
+  }
+  munmap(blob, st.st_size);
+  return 0;
+}
+
+/**
+ * Applies a profile given with --profile or profile=: from the compiled
+ * profiles if they are at least as recent as the text profiles, from
+ * the text profiles otherwise. Exits if there is no such profile.
+ *
+ * @param config The configuration.
+ * @param name   The name of the profile.
+ */
+void iexec_apply_profile(iexec_config *config, const char *name) {
+  char *path = iexec_profiles_path();
+  char *compiled = iexec_compiled_profiles_path(path);
+  struct stat text_st, compiled_st;
+  int text_exists = stat(path, &text_st) == 0;
+  if (stat(compiled, &compiled_st) == 0
+      && (!text_exists || compiled_st.st_mtim.tv_sec > text_st.st_mtim.tv_sec
+          || (compiled_st.st_mtim.tv_sec == text_st.st_mtim.tv_sec
+              && compiled_st.st_mtim.tv_nsec >= text_st.st_mtim.tv_nsec))) {
+    int applied = iexec_apply_compiled_profile(config, compiled, name);
+    if (applied > 0) {
+      free(compiled);
+      return;
+    }
+    if (applied == 0) {
+      error(0, 0, "no profile `%s' in `%s'", name, compiled);
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(compiled);
+  iexec_profile *profiles;
+  int num_profiles = iexec_read_profiles(path, name, &profiles);
+  if (num_profiles < 0) {
+    exit(EXIT_FAILURE);
+  }
+  if (num_profiles == 0) {
+    error(0, 0, "no profile `%s' in `%s'", name, path);
+    exit(EXIT_FAILURE);
+  }
+  iexec_profile *profile = &profiles[num_profiles - 1];
+  for (int i = 0; i < profile->num_settings; i++) {
+    iexec_config_apply_option(config, profile->options[i], profile->values[i]);
+  }
+}
+
+/**
+ * Compares two profiles by name, for qsort().
+ */
+int iexec_compare_profiles(const void *a, const void *b) {
+  return strcmp(((const iexec_profile *)a)->name, ((const iexec_profile *)b)->name);
+}
+
+/**
+ * Compiles text profiles into the compact file --profile maps (see
+ * iexec-profile.h), next to them. Every profile is checked by applying
+ * it, and the compiled profiles are replaced atomically, so launches
+ * never see a partial file. Exits if a profile is invalid.
+ *
+ * Returns EXIT_SUCCESS, or EXIT_FAILURE if the profiles could not be
+ * read or written.
+ *
+ * @param path The text profiles.
+ */
+int iexec_compile_profiles(const char *path) {
+  iexec_profile *profiles;
+  int num_profiles = iexec_read_profiles(path, 0, &profiles);
+  if (num_profiles < 0) {
+    return EXIT_FAILURE;
+  }
+  qsort(profiles, num_profiles, sizeof(iexec_profile), iexec_compare_profiles);
+
+  /** Check the profiles, on copies as options may split their values. */
+  size_t num_settings = 0, strings_size = 0;
+  for (int i = 0; i < num_profiles; i++) {
+    if (i > 0 && strcmp(profiles[i].name, profiles[i - 1].name) == 0) {
+      error_at_line(0, 0, path, profiles[i].line, "profile `%s' is defined twice", profiles[i].name);
+      exit(EXIT_FAILURE);
+    }
+    iexec_config scratch;
+    iexec_config_set_default_values(&scratch);
+    for (int j = 0; j < profiles[i].num_settings; j++) {
+      char *value = profiles[i].values[j] != 0 ? strdup(profiles[i].values[j]) : 0;
+      iexec_config_apply_option(&scratch, profiles[i].options[j], value);
+      if (profiles[i].values[j] != 0) {
+        strings_size += strlen(profiles[i].values[j]) + 1;
+      }
+    }
+    strings_size += strlen(profiles[i].name) + 1;
+    num_settings += profiles[i].num_settings;
+  }
+
+  /** Lay out the header, the entries, the settings and the strings. */
+  size_t entries_offset = sizeof(iexec_profile_header);
+  size_t settings_offset = entries_offset + sizeof(iexec_profile_entry) * num_profiles;
+  size_t strings_offset = settings_offset + sizeof(iexec_profile_setting) * num_settings;
+  size_t size = strings_offset + strings_size;
+  if (size > UINT32_MAX) {
+    error(0, 0, "the profiles in `%s' are too large", path);
+    return EXIT_FAILURE;
+  }
+  char *blob = calloc(1, size);
+  if (blob == 0) {
+    error(0, errno, "calloc failed");
+    exit(EXIT_FAILURE);
+  }
+  iexec_profile_header *header = (iexec_profile_header *)blob;
+  iexec_profile_entry *entries = (iexec_profile_entry *)(blob + entries_offset);
+  iexec_profile_setting *settings = (iexec_profile_setting *)(blob + settings_offset);
+  header->magic = IEXEC_PROFILE_MAGIC;
+  header->version = IEXEC_PROFILE_VERSION;
+  header->options_hash = iexec_long_options_hash();
+  header->size = size;
+  header->num_profiles = num_profiles;
+  header->entries = entries_offset;
+  header->num_settings = num_settings;
+  header->settings = settings_offset;
+  size_t next_string = strings_offset, next_setting = 0;
+  for (int i = 0; i < num_profiles; i++) {
+    entries[i].name = next_string;
+    next_string = stpcpy(blob + next_string, profiles[i].name) - blob + 1;
+    entries[i].first_setting = next_setting;
+    entries[i].num_settings = profiles[i].num_settings;
+    for (int j = 0; j < profiles[i].num_settings; j++, next_setting++) {
+      settings[next_setting].option = profiles[i].options[j];
+      if (profiles[i].values[j] != 0) {
+        settings[next_setting].value = next_string;
+        next_string = stpcpy(blob + next_string, profiles[i].values[j]) - blob + 1;
+      }
+    }
+  }
+
+  /** Write a temporary file and rename it over the compiled profiles. */
+  char *compiled = iexec_compiled_profiles_path(path);
+  char *temp_path = malloc(strlen(compiled) + 8);
+  if (temp_path == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  sprintf(temp_path, "%s.XXXXXX", compiled);
+  int fd = mkostemp(temp_path, O_CLOEXEC);
+  if (fd < 0) {
+    error(0, errno, "unable to create `%s'", temp_path);
+    return EXIT_FAILURE;
+  }
+  size_t written = 0;
+  while (written < size) {
+    ssize_t len = write(fd, blob + written, size - written);
+    if (len < 0 && errno == EINTR) {
+      continue;
+    }
+    if (len < 0) {
+      error(0, errno, "unable to write `%s'", temp_path);
+      close(fd);
+      unlink(temp_path);
+      return EXIT_FAILURE;
+    }
+    written += len;
+  }
+  if (fchmod(fd, 0644) < 0 || fsync(fd) < 0 || close(fd) < 0 || rename(temp_path, compiled) < 0) {
+    error(0, errno, "unable to write `%s'", compiled);
+    unlink(temp_path);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Looks for a cycle among the dependencies of the entries of a manifest,
+ * depth first from one entry.
+ *
+ * Returns the index of an entry in a cycle, or -1 if there is none.
+ *
+ * @param entries The entries.
+ * @param colors  For each entry, 0 if not visited yet, 1 while its
+ *                dependencies are visited, 2 once they were.
+ * @param entry   The entry to start from.
+ */
+int iexec_batch_find_cycle(const iexec_program *entries, char *colors, int entry) {
+  if (colors[entry] != 0) {
+    return colors[entry] == 1 ? entry : -1;
+  }
+  colors[entry] = 1;
+  for (int i = 0; i < entries[entry].num_deps; i++) {
+    int cycle = iexec_batch_find_cycle(entries, colors, entries[entry].deps[i].program);
+    if (cycle >= 0) {
+      return cycle;
+    }
+  }
+  colors[entry] = 2;
+  return -1;
+}
+
+/**
+ * Resolves the names given to after= and requires= in a manifest to the
+ * entries they name (every instance of an entry with --instances), and
+ * marks the entries on either side so the monitor launches them in
+ * order. Exits if a name names no other entry, if an entry and one it
+ * comes after would be monitored by different processes, or if entries
+ * come after each other in a cycle.
+ *
+ * @param entries     The entries.
+ * @param num_entries The number of entries.
+ * @param manifest    The name of the manifest, for error messages.
+ */
+void iexec_batch_order(iexec_program *entries, int num_entries, const char *manifest) {
+  for (int i = 0; i < num_entries; i++) {
+    iexec_config *config = &entries[i].config;
+    for (int required = 0; required < 2; required++) {
+      const char *names = required ? config->requires : config->after;
+      if (names == 0) {
+        continue;
+      }
+      char *copy = strdup(names), *saveptr = 0;
+      if (copy == 0) {
+        error(0, errno, "strdup failed");
+        exit(EXIT_FAILURE);
+      }
+      for (char *name = strtok_r(copy, ",", &saveptr); name != 0; name = strtok_r(0, ",", &saveptr)) {
+        int found = 0;
+        for (int j = 0; j < num_entries; j++) {
+          if (j == i || strcmp(iexec_program_name(&entries[j].config), name) != 0) {
+            continue;
+          }
+          if (!entries[j].config.no_daemonize != !config->no_daemonize) {
+            error(0, 0, "`%s' and `%s' it comes after in `%s' must both be given -n, or neither",
+                  iexec_program_name(config), name, manifest);
+            exit(EXIT_FAILURE);
+          }
+          iexec_program_dep *temp_deps = realloc(entries[i].deps, sizeof(iexec_program_dep) * (entries[i].num_deps + 1));
+          if (temp_deps == 0) {
+            error(0, errno, "realloc failed");
+            exit(EXIT_FAILURE);
+          }
+          entries[i].deps = temp_deps;
+          entries[i].deps[entries[i].num_deps].program = j;
+          entries[i].deps[entries[i].num_deps++].required = required;
+          entries[j].config.ordered = 1;
+          config->ordered = 1;
+          found = 1;
+        }
+        if (!found) {
+          error(0, 0, "`%s' given to %s= of `%s' names no other program in `%s'",
+                name, required ? "requires" : "after", iexec_program_name(config), manifest);
+          exit(EXIT_FAILURE);
+        }
+      }
+      free(copy);
+    }
+  }
+  char *colors = calloc(num_entries > 0 ? num_entries : 1, 1);
+  if (colors == 0) {
+    error(0, errno, "calloc failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < num_entries; i++) {
+    int cycle = iexec_batch_find_cycle(entries, colors, i);
+    if (cycle >= 0) {
+      error(0, 0, "the programs in `%s' come after each other in a cycle through `%s'",
+            manifest, iexec_program_name(&entries[cycle].config));
+      exit(EXIT_FAILURE);
+    }
+  }
+  free(colors);
+}
+
+/**
+ * Launches every program listed in the manifest given with --batch from
+ * this one process. Each non-empty line of the manifest describes one
+ * program (see iexec_batch_parse_line()), starting from the options given
+ * on the command line. The whole manifest is read and every entry is
+ * prepared before the first program is launched, so a bad line launches
+ * nothing.
+ *
+ * Returns EXIT_FAILURE if a program failed to launch, otherwise the exit
+ * status for iexec (see iexec_start()).
+ *
+ * @param defaults The configuration parsed from the command line.
+ */
+int iexec_run_batch(const iexec_config *defaults) {
+  const char *manifest = defaults->batch_file;
+  FILE *manifest_file = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+  if (manifest_file == 0) {
+    error(0, errno, "unable to open batch manifest `%s'", manifest);
+    return EXIT_FAILURE;
+  }
+
+  iexec_program *entries = 0;
+  int num_entries = 0;
+  char *buffer = 0;
+  size_t buffer_size = 0;
+  ssize_t len;
+  int line = 0;
+  while ((len = getline(&buffer, &buffer_size, manifest_file)) >= 0) {
+    line++;
+    /** The words point into the line, so each line is kept. */
+    char *text = strdup(buffer);
+    char **words = malloc(sizeof(char *) * (len / 2 + 2));
+    if (text == 0 || words == 0) {
+      error(0, errno, "malloc failed");
+      exit(EXIT_FAILURE);
+    }
+    int num_words = iexec_split_words(text, words);
+    if (num_words < 0) {
+      error_at_line(0, 0, manifest, line, "unterminated quote");
+      exit(EXIT_FAILURE);
+    }
+    if (num_words == 0) {
+      free(words);
+      free(text);
+      continue;
+    }
+    iexec_config entry;
+    iexec_config_copy(&entry, defaults);
+    iexec_batch_parse_line(&entry, words, manifest, line);
+    iexec_add_programs(&entries, &num_entries, &entry);
+  }
+  free(buffer);
+  if (manifest_file != stdin) {
+    fclose(manifest_file);
+  }
+
+  /** Resolve the order, validate the limits, look up the users and the
+      working directories of all entries before launching any of them. */
+  iexec_batch_order(entries, num_entries, manifest);
+  for (int i = 0; i < num_entries; i++) {
+    iexec_launch_prepare(&entries[i].config, &entries[i].launch);
+  }
+
+  int exit_status;
+  int num_failed = iexec_start(entries, num_entries, &exit_status);
+  if (num_failed > 0) {
+    error(0, 0, "%d of %d programs in `%s' failed", num_failed, num_entries, manifest);
+    return EXIT_FAILURE;
+  }
+  return exit_status;
+}
+
+/**
+ * Reads the pid in a pid file, such as one written with -p.
+ *
+ * Returns the pid, or 0 if an error occurred (and was printed).
+ */
+pid_t iexec_read_pid_file(const char *filename) {
+  FILE *pid_file = fopen(filename, "re");
+  long value = 0;
+  if (pid_file == 0) {
+    error(0, errno, "unable to open pid file `%s'", filename);
+    return 0;
+  }
+  if (fscanf(pid_file, "%ld", &value) != 1 || value <= 0 || value > INT_MAX) {
+    error(0, 0, "pid file `%s' does not hold a pid", filename);
+    value = 0;
+  }
+  fclose(pid_file);
+  return value;
+}
+
+/**
+ * Stops a running program: sends it --stop-signal, to its whole process
+ * group if it leads one, waits up to --stop-grace for it to exit, then
+ * kills it and what is left of its group, and of a cgroup if given. The
+ * program is watched through a pidfd, so a pid reused in the meantime is
+ * not mistaken for it.
+ *
+ * Returns the exit status for iexec: EXIT_SUCCESS once it is gone.
+ *
+ * @param config    The configuration with the signal and the grace.
+ * @param pid       The program.
+ * @param pidfd     A pidfd of the program, closed.
+ * @param cgroup_fd The cgroup to kill too (-1 = none).
+ */
+int iexec_stop_program(const iexec_config *config, pid_t pid, int pidfd, int cgroup_fd) {
+  int group = getpgid(pid) == pid;
+  if (iexec_signal_program(pid, group, config->stop_signal) < 0) {
+    error(0, errno, "unable to send signal %d to process %d", config->stop_signal, pid);
+    close(pidfd);
+    return EXIT_FAILURE;
+  }
+  struct pollfd exited = {pidfd, POLLIN, 0};
+  long long deadline = iexec_now_ms() + config->stop_grace;
+  int ready;
+  while ((ready = poll(&exited, 1, deadline > iexec_now_ms() ? deadline - iexec_now_ms() : 0)) < 0
+         && errno == EINTR) {
+  }
+  if (ready == 0 && config->verbose) {
+    fprintf(stderr, "%s: process %d did not stop within %lldms, killing it\n",
+            program_invocation_name, pid, config->stop_grace);
+  }
+  iexec_kill_program(cgroup_fd, pid, group, ready > 0);
+  while (ready == 0 && poll(&exited, 1, -1) < 0 && errno == EINTR) {
+  }
+  if (config->verbose) {
+    fprintf(stderr, "%s: process %d stopped\n", program_invocation_name, pid);
+  }
+  close(pidfd);
+  return EXIT_SUCCESS;
+}
+
+/**
+ * Opens a pidfd of the program whose pid is in a pid file.
+ *
+ * Returns the pidfd, -1 if an error occurred (and was printed), or -2 if
+ * the program is not running.
+ *
+ * @param filename The pid file.
+ * @param pid      Where to store the pid.
+ */
+int iexec_open_pid_file(const char *filename, pid_t *pid) {
+  *pid = iexec_read_pid_file(filename);
+  if (*pid == 0) {
+    return -1;
+  }
+  int pidfd = pidfd_open(*pid, 0);
+  if (pidfd < 0) {
+    if (errno != ESRCH) {
+      error(0, errno, "unable to watch process %d", *pid);
+      return -1;
+    }
+    return -2;
+  }
+  return pidfd;
+}
+
+/**
+ * Stops the program whose pid is in the pid file of --stop, and what is
+ * left of the cgroup of --cgroup-path if given.
+ *
+ * Returns the exit status for iexec: EXIT_SUCCESS once it is gone, or
+ * if it was not running.
+ */
+int iexec_stop(const iexec_config *config) {
+  pid_t pid;
+  int pidfd = iexec_open_pid_file(config->stop_pid_file, &pid);
+  if (pidfd == -1) {
+    return EXIT_FAILURE;
+  }
+  if (pidfd == -2) {
+    if (config->verbose) {
+      fprintf(stderr, "%s: process %d is not running\n", program_invocation_name, pid);
+    }
+    return EXIT_SUCCESS;
+  }
+  int cgroup_fd = config->cgroup_path != 0 ? iexec_cgroup_open(config->cgroup_path) : -1;
+  return iexec_stop_program(config, pid, pidfd, cgroup_fd);
+}
+
+/**
+ * Takes over the sockets of the program in the pid file of --upgrade:
+ * those it was passed as in socket activation, found in the
+ * C<LISTEN_FDS> of its environment, are copied with pidfd_getfd(2) to
+ * be passed to the new program in their place, instead of binding
+ * --listen. Copying them needs the permission to ptrace the program.
+ *
+ * Returns a pidfd of the program, or -1 if an error occurred (and was
+ * printed).
+ *
+ * @param config The configuration of the new program, given the sockets.
+ * @param pid    Where to store the pid of the program.
+ */
+int iexec_upgrade_take_sockets(iexec_config *config, pid_t *pid) {
+  int pidfd = iexec_open_pid_file(config->upgrade_pid_file, pid);
+  if (pidfd == -2) {
+    error(0, 0, "process %d of `%s' is not running, there is nothing to upgrade", *pid, config->upgrade_pid_file);
+  }
+  if (pidfd < 0) {
+    return -1;
+  }
+
+  /** The environment it was started with, as NUL-terminated strings. */
+  char path[32], environ_buffer[65536];
+  snprintf(path, sizeof(path), "/proc/%d/environ", (int)*pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  ssize_t length = fd < 0 ? -1 : read(fd, environ_buffer, sizeof(environ_buffer) - 1);
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (length < 0) {
+    error(0, errno, "unable to read the environment of process %d", *pid);
+    close(pidfd);
+    return -1;
+  }
+  environ_buffer[length] = 0;
+  long num_fds = 0, listen_pid = 0;
+  for (char *variable = environ_buffer; variable < environ_buffer + length; variable += strlen(variable) + 1) {
+    if (strncmp(variable, "LISTEN_FDS=", 11) == 0) {
+      num_fds = strtol(variable + 11, 0, 10);
+    } else if (strncmp(variable, "LISTEN_PID=", 11) == 0) {
+      listen_pid = strtol(variable + 11, 0, 10);
+    }
+  }
+  if (listen_pid != *pid || num_fds <= 0 || num_fds > 1024) {
+    num_fds = 0;
+  }
+  if (config->num_listen > 0 && num_fds != config->num_listen) {
+    error(0, 0, "process %d was passed %ld sockets, not the %d of --listen", *pid, num_fds, config->num_listen);
+    close(pidfd);
+    return -1;
+  }
+  if (num_fds == 0) {
+    return pidfd;
+  }
+
+  config->upgrade_fds = malloc(sizeof(int) * num_fds);
+  if (config->upgrade_fds == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  for (int i = 0; i < num_fds; i++) {
+    int listening = 0;
+    socklen_t size = sizeof(listening);
+    config->upgrade_fds[i] = pidfd_getfd(pidfd, IEXEC_LISTEN_FDS_START + i, 0);
+    if (config->upgrade_fds[i] < 0) {
+      error(0, errno, "unable to take over descriptor %d of process %d", IEXEC_LISTEN_FDS_START + i, *pid);
+      close(pidfd);
+      return -1;
+    }
+    if (getsockopt(config->upgrade_fds[i], SOL_SOCKET, SO_ACCEPTCONN, &listening, &size) < 0 || !listening) {
+      error(0, 0, "descriptor %d of process %d is no longer a listening socket", IEXEC_LISTEN_FDS_START + i, *pid);
+      close(pidfd);
+      return -1;
+    }
+  }
+  config->num_listen = num_fds;
+  if (config->verbose) {
+    fprintf(stderr, "%s: took over %ld sockets of process %d\n", program_invocation_name, num_fds, *pid);
+  }
+  return pidfd;
+}
+
+/**
+ * Changes the resource limits of the running process of --adjust-pid
+ * (or of the pid in --adjust-pid-file) to those of the --rlimit-*
+ * options with prlimit(2), so that eg RLIMIT_NOFILE of a daemon can be
+ * raised without restarting it. Limits are worked out as for a launch,
+ * from the process's own current limits. With -v, the old and new
+ * limits are printed.
+ *
+ * @param config The configuration with the limits and the process.
+ * @return       EXIT_SUCCESS if all limits were changed, otherwise
+ *               EXIT_FAILURE.
+ */
+int iexec_adjust_limits(const iexec_config *config) {
+  pid_t pid = config->adjust_pid;
+  if (config->adjust_pid_file != 0 && (pid = iexec_read_pid_file(config->adjust_pid_file)) == 0) {
+    return EXIT_FAILURE;
+  }
+
+  struct rlimit limits[RLIMIT_NLIMITS];
+  int limits_set[RLIMIT_NLIMITS];
+  int num_set = 0, status = EXIT_SUCCESS;
+  iexec_limits_prepare(config, pid, limits, limits_set);
+  for (int i = 0; i < RLIMIT_NLIMITS; i++) {
+    struct rlimit old_limit;
+    if (!limits_set[i]) {
+      continue;
+    }
+    num_set++;
+    if (prlimit(pid, i, &limits[i], &old_limit) < 0) {
+      char soft_value[32], hard_value[32];
+      error(0, errno, "unable to set %s of process %d to %s/%s", limit_names[i], pid,
+            iexec_format_rlimit(soft_value, sizeof(soft_value), limits[i].rlim_cur),
+            iexec_format_rlimit(hard_value, sizeof(hard_value), limits[i].rlim_max));
+      status = EXIT_FAILURE;
+    } else if (config->verbose) {
+      char values[4][32];
+      fprintf(stderr, "%s: %s of process %d changed from %s/%s to %s/%s\n", program_invocation_name,
+              limit_names[i], pid,
+              iexec_format_rlimit(values[0], sizeof(values[0]), old_limit.rlim_cur),
+              iexec_format_rlimit(values[1], sizeof(values[1]), old_limit.rlim_max),
+              iexec_format_rlimit(values[2], sizeof(values[2]), limits[i].rlim_cur),
+              iexec_format_rlimit(values[3], sizeof(values[3]), limits[i].rlim_max));
+    }
+  }
+  if (num_set == 0) {
+    error(0, 0, "no --rlimit-* options given to change the limits of process %d with", pid);
+    return EXIT_FAILURE;
+  }
+  return status;
+}
+
+int iexec_run(int argc, char **argv, pid_t *pid);
+
+/**
+ * Tells whether a command line starts a launch server (--server), which
+ * is run rather than forwarded to one.
+ */
+int iexec_is_server_command(int argc, char **argv) {
+  for (int i = 1; i < argc && strcmp(argv[i], "--") != 0; i++) {
+    if (strcmp(argv[i], "--server") == 0 || strncmp(argv[i], "--server=", 9) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Sends the command line to the launch server listening on a socket
+ * (see iexec-server.h) and exits with the status it replies with. The
+ * server launches the program in iexec's working directory, with its
+ * environment, umask and standard streams.
+ *
+ * Returns only if no server listens on the socket, so that iexec
+ * launches the program itself.
+ *
+ * @param path   The socket of the server (IEXEC_SERVER).
+ * @param argc   The number of arguments, including the program name.
+ * @param argv   The arguments.
+ */
+void iexec_forward(const char *path, int argc, char **argv) {
+  struct sockaddr_un address;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    error(0, 0, "the launch server socket `%s' has too long a name", path);
+    exit(EXIT_FAILURE);
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  int server_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (server_fd < 0 || connect(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    if (errno == ENOENT || errno == ECONNREFUSED) {
+      close(server_fd);
+      return;
+    }
+    error(0, errno, "unable to connect to the launch server `%s'", path);
+    exit(EXIT_FAILURE);
+  }
+
+  /** Lay out the request: the header, the arguments and the environment. */
+  size_t size = sizeof(iexec_server_request);
+  int envc = 0;
+  for (int i = 0; i < argc; i++) {
+    size += strlen(argv[i]) + 1;
+  }
+  for (; environ[envc] != 0; envc++) {
+    size += strlen(environ[envc]) + 1;
+  }
+  if (size > IEXEC_SERVER_MAX_REQUEST) {
+    error(0, 0, "the command line and environment are too large for the launch server");
+    exit(EXIT_FAILURE);
+  }
+  char *message = malloc(size);
+  if (message == 0) {
+    error(0, errno, "malloc failed");
+    exit(EXIT_FAILURE);
+  }
+  iexec_server_request *request = (iexec_server_request *)message;
+  mode_t mask = umask(0);
+  umask(mask);
+  request->magic = IEXEC_SERVER_MAGIC;
+  request->version = IEXEC_SERVER_VERSION;
+  request->argc = argc;
+  request->envc = envc;
+  request->umask = mask;
+  request->reserved = 0;
+  char *p = message + sizeof(iexec_server_request);
+  for (int i = 0; i < argc; i++) {
+    p = stpcpy(p, argv[i]) + 1;
+  }
+  for (int i = 0; i < envc; i++) {
+    p = stpcpy(p, environ[i]) + 1;
+  }
+
+  /** Send the working directory and the standard streams with it; a
+      closed stream is sent as /dev/null. */
+  int fds[IEXEC_SERVER_NUM_FDS];
+  fds[IEXEC_SERVER_FD_CWD] = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+  if (fds[IEXEC_SERVER_FD_CWD] < 0) {
+    error(0, errno, "unable to open the working directory");
+    exit(EXIT_FAILURE);
+  }
+  for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+    fds[IEXEC_SERVER_FD_STDIN + fd] = fcntl(fd, F_GETFD) < 0 ? open("/dev/null", O_RDWR | O_CLOEXEC) : fd;
+  }
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = message, .iov_len = size };
+  struct msghdr header = { .msg_iov = &iov, .msg_iovlen = 1,
+                           .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (sendmsg(server_fd, &header, MSG_NOSIGNAL) < 0) {
+    error(0, errno, "unable to send the launch request to `%s'", path);
+    exit(EXIT_FAILURE);
+  }
+
+  /** Wait for the reply. Without one, the server has already told why
+      on standard error. */
+  iexec_server_reply reply;
+  ssize_t n;
+  while ((n = recv(server_fd, &reply, sizeof(reply), 0)) < 0 && errno == EINTR) {
+  }
+  if (n != sizeof(reply)) {
+    exit(EXIT_FAILURE);
+  }
+  exit(reply.status);
+}
+
+/**
+ * Replies to the client of a worker of the launch server with the exit
+ * status and the pid (and a pidfd) of the program, once. The standard
+ * streams are flushed first, so the client has all of the output when
+ * it gets the reply.
+ *
+ * @param status The exit status iexec would have exited with.
+ * @param pid    The pid of the program, or 0.
+ */
+void iexec_server_reply_to_client(int status, pid_t pid) {
+  if (iexec_server_client_fd < 0 || getpid() != iexec_server_worker_pid) {
+    return;
+  }
+  fflush(0);
+  iexec_server_reply reply;
+  reply.status = status;
+  reply.pid = pid;
+  int pidfd = pid > 0 ? pidfd_open(pid, 0) : -1;
+  union {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = &reply, .iov_len = sizeof(reply) };
+  struct msghdr header = { .msg_iov = &iov, .msg_iovlen = 1 };
+  if (pidfd >= 0) {
+    header.msg_control = control.buffer;
+    header.msg_controllen = sizeof(control.buffer);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pidfd, sizeof(int));
+  }
+  sendmsg(iexec_server_client_fd, &header, MSG_NOSIGNAL);
+  close(iexec_server_client_fd);
+  iexec_server_client_fd = -1;
+}
+
+/**
+ * Replies to the client when iexec_run() exits a worker of the launch
+ * server, as on --help, --version or an error in the options, with the
+ * status it exits with.
+ */
+void iexec_server_worker_exited(int status, void *arg) {
+  iexec_server_reply_to_client(status, 0);
+}
+
+/**
+ * Serves one launch request in a worker of the launch server: accepts a
+ * connection, takes on the working directory, standard streams,
+ * environment and umask of the client, runs its command line as iexec
+ * would and replies with the exit status and the pid (and a pidfd) of
+ * the program, also when iexec_run() exits. Error messages go to the
+ * client's standard error. Never returns.
+ *
+ * @param listen_fd  The socket of the server.
+ * @param channel_fd The worker's end of the channel to the server, told
+ *                   when a connection is accepted and (see
+ *                   iexec_lookup_user()) of the users looked up.
+ * @param server_pid The pid of the server.
+ */
+void iexec_server_worker(int listen_fd, int channel_fd, pid_t server_pid) {
+  int client_fd;
+
+  /** A worker still waiting goes when the server does; one serving a
+      request finishes it. */
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGINT, SIG_DFL);
+  signal(SIGCHLD, SIG_DFL);
+  prctl(PR_SET_PDEATHSIG, SIGTERM, 0, 0, 0);
+  if (getppid() != server_pid) {
+    _exit(EXIT_FAILURE);
+  }
+  while ((client_fd = accept4(listen_fd, 0, 0, SOCK_CLOEXEC)) < 0 && errno == EINTR) {
+  }
+  if (client_fd < 0) {
+    error(0, errno, "unable to accept a launch request");
+    _exit(EXIT_FAILURE);
+  }
+  prctl(PR_SET_PDEATHSIG, 0, 0, 0, 0);
+  send(channel_fd, "A", 1, MSG_NOSIGNAL);
+  close(listen_fd);
+
+  /** Only the server's own user (or root) may launch programs as it. */
+  struct ucred peer;
+  socklen_t peer_len = sizeof(peer);
+  if (getsockopt(client_fd, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) < 0
+      || (peer.uid != 0 && peer.uid != geteuid())) {
+    error(0, 0, "refusing a launch request of uid %d", (int)peer.uid);
+    _exit(EXIT_FAILURE);
+  }
+
+  char *message = malloc(IEXEC_SERVER_MAX_REQUEST + 1);
+  if (message == 0) {
+    error(0, errno, "malloc failed");
+    _exit(EXIT_FAILURE);
+  }
+  int fds[IEXEC_SERVER_NUM_FDS];
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = message, .iov_len = IEXEC_SERVER_MAX_REQUEST };
+  struct msghdr header = { .msg_iov = &iov, .msg_iovlen = 1,
+                           .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+  ssize_t n;
+  while ((n = recvmsg(client_fd, &header, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+  }
+  /** A client hanging up without a request, as another --server probing
+      the socket does, is not an error. */
+  if (n == 0) {
+    _exit(EXIT_SUCCESS);
+  }
+  struct cmsghdr *cmsg = n > 0 ? CMSG_FIRSTHDR(&header) : 0;
+  const iexec_server_request *request = (const iexec_server_request *)message;
+  if (n < (ssize_t)sizeof(iexec_server_request) || (header.msg_flags & (MSG_TRUNC | MSG_CTRUNC))
+      || cmsg == 0 || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))
+      || request->magic != IEXEC_SERVER_MAGIC || request->version != IEXEC_SERVER_VERSION
+      || request->argc < 1 || request->argc > IEXEC_SERVER_MAX_REQUEST || request->envc > IEXEC_SERVER_MAX_REQUEST) {
+    error(0, n < 0 ? errno : 0, "invalid launch request");
+    _exit(EXIT_FAILURE);
+  }
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+
+  /** Split the arguments and the environment, which are NUL-terminated. */
+  message[n] = 0;
+  char **strings = malloc(sizeof(char *) * (request->argc + request->envc + 2));
+  if (strings == 0) {
+    error(0, errno, "malloc failed");
+    _exit(EXIT_FAILURE);
+  }
+  char *p = message + sizeof(iexec_server_request), *end = message + n;
+  for (uint32_t i = 0; i < request->argc + request->envc; i++) {
+    if (p >= end) {
+      error(0, 0, "invalid launch request");
+      _exit(EXIT_FAILURE);
+    }
+    strings[i + (i >= request->argc)] = p;
+    p += strlen(p) + 1;
+  }
+  strings[request->argc] = 0;
+  strings[request->argc + request->envc + 1] = 0;
+
+  /** Take on what iexec would have inherited from the client. */
+  if (fchdir(fds[IEXEC_SERVER_FD_CWD]) < 0) {
+    error(0, errno, "unable to change to the working directory of the launch request");
+    _exit(EXIT_FAILURE);
+  }
+  for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++) {
+    dup2(fds[IEXEC_SERVER_FD_STDIN + fd], fd);
+  }
+  for (int i = 0; i < IEXEC_SERVER_NUM_FDS; i++) {
+    close(fds[i]);
+  }
+  environ = strings + request->argc + 1;
+  umask(request->umask);
+  iexec_server_channel_fd = channel_fd;
+  iexec_server_client_fd = client_fd;
+  iexec_server_worker_pid = getpid();
+  on_exit(iexec_server_worker_exited, 0);
+
+  /** getopt_long() starts over when optind is 0. */
+  optind = 0;
+  pid_t pid = 0;
+  int status = iexec_run(request->argc, strings, &pid);
+  iexec_server_reply_to_client(status, pid);
+  exit(EXIT_SUCCESS);
+}
+
+/** How many workers of the launch server wait for requests. */
+#define IEXEC_SERVER_WORKERS 2
+
+/** A worker of the launch server. */
+typedef struct iexec_server_worker_state {
+  pid_t pid;            /** Its pid. */
+  int waiting;          /** Non-zero until it accepts a request. */
+} iexec_server_worker_state;
+
+/** Set by SIGTERM and SIGINT to stop the launch server. */
+volatile sig_atomic_t iexec_server_stopping = 0;
+
+/**
+ * Stops the launch server (a SIGTERM and SIGINT handler).
+ */
+void iexec_server_stop(int signum) {
+  iexec_server_stopping = 1;
+}
+
+/**
+ * Runs the launch server of --server, the zygote of its workers. It has
+ * paid for what an iexec execution does before launching (loading,
+ * dynamic linking, NSS initialization) once, and keeps a worker forked
+ * from it waiting for the next request (see iexec_server_worker()), so
+ * that a request costs neither an execve() nor a fork(). Once a worker
+ * accepts a request, the next one is forked. Users looked up by the
+ * workers are cached for the workers forked later. Runs until SIGTERM
+ * or SIGINT, then removes the socket.
+ *
+ * Returns the exit status for iexec.
+ *
+ * @param config The configuration with the socket (config->server).
+ */
+int iexec_serve(const iexec_config *config) {
+  const char *path = config->server;
+  struct sockaddr_un address;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    error(0, 0, "the launch server socket `%s' has too long a name", path);
+    return EXIT_FAILURE;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+
+  /** A stale socket of a server that is gone, which refuses connections,
+      is replaced, but not that of a server still serving on it. The
+      socket is only accessible by the server's user. */
+  struct stat path_stat;
+  if (lstat(path, &path_stat) == 0 && S_ISSOCK(path_stat.st_mode)) {
+    int probe_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (probe_fd < 0) {
+      error(0, errno, "unable to listen on `%s'", path);
+      return EXIT_FAILURE;
+    }
+    int refused = connect(probe_fd, (struct sockaddr *)&address, sizeof(address)) < 0 && errno == ECONNREFUSED;
+    close(probe_fd);
+    if (!refused) {
+      error(0, 0, "a launch server is already serving on `%s'", path);
+      return EXIT_FAILURE;
+    }
+    unlink(path);
+  }
+  int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  mode_t mask = umask(077);
+  if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) < 0
+      || listen(listen_fd, SOMAXCONN) < 0) {
+    error(0, errno, "unable to listen on `%s'", path);
+    umask(mask);
+    return EXIT_FAILURE;
+  }
+  umask(mask);
+
+  /** Load the NSS modules before forking workers. */
+  getpwnam("root");
+  endpwent();
+
+  struct sigaction stop;
+  memset(&stop, 0, sizeof(stop));
+  stop.sa_handler = iexec_server_stop;
+  sigaction(SIGTERM, &stop, 0);
+  sigaction(SIGINT, &stop, 0);
+  /** Finished workers are reaped by the kernel. */
+  signal(SIGCHLD, SIG_IGN);
+
+  /** The channels of the workers, and for each its pid and whether it
+      is still waiting for a request. */
+  struct pollfd *channels = 0;
+  iexec_server_worker_state *workers = 0;
+  int num_channels = 0, num_waiting = 0, status = EXIT_SUCCESS;
+  pid_t server_pid = getpid();
+  while (!iexec_server_stopping) {
+    /** Keep IEXEC_SERVER_WORKERS workers waiting for requests, but fork
+        while requests are served only if none is left, so that forks do
+        not compete with them. */
+    while (num_waiting < IEXEC_SERVER_WORKERS && (num_waiting == 0 || num_waiting == num_channels)) {
+      int channel[2];
+      struct pollfd *temp_channels = realloc(channels, sizeof(struct pollfd) * (num_channels + 1));
+      if (temp_channels != 0) {
+        channels = temp_channels;
+      }
+      iexec_server_worker_state *temp_workers = realloc(workers, sizeof(iexec_server_worker_state) * (num_channels + 1));
+      if (temp_workers != 0) {
+        workers = temp_workers;
+      }
+      if (temp_channels == 0 || temp_workers == 0
+          || socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, channel) < 0) {
+        error(0, errno, "unable to create a worker channel");
+        status = EXIT_FAILURE;
+        iexec_server_stopping = 1;
+        break;
+      }
+      pid_t worker_pid = fork();
+      if (worker_pid < 0) {
+        error(0, errno, "unable to fork a worker");
+        status = EXIT_FAILURE;
+        iexec_server_stopping = 1;
+        break;
+      }
+      if (worker_pid == 0) {
+        for (int i = 0; i < num_channels; i++) {
+          close(channels[i].fd);
+        }
+        close(channel[0]);
+        iexec_server_worker(listen_fd, channel[1], server_pid);
+      }
+      close(channel[1]);
+      channels[num_channels].fd = channel[0];
+      channels[num_channels].events = POLLIN;
+      workers[num_channels].pid = worker_pid;
+      workers[num_channels].waiting = 1;
+      num_channels++;
+      num_waiting++;
+    }
+    if (iexec_server_stopping) {
+      break;
+    }
+
+    if (poll(channels, num_channels, -1) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      error(0, errno, "poll failed");
+      status = EXIT_FAILURE;
+      break;
+    }
+    int j = 0;
+    for (int i = 0; i < num_channels; i++) {
+      if (channels[i].revents != 0) {
+        char message[1 + sizeof(uid_t) + 256];
+        ssize_t n = recv(channels[i].fd, message, sizeof(message), MSG_DONTWAIT);
+        if (n == 1 && message[0] == 'A' && workers[i].waiting) {
+          workers[i].waiting = 0;
+          num_waiting--;
+        } else if (n > (ssize_t)(1 + sizeof(uid_t)) && message[0] == 'U') {
+          iexec_cached_user *temp_cache = realloc(iexec_user_cache, sizeof(iexec_cached_user) * (iexec_num_cached_users + 1));
+          char *name = strndup(message + 1 + sizeof(uid_t), n - 1 - sizeof(uid_t));
+          if (temp_cache != 0 && name != 0) {
+            iexec_user_cache = temp_cache;
+            iexec_user_cache[iexec_num_cached_users].name = name;
+            memcpy(&iexec_user_cache[iexec_num_cached_users].uid, message + 1, sizeof(uid_t));
+            iexec_num_cached_users++;
+          }
+        } else if (n <= 0 && (n == 0 || (errno != EAGAIN && errno != EINTR))) {
+          /** A worker that exits before accepting a request cannot
+              accept any. */
+          if (workers[i].waiting) {
+            error(0, 0, "a worker exited before accepting a request");
+            status = EXIT_FAILURE;
+            iexec_server_stopping = 1;
+            num_waiting--;
+          }
+          close(channels[i].fd);
+          continue;
+        }
+      }
+      channels[j] = channels[i];
+      workers[j++] = workers[i];
+    }
+    num_channels = j;
+  }
+
+  for (int i = 0; i < num_channels; i++) {
+    if (workers[i].waiting) {
+      kill(workers[i].pid, SIGTERM);
+    }
+  }
+  unlink(path);
+  close(listen_fd);
+  return status;
+}
+
+/**
+ * Does what one invocation of iexec does with its command line: parses
+ * the options and launches the program (or its instances), runs a
+ * batch, changes the limits of a running process or serves launch
+ * requests. Exits on errors in the options.
+ *
+ * Returns the exit status for iexec.
+ *
+ * @param argc   The number of arguments, including the program name.
+ * @param argv   The arguments.
+ * @param pid    If not 0, set to the pid of the first program launched
+ *               (0 if none was, or a monitor launched it).
+ */
+int iexec_run(int argc, char **argv, pid_t *pid) {
+  iexec_program *programs = 0;    /* The program (or its instances) to launch. */
+  int num_programs = 0;           /* The number of programs. */
+  iexec_config config;            /* The configuration. */
+  int exit_status;                /* The exit status with -n. */
+  pid_t upgraded = 0;             /* The program replaced with --upgrade. */
+  int upgraded_pidfd = -1;        /* A pidfd of that program. */
+
+  /** Parse the options into the configuration. */
+  iexec_trace_origin = iexec_trace_ns();
+  parse_options(argc, argv, &config);
+  iexec_trace(&config, "parse_options", iexec_trace_origin);
+
+  /** With --compile-profiles, the profiles are compiled instead. */
+  if (config.compile_profiles != 0) {
+    if (config.remaining_argc != 0) {
+      error(0, 0, "a program cannot be given with --compile-profiles");
+      return EXIT_FAILURE;
+    }
+    return iexec_compile_profiles(config.compile_profiles);
+  }
+
+  /** With --batch, the programs come from the manifest. */
+  if (config.batch_file != 0) {
+    if (config.remaining_argc != 0) {
+      error(0, 0, "a program cannot be given with --batch");
+      return EXIT_FAILURE;
+    }
+    return iexec_run_batch(&config);
+  }
+
+  /** With --adjust-pid, the limits of a running process are changed
+      instead. */
+  if (config.adjust_pid != 0 || config.adjust_pid_file != 0) {
+    if (config.remaining_argc != 0) {
+      error(0, 0, "a program cannot be given with --adjust-pid or --adjust-pid-file");
+      return EXIT_FAILURE;
+    }
+    return iexec_adjust_limits(&config);
+  }
+
+  /** With --stop, a running program is stopped instead. */
+  if (config.stop_pid_file != 0) {
+    if (config.remaining_argc != 0) {
+      error(0, 0, "a program cannot be given with --stop");
+      return EXIT_FAILURE;
+    }
+    return iexec_stop(&config);
+  }
+
+  /** With --server, launches are requested over a socket. */
+  if (config.server != 0) {
+    if (config.remaining_argc != 0 || iexec_server_channel_fd >= 0) {
+      error(0, 0, "a program cannot be given with --server, nor --server requested of a server");
+      return EXIT_FAILURE;
+    }
+    return iexec_serve(&config);
+  }
+
+  /** If there are no remaining arguments after the options, print an error,
+      and exit since a program must be provided. */
+  if (config.remaining_argc == 0) {
+    error(0, 0, "a program and its arguments are required!");
+    return EXIT_FAILURE;
+  }
+  if (config.after != 0 || config.requires != 0) {
+    error(0, 0, "--after and --requires name programs of a --batch manifest");
+    return EXIT_FAILURE;
+  }
+
+  /** With --upgrade, the new program takes over the sockets of the one
+      it replaces, which is stopped once the new one is ready. */
+  if (config.upgrade_pid_file != 0) {
+    if (config.no_daemonize || config.instances != 1) {
+      error(0, 0, "--upgrade replaces a single program in the background, not with -n or --instances");
+      return EXIT_FAILURE;
+    }
+    if (config.use_pid_file == 0) {
+      config.use_pid_file = config.upgrade_pid_file;
+    }
+    if (config.wait_ready < 0) {
+      config.wait_ready = 0;
+    }
+    upgraded_pidfd = iexec_upgrade_take_sockets(&config, &upgraded);
+    if (upgraded_pidfd < 0) {
+      return EXIT_FAILURE;
+    }
+    config.upgrade_pid = upgraded;
+  }
+
+  /** Validate the limits, look up the user and the working directory. */
+  iexec_add_programs(&programs, &num_programs, &config);
+  for (int i = 0; i < num_programs; i++) {
+    iexec_launch_prepare(&programs[i].config, &programs[i].launch);
+  }
+
+  if (iexec_start(programs, num_programs, &exit_status) > 0) {
+    exit_status = EXIT_FAILURE;
+  } else if (upgraded_pidfd >= 0) {
+    exit_status = iexec_stop_program(&config, upgraded, upgraded_pidfd, -1);
+  }
+  if (pid != 0) {
+    *pid = programs[0].launch.pid;
+  }
+  return exit_status;
+}
+
+/**
+ * The main function: forwards the command line to the launch server
+ * named by IEXEC_SERVER if there is one, or runs it.
+ */
+int main(int argc, char **argv) {
+  const char *server = getenv("IEXEC_SERVER");
+  if (server != 0 && server[0] != 0 && !iexec_is_server_command(argc, argv)) {
+    iexec_forward(server, argc, argv);
+  }
+  exit(iexec_run(argc, argv, 0));
 
   /** We should never get here but the compiler expects a return in main(). */
   return 0;
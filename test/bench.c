@@ -0,0 +1,564 @@
+/**
+ * Measures how fast iexec launches programs: launches per second and the
+ * p50/p99 latency from running iexec to iexec returning, which it does
+ * once the program was executed (or, with -s, once the monitor has
+ * launched it). Each scenario launches the test programs in this
+ * directory as payloads, opener for descriptor pressure and forker for
+ * process pressure, and kills them after every run.
+ *
+ * The server scenario makes the devnull launch through a launch server
+ * (iexec --server) that the iexec runs forward it to, and the protocol
+ * scenario sends it to the server directly as a job runner would, with
+ * the protocol of iexec-server.h, without running iexec.
+ *
+ * One more run of each scenario is traced with ptrace() to count the
+ * system calls a launched child makes up to and including its execve(),
+ * which must stay within the scenario's budget: the bench fails if one
+ * does not.
+ *
+ * Usage: bench [-n runs] [-c csv-file] [-j json-file] iexec test-dir
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <error.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ptrace.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "../src/iexec-server.h"
+
+extern char **environ;
+
+/** The most arguments a scenario passes to iexec. */
+#define BENCH_MAX_ARGS 256
+
+/** The descriptors the close scenario opens and closes with -c. */
+#define BENCH_NUM_CLOSE 64
+
+/** The programs the batch and instances scenarios launch per run. */
+#define BENCH_GROUP 8
+
+/** The most processes traced at once when counting system calls. */
+#define BENCH_MAX_TRACEES 64
+
+/**
+ * A scenario: the arguments given to iexec, where a word starting with
+ * @ is a path in the scratch directory, one starting with # a test
+ * program, and !close expands to -c for each of BENCH_NUM_CLOSE open
+ * descriptors.
+ */
+typedef struct bench_scenario {
+  const char *name;     /** The name in the results. */
+  int launches;         /** The programs launched per run. */
+  const char *pid_file; /** The pid file(s) in the scratch directory, with
+                            %d for the number of the program. */
+  int budget;           /** The most system calls a launched child may
+                            make, with the default vfork engine and the
+                            lean redirection (0 = not counted). */
+  const char *args[16]; /** The arguments (null-terminated). */
+} bench_scenario;
+
+const bench_scenario scenarios[] = {
+  {"devnull", 1, "p.pid", 9, {"-p", "@p.pid", "--", "#opener", "64", 0}},
+  {"files", 1, "p.pid", 12, {"-p", "@p.pid", "-o", "@out.log", "-e", "@err.log", "--", "#opener", "64", 0}},
+  {"status", 1, "p.pid", 0, {"-p", "@p.pid", "-s", "@p.status", "--", "#opener", "64", 0}},
+  {"close", 1, "p.pid", 73, {"-p", "@p.pid", "!close", "--", "#opener", "64", 0}},
+  {"forker", 1, "p.pid", 9, {"-p", "@p.pid", "--", "#forker", "16", 0}},
+  {"batch", BENCH_GROUP, "b.%d.pid", 9, {"--batch", "@manifest", 0}},
+  {"instances", BENCH_GROUP, "i.%d.pid", 9, {"--instances", "8", "-p", "@i.%i.pid", "--", "#opener", "64", 0}},
+  {"server", 1, "p.pid", 0, {"-p", "@p.pid", "--", "#opener", "64", 0}},
+  {"protocol", 1, "p.pid", 0, {"-p", "@p.pid", "--", "#opener", "64", 0}},
+};
+
+/**
+ * The results of a scenario.
+ */
+typedef struct bench_result {
+  const char *name;     /** The scenario. */
+  int runs;             /** The number of runs of iexec. */
+  int launches;         /** The number of programs launched. */
+  double seconds;       /** The time all runs took. */
+  double p50;           /** The median latency of a run (us). */
+  double p99;           /** The 99th percentile latency of a run (us). */
+  double min;           /** The lowest latency (us). */
+  double max;           /** The highest latency (us). */
+  int syscalls;         /** The most system calls a launched child made
+                            (-1 = not counted). */
+  int budget;           /** The scenario's budget for them. */
+} bench_result;
+
+/**
+ * Returns the time of the monotonic clock in nanoseconds.
+ */
+long long bench_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/**
+ * Returns a string made of two. Exits if out of memory.
+ */
+char *bench_concat(const char *a, const char *b) {
+  char *result = malloc(strlen(a) + strlen(b) + 1);
+  if (result == 0) {
+    error(EXIT_FAILURE, errno, "malloc failed");
+  }
+  strcpy(result, a);
+  strcat(result, b);
+  return result;
+}
+
+/**
+ * Kills the programs a run launched, and the processes they forked,
+ * which share their process group since iexec made them session
+ * leaders. Removes the pid files.
+ */
+void bench_kill(const bench_scenario *scenario, const char *scratch) {
+  for (int i = 0; i < scenario->launches; i++) {
+    char name[64], path[4096];
+    snprintf(name, sizeof(name), scenario->pid_file, i);
+    snprintf(path, sizeof(path), "%s%s", scratch, name);
+    FILE *pid_file = fopen(path, "r");
+    int pid;
+    if (pid_file == 0) {
+      continue;
+    }
+    if (fscanf(pid_file, "%d", &pid) == 1 && pid > 1) {
+      kill(-pid, SIGKILL);
+      kill(pid, SIGKILL);
+    }
+    fclose(pid_file);
+    unlink(path);
+  }
+}
+
+/**
+ * Runs iexec once under ptrace(), following every process it creates,
+ * and counts the system calls each makes from its creation until it
+ * executes a program. Launches by a monitor that outlives iexec (-s) are
+ * not followed.
+ *
+ * Returns the most system calls a launched child made, including its
+ * execve(), or -1 if tracing failed.
+ */
+int bench_count_syscalls(const char *iexec, char **argv) {
+  struct {
+    pid_t pid;
+    int syscalls;
+    int in_syscall;
+  } tracees[BENCH_MAX_TRACEES];
+  int num_tracees = 0, most = -1, status;
+
+  pid_t root = fork();
+  if (root < 0) {
+    return -1;
+  }
+  if (root == 0) {
+    ptrace(PTRACE_TRACEME, 0, 0, 0);
+    raise(SIGSTOP);
+    execv(iexec, argv);
+    _exit(127);
+  }
+  if (waitpid(root, &status, 0) < 0 || !WIFSTOPPED(status)
+      || ptrace(PTRACE_SETOPTIONS, root, 0, PTRACE_O_TRACESYSGOOD | PTRACE_O_TRACEEXEC
+                | PTRACE_O_TRACEFORK | PTRACE_O_TRACEVFORK | PTRACE_O_TRACECLONE) < 0) {
+    kill(root, SIGKILL);
+    return -1;
+  }
+  ptrace(PTRACE_SYSCALL, root, 0, 0);
+
+  /** The first execve() of the root is iexec itself. */
+  int root_execs = 0;
+  pid_t pid;
+  while ((pid = waitpid(-1, &status, __WALL)) > 0) {
+    int t = 0;
+    while (t < num_tracees && tracees[t].pid != pid) {
+      t++;
+    }
+    if (t == num_tracees) {
+      if (num_tracees == BENCH_MAX_TRACEES) {
+        error(EXIT_FAILURE, 0, "too many processes to trace");
+      }
+      tracees[num_tracees].pid = pid;
+      tracees[num_tracees].syscalls = 0;
+      tracees[num_tracees].in_syscall = 0;
+      num_tracees++;
+    }
+    if (!WIFSTOPPED(status)) {
+      tracees[t] = tracees[--num_tracees];
+      continue;
+    }
+    int signal = WSTOPSIG(status), event = status >> 16, deliver = 0;
+    if (signal == (SIGTRAP | 0x80)) {
+      tracees[t].in_syscall = !tracees[t].in_syscall;
+      tracees[t].syscalls += tracees[t].in_syscall;
+    } else if (signal == SIGTRAP && event == PTRACE_EVENT_EXEC) {
+      if (pid != root || root_execs++ > 0) {
+        if (tracees[t].syscalls > most) {
+          most = tracees[t].syscalls;
+        }
+        /** Let the program run untraced. */
+        ptrace(PTRACE_DETACH, pid, 0, 0);
+        tracees[t] = tracees[--num_tracees];
+        continue;
+      }
+    } else if (signal == SIGTRAP && event != 0) {
+      /** A fork, vfork or clone: the new process is traced already. */
+    } else if (signal != SIGSTOP || tracees[t].syscalls > 0) {
+      deliver = signal;
+    }
+    ptrace(PTRACE_SYSCALL, pid, 0, deliver);
+  }
+  return most;
+}
+
+/**
+ * Compares two latencies for qsort().
+ */
+int bench_compare(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return x < y ? -1 : x > y;
+}
+
+/**
+ * Sends a launch request to a launch server, as iexec with IEXEC_SERVER
+ * does, and waits for the reply. Exits on error.
+ *
+ * Returns the exit status iexec would have had.
+ *
+ * @param socket_path The socket of the server.
+ * @param argv        The command line of iexec (null-terminated).
+ * @param envp        The environment (null-terminated).
+ */
+int bench_request(const char *socket_path, char **argv, char **envp) {
+  static char message[IEXEC_SERVER_MAX_REQUEST];
+  iexec_server_request *request = (iexec_server_request *)message;
+  size_t length = sizeof(iexec_server_request);
+  request->magic = IEXEC_SERVER_MAGIC;
+  request->version = IEXEC_SERVER_VERSION;
+  request->argc = 0;
+  request->envc = 0;
+  request->umask = 022;
+  request->reserved = 0;
+  for (char **strings = argv; strings != 0; strings = strings == argv ? envp : 0) {
+    for (int i = 0; strings[i] != 0; i++) {
+      size_t size = strlen(strings[i]) + 1;
+      if (length + size > sizeof(message)) {
+        error(EXIT_FAILURE, 0, "the launch request is too long");
+      }
+      memcpy(message + length, strings[i], size);
+      length += size;
+      if (strings == argv) {
+        request->argc++;
+      } else {
+        request->envc++;
+      }
+    }
+  }
+
+  struct sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  strncpy(address.sun_path, socket_path, sizeof(address.sun_path) - 1);
+  int server_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (server_fd < 0 || connect(server_fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    error(EXIT_FAILURE, errno, "unable to connect to `%s'", socket_path);
+  }
+  int fds[IEXEC_SERVER_NUM_FDS];
+  fds[IEXEC_SERVER_FD_CWD] = open(".", O_PATH | O_CLOEXEC);
+  fds[IEXEC_SERVER_FD_STDIN] = STDIN_FILENO;
+  fds[IEXEC_SERVER_FD_STDOUT] = STDOUT_FILENO;
+  fds[IEXEC_SERVER_FD_STDERR] = STDERR_FILENO;
+  union {
+    char buffer[CMSG_SPACE(sizeof(fds))];
+    struct cmsghdr align;
+  } control;
+  struct iovec iov = { .iov_base = message, .iov_len = length };
+  struct msghdr header = { .msg_iov = &iov, .msg_iovlen = 1,
+                           .msg_control = control.buffer, .msg_controllen = sizeof(control.buffer) };
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+  if (fds[IEXEC_SERVER_FD_CWD] < 0 || sendmsg(server_fd, &header, MSG_NOSIGNAL) < 0) {
+    error(EXIT_FAILURE, errno, "unable to send the launch request to `%s'", socket_path);
+  }
+  close(fds[IEXEC_SERVER_FD_CWD]);
+
+  /** The reply may carry a pidfd of the program, which is not needed. */
+  iexec_server_reply reply;
+  union {
+    char buffer[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+  } reply_control;
+  iov.iov_base = &reply;
+  iov.iov_len = sizeof(reply);
+  header.msg_control = reply_control.buffer;
+  header.msg_controllen = sizeof(reply_control.buffer);
+  ssize_t n;
+  while ((n = recvmsg(server_fd, &header, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+  }
+  close(server_fd);
+  if (n != sizeof(reply)) {
+    return EXIT_FAILURE;
+  }
+  cmsg = CMSG_FIRSTHDR(&header);
+  if (cmsg != 0 && cmsg->cmsg_type == SCM_RIGHTS) {
+    int pidfd;
+    memcpy(&pidfd, CMSG_DATA(cmsg), sizeof(int));
+    close(pidfd);
+  }
+  return reply.status;
+}
+
+/**
+ * Runs a scenario.
+ *
+ * @param scenario The scenario.
+ * @param runs     How many times to run iexec.
+ * @param iexec    The iexec to measure.
+ * @param test_dir Where the test programs are.
+ * @param scratch  The scratch directory, ending in /.
+ * @param result   Set to the results.
+ */
+void bench_run(const bench_scenario *scenario, int runs, const char *iexec,
+               const char *test_dir, const char *scratch, bench_result *result) {
+  char *argv[BENCH_MAX_ARGS];
+  int close_fds[BENCH_NUM_CLOSE];
+  int argc = 0;
+
+  argv[argc++] = (char *)iexec;
+  for (int i = 0; scenario->args[i] != 0; i++) {
+    const char *arg = scenario->args[i];
+    if (strcmp(arg, "!close") == 0) {
+      /** Inherited by iexec, which closes them in the child. */
+      for (int j = 0; j < BENCH_NUM_CLOSE; j++) {
+        char fd[16];
+        close_fds[j] = open("/dev/null", O_RDONLY);
+        snprintf(fd, sizeof(fd), "%d", close_fds[j]);
+        argv[argc++] = "-c";
+        argv[argc++] = strdup(fd);
+      }
+    } else if (arg[0] == '@') {
+      argv[argc++] = bench_concat(scratch, arg + 1);
+    } else if (arg[0] == '#') {
+      argv[argc++] = bench_concat(test_dir, arg);
+      argv[argc - 1][strlen(test_dir)] = '/';
+    } else {
+      argv[argc++] = (char *)arg;
+    }
+  }
+  argv[argc] = 0;
+
+  if (strcmp(scenario->name, "batch") == 0) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%smanifest", scratch);
+    FILE *manifest = fopen(path, "w");
+    if (manifest == 0) {
+      error(EXIT_FAILURE, errno, "unable to write `%s'", path);
+    }
+    for (int i = 0; i < scenario->launches; i++) {
+      fprintf(manifest, "pid=%sb.%d.pid -- %s/opener 64\n", scratch, i, test_dir);
+    }
+    fclose(manifest);
+  }
+
+  char **envp = environ;
+  pid_t server_pid = -1;
+  int protocol = strcmp(scenario->name, "protocol") == 0;
+  char *socket_path = bench_concat(scratch, "server.sock");
+  if (strcmp(scenario->name, "server") == 0 || protocol) {
+    char *server_argv[] = {(char *)iexec, "--server", socket_path, 0};
+    int err = posix_spawn(&server_pid, iexec, 0, 0, server_argv, environ);
+    if (err != 0) {
+      error(EXIT_FAILURE, err, "unable to run `%s --server'", iexec);
+    }
+    /** Without the socket, iexec would launch the program itself. */
+    for (int tries = 0; access(socket_path, F_OK) < 0; tries++) {
+      struct timespec delay = {0, 10000000};
+      if (tries == 500) {
+        error(EXIT_FAILURE, 0, "the launch server did not start");
+      }
+      nanosleep(&delay, 0);
+    }
+    int num_vars = 0;
+    while (environ[num_vars] != 0) {
+      num_vars++;
+    }
+    envp = malloc(sizeof(char *) * (num_vars + 2));
+    if (envp == 0) {
+      error(EXIT_FAILURE, errno, "malloc failed");
+    }
+    memcpy(envp, environ, sizeof(char *) * num_vars);
+    envp[num_vars] = bench_concat("IEXEC_SERVER=", socket_path);
+    envp[num_vars + 1] = 0;
+  }
+
+  double *latencies = malloc(sizeof(double) * runs);
+  if (latencies == 0) {
+    error(EXIT_FAILURE, errno, "malloc failed");
+  }
+  long long total = 0;
+  for (int run = 0; run < runs; run++) {
+    pid_t pid;
+    int status, failed;
+    long long start = bench_now_ns();
+    if (protocol) {
+      failed = bench_request(socket_path, argv, environ) != EXIT_SUCCESS;
+    } else {
+      int err = posix_spawn(&pid, iexec, 0, 0, argv, envp);
+      if (err != 0) {
+        error(EXIT_FAILURE, err, "unable to run `%s'", iexec);
+      }
+      while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+      }
+      failed = !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    long long end = bench_now_ns();
+    if (failed) {
+      error(EXIT_FAILURE, 0, "iexec failed in scenario `%s'", scenario->name);
+    }
+    latencies[run] = (end - start) / 1000.0;
+    total += end - start;
+    bench_kill(scenario, scratch);
+  }
+
+  result->syscalls = -1;
+  result->budget = scenario->budget;
+  if (scenario->budget > 0) {
+    result->syscalls = bench_count_syscalls(iexec, argv);
+    bench_kill(scenario, scratch);
+  }
+
+  if (server_pid > 0) {
+    kill(server_pid, SIGTERM);
+    waitpid(server_pid, 0, 0);
+  }
+  if (strcmp(scenario->name, "close") == 0) {
+    for (int j = 0; j < BENCH_NUM_CLOSE; j++) {
+      close(close_fds[j]);
+    }
+  }
+  qsort(latencies, runs, sizeof(double), bench_compare);
+  result->name = scenario->name;
+  result->runs = runs;
+  result->launches = runs * scenario->launches;
+  result->seconds = total / 1e9;
+  result->p50 = latencies[(runs - 1) * 50 / 100];
+  result->p99 = latencies[(runs - 1) * 99 / 100];
+  result->min = latencies[0];
+  result->max = latencies[runs - 1];
+  free(latencies);
+}
+
+/**
+ * Writes the results as CSV, with a header line.
+ */
+void bench_write_csv(FILE *out, const bench_result *results, int num_results) {
+  fprintf(out, "scenario,runs,launches,seconds,launches_per_second,p50_us,p99_us,min_us,max_us,syscalls,syscall_budget\n");
+  for (int i = 0; i < num_results; i++) {
+    const bench_result *r = &results[i];
+    fprintf(out, "%s,%d,%d,%.6f,%.1f,%.1f,%.1f,%.1f,%.1f,%d,%d\n", r->name, r->runs, r->launches,
+            r->seconds, r->launches / r->seconds, r->p50, r->p99, r->min, r->max,
+            r->syscalls, r->budget);
+  }
+}
+
+/**
+ * Writes the results as a JSON array of objects.
+ */
+void bench_write_json(FILE *out, const bench_result *results, int num_results) {
+  fprintf(out, "[\n");
+  for (int i = 0; i < num_results; i++) {
+    const bench_result *r = &results[i];
+    fprintf(out, "  {\"scenario\": \"%s\", \"runs\": %d, \"launches\": %d, \"seconds\": %.6f, "
+            "\"launches_per_second\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+            "\"min_us\": %.1f, \"max_us\": %.1f, \"syscalls\": %d, \"syscall_budget\": %d}%s\n",
+            r->name, r->runs, r->launches, r->seconds, r->launches / r->seconds, r->p50, r->p99,
+            r->min, r->max, r->syscalls, r->budget, i + 1 < num_results ? "," : "");
+  }
+  fprintf(out, "]\n");
+}
+
+/**
+ * Writes the results to a file, or to standard output for -.
+ */
+void bench_write(const char *path, void (*write_results)(FILE *, const bench_result *, int),
+                 const bench_result *results, int num_results) {
+  FILE *out = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+  if (out == 0) {
+    error(EXIT_FAILURE, errno, "unable to write `%s'", path);
+  }
+  write_results(out, results, num_results);
+  if (out != stdout) {
+    fclose(out);
+  }
+}
+
+int main(int argc, char **argv) {
+  int runs = 200;
+  const char *csv_path = "-", *json_path = 0;
+  int c;
+  while ((c = getopt(argc, argv, "n:c:j:")) != -1) {
+    switch (c) {
+    case 'n':
+      runs = atoi(optarg);
+      break;
+    case 'c':
+      csv_path = optarg;
+      break;
+    case 'j':
+      json_path = optarg;
+      break;
+    default:
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (argc - optind != 2 || runs < 1) {
+    error(EXIT_FAILURE, 0, "usage: bench [-n runs] [-c csv-file] [-j json-file] iexec test-dir");
+  }
+  const char *iexec = argv[optind], *test_dir = argv[optind + 1];
+
+  char scratch_dir[] = "/tmp/iexec-bench.XXXXXX";
+  if (mkdtemp(scratch_dir) == 0) {
+    error(EXIT_FAILURE, errno, "mkdtemp() failed");
+  }
+  char *scratch = bench_concat(scratch_dir, "/");
+
+  int num_scenarios = sizeof(scenarios) / sizeof(scenarios[0]);
+  bench_result results[sizeof(scenarios) / sizeof(scenarios[0])];
+  for (int i = 0; i < num_scenarios; i++) {
+    bench_run(&scenarios[i], runs, iexec, test_dir, scratch, &results[i]);
+  }
+
+  bench_write(csv_path, bench_write_csv, results, num_scenarios);
+  if (json_path != 0) {
+    bench_write(json_path, bench_write_json, results, num_scenarios);
+  }
+
+  int over_budget = 0;
+  for (int i = 0; i < num_scenarios; i++) {
+    if (results[i].budget > 0 && results[i].syscalls < 0) {
+      error(0, 0, "unable to count the system calls of scenario `%s' (is ptrace() permitted?)", results[i].name);
+    } else if (results[i].budget > 0 && results[i].syscalls > results[i].budget) {
+      error(0, 0, "scenario `%s' made %d system calls per launch, over its budget of %d",
+            results[i].name, results[i].syscalls, results[i].budget);
+      over_budget = 1;
+    }
+  }
+
+  char command[4096];
+  snprintf(command, sizeof(command), "rm -rf '%s'", scratch_dir);
+  return system(command) == 0 && !over_budget ? EXIT_SUCCESS : EXIT_FAILURE;
+}